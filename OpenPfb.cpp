@@ -1,7 +1,27 @@
 #include "OpenPfb.h"
+#include "OpenPfbBswap.h"
+#include "OpenPfbThreads.h"
+#include "OpenPfbTrace.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+
+#include <pthread.h>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using std::auto_ptr;
 using std::string;
+using std::vector;
 
 const char *OpenPfb_GetVersion()
 {
@@ -11,7 +31,9 @@ const char *OpenPfb_GetVersion()
 namespace openpfb
 {
 FILE *debugfile = NULL;
-static bool  needBswap = false;
+
+/// Read buffer of the files that are not mapped
+#define PFB_READ_BUFFER (256*1024)
 
 //
 // UTILS
@@ -21,6 +43,7 @@ struct PfbString
 {
     uint32_t length;
     char    *str; // strlen(str) = length
+    char     buffer[64]; // storage of short strings
 
     PfbString();
     ~PfbString();
@@ -33,134 +56,299 @@ struct PfbNodeEnd
     PfbString name;
 };
             
+// STRING
+
+PfbString::PfbString() : length(0), str(NULL) {}
 
-static void bswap(uint32_t *array, uint32_t size = 1)
+PfbString::~PfbString()
 {
-    if (!needBswap) return;
+    if (str && str != buffer) delete[] str;
+}
 
-    for (unsigned i=0; i<size; ++i)
+// LAZY LISTS
+
+#define PFBLAZY_PENDING 0
+#define PFBLAZY_LOADING 1
+#define PFBLAZY_READY   2
+
+/// Hold a mutex for the lifetime of the object
+class PfbScopedLock
+{
+    public:
+        PfbScopedLock(pthread_mutex_t &mutex) : mutex(mutex) { pthread_mutex_lock(&mutex); }
+        ~PfbScopedLock() { pthread_mutex_unlock(&mutex); }
+
+    private:
+        pthread_mutex_t &mutex;
+
+        PfbScopedLock(const PfbScopedLock &);
+        PfbScopedLock &operator=(const PfbScopedLock &);
+};
+
+/// Where to find the lists of a PFBLOAD_LAZY tree
+struct PfbLazyLists
+{
+    PfbSource  *source;    // data read from source, or
+    bool        ownSource;
+    const char *mapData;   // the mapped data
+    size_t      mapSize;
+    bool        needBswap;
+    uint64_t    size;      // of the data, lists never go past it
+
+    vector<long>          offsets[PfbTree::NUM_LIST_KINDS];
+    vector<unsigned char> states[PfbTree::NUM_LIST_KINDS]; // PFBLAZY_*
+
+    pthread_mutex_t mutex; // protects the tree arena, and waiting for lists
+    pthread_cond_t  ready;
+
+    PfbLazyLists(PfbSource *source, bool ownSource, const char *mapData, size_t mapSize, bool needBswap)
+        : source(source), ownSource(ownSource), mapData(mapData), mapSize(mapSize), needBswap(needBswap)
+        , size(mapSize)
     {
-        union bswap_union
-        {
-            uint32_t u32;
-            uint8_t  u8[4];
-        };
-        bswap_union input;
-        bswap_union output;
-        
-        input.u32 = array[i];
-        
-        output.u8[0] = input.u8[3];
-        output.u8[1] = input.u8[2];
-        output.u8[2] = input.u8[1];
-        output.u8[3] = input.u8[0];
+        if (source) size = source->getSize();
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&ready, NULL);
+    }
 
-        array[i] = output.u32;
+    ~PfbLazyLists()
+    {
+        if (ownSource) delete source;
+        pthread_mutex_destroy(&mutex);
+        pthread_cond_destroy(&ready);
+    }
+
+    bool read(void *dst, long offset, size_t bytes)
+    {
+        if (offset < 0 || offset + bytes > size) return false;
+        if (mapData) {
+            memcpy(dst, mapData + offset, bytes);
+            return true;
+        }
+        return source->read(dst, bytes, offset) == bytes;
     }
+};
+
+/// Mark a list ready and wake up its waiters when going out of scope,
+/// whether its decoding succeeded, failed or threw
+class PfbLazyPublisher
+{
+    public:
+        PfbLazyPublisher(PfbLazyLists &lazy, unsigned char *state) : lazy(lazy), state(state) {}
+        ~PfbLazyPublisher()
+        {
+            PfbScopedLock lock(lazy.mutex);
+            __atomic_store_n(state, PFBLAZY_READY, __ATOMIC_RELEASE);
+            pthread_cond_broadcast(&lazy.ready);
+        }
+
+    private:
+        PfbLazyLists  &lazy;
+        unsigned char *state;
+
+        PfbLazyPublisher(const PfbLazyPublisher &);
+        PfbLazyPublisher &operator=(const PfbLazyPublisher &);
+};
+
+// ARENA
+
+/// Size of the arena chunks, unless a bigger block is reserved
+#define PFB_ARENA_CHUNK (256*1024)
+
+PfbArena::PfbArena() : current(NULL), left(0), used(0), allocations(0) {}
+
+PfbArena::~PfbArena()
+{
+    for (unsigned i=0; i<chunks.size(); ++i)
+        free(chunks[i]);
 }
-static void bswap(int32_t *array, uint32_t size = 1) { bswap((uint32_t*)array, size); }
-static void bswap(float *array, uint32_t size = 1) { bswap((uint32_t*)array, size); }
 
-// STRING
+void PfbArena::grow(size_t bytes)
+{
+    size_t size = (bytes > PFB_ARENA_CHUNK) ? bytes : PFB_ARENA_CHUNK;
+    current = (char*)malloc(size);
+    if (current == NULL) throw std::bad_alloc();
+    chunks.push_back(current);
+    chunkSizes.push_back(size);
+    left = size;
+}
 
-PfbString::PfbString() : length(0), str(NULL) {}
+void PfbArena::adopt(PfbArena &other)
+{
+    chunks.insert(chunks.end(), other.chunks.begin(), other.chunks.end());
+    chunkSizes.insert(chunkSizes.end(), other.chunkSizes.begin(), other.chunkSizes.end());
+    used        += other.used;
+    allocations += other.allocations;
+    other.chunks.clear();
+    other.chunkSizes.clear();
+    other.current     = NULL;
+    other.left        = 0;
+    other.used        = 0;
+    other.allocations = 0;
+}
 
-PfbString::~PfbString()
+void PfbArena::clear()
 {
-    if (str) delete[] str;
+    used        = 0;
+    allocations = 0;
+    if (chunks.empty()) return;
+
+    unsigned biggest = 0;
+    for (unsigned i=1; i<chunks.size(); ++i)
+        if (chunkSizes[i] > chunkSizes[biggest]) biggest = i;
+    for (unsigned i=0; i<chunks.size(); ++i)
+        if (i != biggest) free(chunks[i]);
+
+    chunks[0]     = chunks[biggest];
+    chunkSizes[0] = chunkSizes[biggest];
+    chunks.resize(1);
+    chunkSizes.resize(1);
+    current = chunks[0];
+    left    = chunkSizes[0];
 }
 
 // CHILDS
 
-void PfbChilds::setNumChildren(uint32_t num)
+void PfbChilds::setNumChildren(uint32_t num, PfbArena *arena)
 {
     numChildren = num;
+    owner = (arena == NULL);
     if (num > 0)
-        childs = new uint32_t[num];
+        childs = arena ? arena->allocate<uint32_t>(num) : new uint32_t[num];
+}
+
+void PfbChilds::attachChildren(uint32_t num, uint32_t *childs)
+{
+    if (this->childs && owner) delete[] this->childs;
+    numChildren  = num;
+    this->childs = childs;
+    owner        = false;
 }
 
-PfbChilds::PfbChilds() : numChildren(0), childs(NULL) {}
+PfbChilds::PfbChilds() : numChildren(0), childs(NULL), owner(true) {}
 
 PfbChilds::~PfbChilds()
 {
-    if (childs) delete[] childs;
+    if (childs && owner) delete[] childs;
 }
 
 // LOD
 
-void PfbNodeLOD::setNumRanges(uint32_t num) {
+void PfbNodeLOD::setNumRanges(uint32_t num, PfbArena *arena) {
     numRanges = num;
-    ranges = new float[num+1];
+    owner = (arena == NULL);
+    ranges = arena ? arena->allocate<float>(num+1) : new float[num+1];
 }
 
-PfbNodeLOD::PfbNodeLOD() : ranges(NULL) {}
+void PfbNodeLOD::attachRanges(uint32_t num, float *ranges)
+{
+    if (this->ranges && owner) delete[] this->ranges;
+    numRanges    = num;
+    this->ranges = ranges;
+    owner        = false;
+}
+
+PfbNodeLOD::PfbNodeLOD() : ranges(NULL), owner(true) {}
 
 PfbNodeLOD::~PfbNodeLOD()
 {
-    if (ranges) delete[] ranges;
+    if (ranges && owner) delete[] ranges;
 }
 
 // GEODE
 
-PfbNodeGeode::PfbNodeGeode() : numGeosets(0), geosets(NULL) {}
+PfbNodeGeode::PfbNodeGeode() : numGeosets(0), geosets(NULL), owner(true) {}
 PfbNodeGeode::~PfbNodeGeode()
 {
-    if (geosets) delete[] geosets;
+    if (geosets && owner) delete[] geosets;
 }
 
-void PfbNodeGeode::setNumGeosets(uint32_t num)
+void PfbNodeGeode::setNumGeosets(uint32_t num, PfbArena *arena)
 {
     numGeosets = num;
-    geosets = new uint32_t[num];
+    owner = (arena == NULL);
+    geosets = arena ? arena->allocate<uint32_t>(num) : new uint32_t[num];
+}
+
+void PfbNodeGeode::attachGeosets(uint32_t num, uint32_t *geosets)
+{
+    if (this->geosets && owner) delete[] this->geosets;
+    numGeosets    = num;
+    this->geosets = geosets;
+    owner         = false;
 }
 
 // NODE
 
-PfbNode::PfbNode() : type(0), name(NULL)
+PfbNode::PfbNode() : type(0), ownData(true), ownName(true), name(NULL)
 {}
 
+/// Destroy an object allocated with new, or constructed in an arena
+template <typename T>
+static void destroy(T *object, bool owner)
+{
+    if (owner) delete object;
+    else       object->~T();
+}
+
 PfbNode::~PfbNode()
 {
     switch (type)
     {
-        case 2: delete data.geode; break;
-        case 5: delete data.group; break;
-        case 6: delete data.scs; break;
-        case 7: delete data.dcs; break;
-        case 11: delete data.lod; break;
+        case 2: destroy(data.geode, ownData); break;
+        case 5: destroy(data.group, ownData); break;
+        case 6: destroy(data.scs, ownData); break;
+        case 7: destroy(data.dcs, ownData); break;
+        case 11: destroy(data.lod, ownData); break;
     }
-    if (name) delete[] name;
+    if (name && ownName) delete[] name;
+}
+
+/// Create an object with new, or in the arena if any
+template <typename T>
+static T *create(PfbArena *arena)
+{
+    if (arena) return new (arena->allocate(sizeof(T))) T();
+    return new T();
 }
 
-void PfbNode::setType(uint32_t type)
+void PfbNode::setType(uint32_t type, PfbArena *arena)
 {
     this->type = type;
+    ownData = (arena == NULL);
     switch (type)
     {
         case 2:  // Geode
-            data.geode = new PfbNodeGeode(); break;
+            data.geode = create<PfbNodeGeode>(arena); break;
         case 5:  // Group
-            data.group = new PfbNodeGroup(); break;
+            data.group = create<PfbNodeGroup>(arena); break;
         case 6:  // SCS
-            data.scs   = new PfbNodeSCS(); break;
+            data.scs   = create<PfbNodeSCS>(arena); break;
         case 7:  // SCS
-            data.scs   = new PfbNodeDCS(); break;
+            data.scs   = create<PfbNodeDCS>(arena); break;
         case 11: // LOD
-            data.lod   = new PfbNodeLOD(); break;
+            data.lod   = create<PfbNodeLOD>(arena); break;
         default:
             return;
     }
 }
 
-void PfbNode::setName(const char *str, uint32_t strlength)
+void PfbNode::setName(const char *str, uint32_t strlength, PfbArena *arena)
 {
-    if (name) delete[] name;
-    name = new char[strlength+1];
+    if (name && ownName) delete[] name;
+    ownName = (arena == NULL);
+    name = arena ? arena->allocate<char>(strlength+1) : new char[strlength+1];
     if (strlength == 0) name[0] = 0;
     if (str == NULL)    name[0] = 0;
     strcpy(name, str);
 }
 
+void PfbNode::attachName(char *str)
+{
+    if (name && ownName) delete[] name;
+    ownName = false;
+    name    = str;
+}
+
 // TREE
    
 PfbTree::PfbTree()
@@ -184,6 +372,10 @@ PfbTree::PfbTree()
     , numGeoStates(0)
     , numGeoSets(0)
     , numNodes(0)
+    , mapAddress(NULL)
+    , mapLength(0)
+    , boundsComputed(false)
+    , lazy(NULL)
 {}
 
 PfbTree::~PfbTree()
@@ -198,6 +390,82 @@ PfbTree::~PfbTree()
     if (geostates)    delete[] geostates;
     if (geosets)      delete[] geosets;
     if (nodes)        delete[] nodes;
+    if (lazy)         delete lazy;
+    if (mapAddress)   munmap(mapAddress, mapLength);
+}
+
+/// Read list i of the given kind if it was not yet. Concurrent calls for
+/// the same list wait for the first one to be done.
+void PfbTree::loadList(ListKind kind, unsigned i)
+{
+    if (i >= lazy->states[kind].size()) return;
+
+    unsigned char *state = &lazy->states[kind][i];
+    if (__atomic_load_n(state, __ATOMIC_ACQUIRE) == PFBLAZY_READY) return;
+
+    unsigned char expected = PFBLAZY_PENDING;
+    if (__atomic_compare_exchange_n(state, &expected, PFBLAZY_LOADING, false,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        PfbLazyPublisher publisher(*lazy, state);
+        long offset = lazy->offsets[kind][i];
+        switch (kind) {
+            case LENGTH_LIST:   decodeList(lengthList[i],   offset); break;
+            case VERTEX_LIST:   decodeList(vertexList[i],   offset); break;
+            case COLOR_LIST:    decodeList(colorList[i],    offset); break;
+            case NORMAL_LIST:   decodeList(normalList[i],   offset); break;
+            case TEXCOORD_LIST: decodeList(texcoordList[i], offset); break;
+            default: break;
+        }
+        return;
+    }
+
+    PfbScopedLock lock(lazy->mutex);
+    while (__atomic_load_n(state, __ATOMIC_ACQUIRE) != PFBLAZY_READY)
+        pthread_cond_wait(&lazy->ready, &lazy->mutex);
+}
+
+/// Read the list whose header is at offset. On error (the list would go
+/// past the end of the data), the list stays empty.
+template <typename T, unsigned N>
+void PfbTree::decodeList(PfbList<T,N> &list, long offset)
+{
+    uint32_t info[3]; // size, unknown1, unknown2
+    if (!lazy->read(info, offset, sizeof(info))) return;
+    uint32_t size = lazy->needBswap ? __builtin_bswap32(info[0]) : info[0];
+
+    size_t bytes = (size_t)size * N * sizeof(T);
+    offset += sizeof(info);
+
+    if (offset + bytes > lazy->size) return;
+
+    const char *src = lazy->mapData ? lazy->mapData + offset : NULL;
+    if (src && !lazy->needBswap && ((uintptr_t)src % sizeof(T)) == 0) {
+        list.attach((T*)src, size);
+        return;
+    }
+
+    T *data;
+    {
+        PfbScopedLock lock(lazy->mutex);
+        data = arena.allocate<T>((size_t)size * N);
+    }
+
+    if (src && lazy->needBswap)
+        bswap32Copy((uint32_t*)data, (const uint32_t*)src, size * N);
+    else if (!lazy->read(data, offset, bytes))
+        return;
+    else if (lazy->needBswap)
+        bswap32((uint32_t*)data, size * N);
+
+    list.attach(data, size);
+}
+
+void PfbTree::adoptMapping(void *address, size_t length)
+{
+    if (mapAddress) munmap(mapAddress, mapLength);
+    mapAddress = address;
+    mapLength  = length;
 }
 void PfbTree::createLengthLists(unsigned num)
 {
@@ -254,37 +522,761 @@ void PfbTree::createNodes(unsigned num)
     nodes = new PfbNode[num];
     numNodes = num;
 }
-            
+
+//
+// NODE TABLE /* {{{ */
+//
+
+void PfbNodeTable::build(PfbTree &tree)
+{
+    uint32_t num = tree.getNumNodes();
+    types.resize(num);
+    payloads.resize(num);
+    names.resize(num);
+    childOffsets.assign(1, 0);
+    children.clear();
+    matrices.clear();
+    rangeOffsets.assign(1, 0);
+    ranges.clear();
+    centers.clear();
+    geosetOffsets.assign(1, 0);
+    geosets.clear();
+
+    for (uint32_t i=0; i<num; ++i) {
+        PfbNode &node = tree.getNode(i);
+        types[i]    = node.getType();
+        payloads[i] = 0;
+        names[i]    = node.getName();
+
+        const PfbChilds *childs = NULL;
+        if (PfbNodeGeode *geode = node.asGeode()) {
+            payloads[i] = geosetOffsets.size() - 1;
+            geosets.insert(geosets.end(), geode->getGeosets(), geode->getGeosets() + geode->getNumGeosets());
+            geosetOffsets.push_back(geosets.size());
+        }
+        else if (PfbNodeGroup *group = node.asGroup()) {
+            childs = &group->getChilds();
+        }
+        else if (node.asSCS() || node.asDCS()) {
+            PfbNodeTransform *transform = node.asSCS() ? node.asSCS() : node.asDCS();
+            payloads[i] = matrices.size() / 16;
+            matrices.insert(matrices.end(), transform->getMatrix(), transform->getMatrix() + 16);
+            childs = &transform->getChilds();
+        }
+        else if (PfbNodeLOD *lod = node.asLOD()) {
+            payloads[i] = rangeOffsets.size() - 1;
+            if (lod->getRanges(0))
+                ranges.insert(ranges.end(), lod->getRanges(0), lod->getRanges(0) + lod->getNumRanges() + 1);
+            else
+                ranges.push_back(0);
+            rangeOffsets.push_back(ranges.size());
+            centers.insert(centers.end(), lod->getCenter(), lod->getCenter() + 3);
+            childs = &lod->getChilds();
+        }
+
+        if (childs)
+            children.insert(children.end(), childs->childs, childs->childs + childs->getNumChildren());
+        childOffsets.push_back(children.size());
+    }
+}
+/* }}} */
+
+//
+// BOUNDS /* {{{ */
+//
+
+PfbBox::PfbBox()
+{
+    for (unsigned a=0; a<3; ++a) {
+        min[a] = FLT_MAX;
+        max[a] = -FLT_MAX;
+    }
+}
+
+void PfbBox::extend(const PfbBox &box)
+{
+    for (unsigned a=0; a<3; ++a) {
+        if (box.min[a] < min[a]) min[a] = box.min[a];
+        if (box.max[a] > max[a]) max[a] = box.max[a];
+    }
+}
+
+bool PfbBox::overlaps(const PfbBox &box) const
+{
+    return min[0] <= box.max[0] && box.min[0] <= max[0] &&
+           min[1] <= box.max[1] && box.min[1] <= max[1] &&
+           min[2] <= box.max[2] && box.min[2] <= max[2];
+}
+
+float PfbBox::area() const
+{
+    if (isEmpty()) return 0;
+    float dx = max[0] - min[0], dy = max[1] - min[1], dz = max[2] - min[2];
+    return dx*dy + dy*dz + dz*dx;
+}
+
+PfbBox computeBox(const float *points, uint32_t count)
+{
+    PfbBox box;
+    uint32_t i = 0;
+#ifdef __SSE2__
+    // One point per iteration, the 4th lane (next point) is ignored
+    if (count > 1) {
+        __m128 lo = _mm_loadu_ps(points), hi = lo;
+        for (i = 1; i + 1 < count; ++i) {
+            __m128 p = _mm_loadu_ps(points + 3*i);
+            lo = _mm_min_ps(lo, p);
+            hi = _mm_max_ps(hi, p);
+        }
+        float l[4], h[4];
+        _mm_storeu_ps(l, lo);
+        _mm_storeu_ps(h, hi);
+        memcpy(box.min, l, sizeof(box.min));
+        memcpy(box.max, h, sizeof(box.max));
+    }
+#endif
+    for (; i < count; ++i) {
+        const float *p = points + 3*i;
+        for (unsigned a=0; a<3; ++a) {
+            if (p[a] < box.min[a]) box.min[a] = p[a];
+            if (p[a] > box.max[a]) box.max[a] = p[a];
+        }
+    }
+    return box;
+}
+
+PfbBox transformBox(const PfbBox &box, const float *m)
+{
+    // Arvo: every output axis is the translation plus the extreme
+    // contributions of the input axes
+    PfbBox out;
+    if (box.isEmpty()) return out;
+    for (unsigned j=0; j<3; ++j) {
+        out.min[j] = out.max[j] = m[12 + j];
+        for (unsigned i=0; i<3; ++i) {
+            float a = box.min[i] * m[4*i + j], b = box.max[i] * m[4*i + j];
+            out.min[j] += (a < b) ? a : b;
+            out.max[j] += (a < b) ? b : a;
+        }
+    }
+    return out;
+}
+
+PfbBounds::PfbBounds() : radius(-1)
+{
+    center[0] = center[1] = center[2] = 0;
+}
+
+/// Largest distance from center to the count points
+static float computeRadius(const float *points, uint32_t count, const float *center)
+{
+    float    max2 = 0;
+    uint32_t i    = 0;
+#ifdef __SSE2__
+    // One point per iteration, the 4th lane (next point) is zeroed
+    if (count > 1) {
+        __m128 c    = _mm_setr_ps(center[0], center[1], center[2], 0);
+        __m128 mask = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+        __m128 best = _mm_setzero_ps();
+        for (; i + 1 < count; ++i) {
+            __m128 d = _mm_and_ps(_mm_sub_ps(_mm_loadu_ps(points + 3*i), c), mask);
+            d = _mm_mul_ps(d, d);
+            d = _mm_add_ps(d, _mm_shuffle_ps(d, d, _MM_SHUFFLE(2, 3, 0, 1)));
+            d = _mm_add_ps(d, _mm_shuffle_ps(d, d, _MM_SHUFFLE(1, 0, 3, 2)));
+            best = _mm_max_ps(best, d);
+        }
+        _mm_store_ss(&max2, best);
+    }
+#endif
+    for (; i < count; ++i) {
+        const float *p = points + 3*i;
+        float dx = p[0] - center[0], dy = p[1] - center[1], dz = p[2] - center[2];
+        float d2 = dx*dx + dy*dy + dz*dz;
+        if (d2 > max2) max2 = d2;
+    }
+    return sqrtf(max2);
+}
+
+/// Center the sphere on the box, with the smallest radius containing the
+/// box or the given spheres
+static void fitSphere(PfbBounds &bounds, const PfbBounds *spheres, unsigned numSpheres)
+{
+    if (bounds.isEmpty()) return;
+    float diagonal2 = 0;
+    for (unsigned a=0; a<3; ++a) {
+        bounds.center[a] = 0.5f * (bounds.box.min[a] + bounds.box.max[a]);
+        float half = bounds.box.max[a] - bounds.center[a];
+        diagonal2 += half * half;
+    }
+    bounds.radius = sqrtf(diagonal2);
+
+    float radius = 0;
+    for (unsigned i=0; i<numSpheres; ++i) {
+        if (spheres[i].isEmpty()) continue;
+        float dx = spheres[i].center[0] - bounds.center[0];
+        float dy = spheres[i].center[1] - bounds.center[1];
+        float dz = spheres[i].center[2] - bounds.center[2];
+        float r = sqrtf(dx*dx + dy*dy + dz*dz) + spheres[i].radius;
+        if (r > radius) radius = r;
+    }
+    if (numSpheres && radius < bounds.radius) bounds.radius = radius;
+}
+
+/// bounds transformed by m (row vectors)
+static PfbBounds transformBounds(const PfbBounds &bounds, const float *m)
+{
+    PfbBounds out;
+    if (bounds.isEmpty()) return out;
+    out.box = transformBox(bounds.box, m);
+
+    // The sphere scales by the longest axis of m
+    PfbBounds sphere;
+    float scale2 = 0;
+    for (unsigned i=0; i<3; ++i) {
+        sphere.center[i] = bounds.center[0]*m[i] + bounds.center[1]*m[4+i] + bounds.center[2]*m[8+i] + m[12+i];
+        float l2 = m[4*i]*m[4*i] + m[4*i+1]*m[4*i+1] + m[4*i+2]*m[4*i+2];
+        if (l2 > scale2) scale2 = l2;
+    }
+    sphere.box    = out.box;
+    sphere.radius = bounds.radius * sqrtf(scale2);
+    fitSphere(out, &sphere, 1);
+    return out;
+}
+
+class PfbGeoSetBoundsTask : public PfbTask
+{
+    public:
+        PfbGeoSetBoundsTask(PfbTree &tree, std::vector<PfbBounds> &bounds) : tree(tree), bounds(bounds) {}
+
+        void run(unsigned i) {
+            int32_t id = tree.getGeoSet(i).lengthListId;
+            if (id < 0 || !tree.haveVertexList() || (uint32_t)id >= tree.getNumVertexList()) return;
+            PfbVertexList &list = tree.getVertexList(id);
+            if (list.getSize() == 0) return;
+            bounds[i].box = computeBox(list.get(0), list.getSize());
+            fitSphere(bounds[i], NULL, 0);
+            bounds[i].radius = computeRadius(list.get(0), list.getSize(), bounds[i].center);
+        }
+
+    private:
+        PfbTree                &tree;
+        std::vector<PfbBounds> &bounds;
+};
+
+void PfbTree::computeBounds(unsigned numThreads)
+{
+    geosetBounds.assign(numGeoSets, PfbBounds());
+    PfbGeoSetBoundsTask task(*this, geosetBounds);
+    parallelFor(task, numGeoSets, numThreads);
+
+    // 0 = to do, 1 = being computed (cycles), 2 = done
+    std::vector<unsigned char> state(numNodes, 0);
+    nodeBounds.assign(numNodes, PfbBounds());
+    for (uint32_t i=0; i<numNodes; ++i)
+        computeNodeBounds(i, state);
+    boundsComputed = true;
+}
+
+const PfbBounds &PfbTree::computeNodeBounds(uint32_t i, std::vector<unsigned char> &state)
+{
+    PfbBounds &bounds = nodeBounds[i];
+    if (state[i]) return bounds;
+    state[i] = 1;
+
+    std::vector<PfbBounds> parts;
+    PfbNode &node = nodes[i];
+    if (PfbNodeGeode *geode = node.asGeode()) {
+        for (uint32_t g=0; g<geode->getNumGeosets(); ++g) {
+            uint32_t geoset = geode->getGeosets()[g];
+            if (geoset < numGeoSets) parts.push_back(geosetBounds[geoset]);
+        }
+    }
+    else {
+        const PfbChilds *childs = NULL;
+        if      (node.asGroup()) childs = &node.asGroup()->getChilds();
+        else if (node.asSCS())   childs = &node.asSCS()->getChilds();
+        else if (node.asDCS())   childs = &node.asDCS()->getChilds();
+        else if (node.asLOD())   childs = &node.asLOD()->getChilds();
+        for (uint32_t c=0; childs && c<childs->getNumChildren(); ++c) {
+            uint32_t child = childs->getChild(c);
+            if (child < numNodes) parts.push_back(computeNodeBounds(child, state));
+        }
+    }
+
+    PfbBounds local;
+    for (unsigned p=0; p<parts.size(); ++p)
+        local.box.extend(parts[p].box);
+    if (!parts.empty()) fitSphere(local, &parts[0], parts.size());
+
+    if (node.asSCS())
+        bounds = transformBounds(local, node.asSCS()->getMatrix());
+    else if (node.asDCS())
+        bounds = transformBounds(local, node.asDCS()->getMatrix());
+    else
+        bounds = local;
+    state[i] = 2;
+    return bounds;
+}
+/* }}} */
+
+//
+// SOURCES /* {{{ */
+//
+
+PfbFdSource::PfbFdSource(int fd, long offset, long size, bool closeFd)
+    : fd(fd), offset(offset), size(0), closeFd(closeFd)
+{
+    struct stat st;
+    if (size >= 0)
+        this->size = size;
+    else if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > offset)
+        this->size = st.st_size - offset;
+}
+
+PfbFdSource::~PfbFdSource()
+{
+    if (closeFd && fd >= 0) close(fd);
+}
+
+size_t PfbFdSource::read(void *dst, size_t size, uint64_t offset)
+{
+    if (offset >= this->size) return 0;
+    if (size > this->size - offset) size = this->size - offset;
+
+    char  *out  = (char*)dst;
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, out + done, size - done, this->offset + offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+    return done;
+}
+
+size_t PfbMemorySource::read(void *dst, size_t size, uint64_t offset)
+{
+    if (offset >= this->size) return 0;
+    if (size > this->size - offset) size = this->size - offset;
+    memcpy(dst, data + offset, size);
+    return size;
+}
+/* }}} */
+
 /// PFB Loader
 ///
 /// @author Jean-Christophe Hoelt
-PfbFile::PfbFile(const string &name) : name(name), error(NULL)
+PfbFile::PfbFile(const string &name, unsigned flags)
+    : name(name), flags(flags), f(NULL), error(NULL), needBswap(false), arena(NULL), lazy(NULL)
+    , stats(NULL), currentBlock(0)
+    , visitor(NULL), chunkBuffer(NULL)
+    , mapData(NULL), mapSize(0), mapPos(0), mapShared(false), mapOwned(true)
+    , parent(NULL), source(NULL), ownSource(false)
+    , filePos(0), readBuffer(NULL), bufferOffset(0), bufferLength(0)
+    , dataEof(false)
 {
+    if (flags & PFBLOAD_MMAP)
+    {
+        int fd = open(name.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            void *addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED) {
+                madvise(addr, st.st_size, MADV_WILLNEED);
+                madvise(addr, st.st_size, MADV_SEQUENTIAL);
+                mapData = (char*)addr;
+                mapSize = st.st_size;
+            }
+        }
+        if (fd >= 0) close(fd);
+        if (mapData) return;
+        // Fallback to stdio (empty file, pipe, ...)
+    }
+
     f = fopen(name.c_str(), "r");
     if (f == NULL) error = "Could not open file";
 
     if (error)
         printf("hidra::PfbLoader: could not open file\n");
+    else if (lseek(fileno(f), 0, SEEK_CUR) >= 0) {
+        // Seekable: read through our own buffer, stdio is left for pipes
+        source     = new PfbFdSource(fileno(f));
+        ownSource  = true;
+        readBuffer = new char[PFB_READ_BUFFER];
+    }
+}
+
+PfbFile::PfbFile(PfbSource &source, unsigned flags, const string &name)
+    : name(name), flags(flags), f(NULL), error(NULL), needBswap(false), arena(NULL), lazy(NULL)
+    , stats(NULL), currentBlock(0)
+    , visitor(NULL), chunkBuffer(NULL)
+    , mapData(NULL), mapSize(0), mapPos(0), mapShared(false), mapOwned(false)
+    , parent(NULL), source(NULL), ownSource(false)
+    , filePos(0), readBuffer(NULL), bufferOffset(0), bufferLength(0)
+    , dataEof(false)
+{
+    // Lists point into the data, changes to them are made there
+    mapData = source.getData();
+    if (mapData) {
+        mapSize = source.getSize();
+        return;
+    }
+    this->source = &source;
+    readBuffer   = new char[PFB_READ_BUFFER];
+}
+
+/// Block decoder for PFBLOAD_PARALLEL, reading from offset in parent's
+/// file and filling parent's tree.
+PfbFile::PfbFile(PfbFile &parent, long offset)
+    : name(parent.name), flags(parent.flags), f(NULL), tree(parent.tree), error(NULL)
+    , needBswap(parent.needBswap), arena(new PfbArena()), lazy(parent.lazy)
+    , stats(NULL), currentBlock(0)
+    , visitor(NULL), chunkBuffer(NULL)
+    , mapData(parent.mapData), mapSize(parent.mapSize), mapPos(offset), mapShared(false)
+    , mapOwned(parent.mapOwned)
+    , parent(&parent), source(parent.source), ownSource(false)
+    , filePos(offset), readBuffer(NULL), bufferOffset(0), bufferLength(0)
+    , dataEof(false)
+{
+    if (!mapData)
+        readBuffer = new char[PFB_READ_BUFFER];
 }
 
 PfbFile::~PfbFile()
 {
+    if (ownSource) delete source;
     if (f) fclose(f);
+    if (readBuffer) delete[] readBuffer;
+    if (parent) delete arena;
+    if (mapData && mapOwned && !mapShared && !parent) munmap(mapData, mapSize);
 }
 
 bool PfbFile::loadFailed() const      { return error != NULL; }
 const char *PfbFile::getError() const { return error; }
 
+//
+// BYTE SWAP /* {{{ */
+//
+
+void PfbFile::bswap(uint32_t *array, uint32_t size) const
+{
+    if (!needBswap) return;
+
+    // Vector kernels only pay off on bulk data
+    if (size >= 16) {
+        bswap32(array, size);
+        return;
+    }
+    for (unsigned i=0; i<size; ++i)
+        array[i] = __builtin_bswap32(array[i]);
+}
+void PfbFile::bswap(int32_t *array, uint32_t size) const { bswap((uint32_t*)array, size); }
+void PfbFile::bswap(float *array, uint32_t size) const { bswap((uint32_t*)array, size); }
+/* }}} */
+
+//
+// DATA ACCESS /* {{{ */
+//
+// Same semantic as fread/fseek/ftell/feof, but on the mapping when the file
+// was opened with PFBLOAD_MMAP (or the data of a memory source), or on the
+// source.
+//
+
+size_t PfbFile::readData(void *dst, size_t size, size_t count)
+{
+    if (source) return readPositioned(dst, size * count) / size;
+    if (!mapData) {
+        if (stats) stats->numReads++;
+        return fread(dst, size, count, f);
+    }
+
+    size_t avail = (mapPos < mapSize) ? (mapSize - mapPos) / size : 0;
+    if (count > avail) {
+        count   = avail;
+        dataEof = true;
+    }
+    memcpy(dst, mapData + mapPos, size * count);
+    mapPos += size * count;
+    return count;
+}
+
+void PfbFile::seekData(long offset, int whence)
+{
+    if (stats) stats->numSeeks++;
+    if (source) {
+        switch (whence) {
+            case SEEK_SET: filePos = offset; break;
+            case SEEK_CUR: filePos += offset; break;
+            default: break; // not used
+        }
+        dataEof = false;
+        return;
+    }
+    if (!mapData) {
+        fseek(f, offset, whence);
+        return;
+    }
+    switch (whence) {
+        case SEEK_SET: mapPos = offset; break;
+        case SEEK_CUR: mapPos += offset; break;
+        case SEEK_END: mapPos = mapSize + offset; break;
+    }
+    dataEof = false;
+}
+
+long PfbFile::tellData()
+{
+    if (source)   return filePos;
+    if (!mapData) return ftell(f);
+    return mapPos;
+}
+
+bool PfbFile::endOfData()
+{
+    if (!source && !mapData) return feof(f);
+    return dataEof;
+}
+
+/// Read bytes at filePos from the source. Small reads are served from
+/// readBuffer, big ones go straight to dst.
+size_t PfbFile::readPositioned(void *dst, size_t bytes)
+{
+    char  *out  = (char*)dst;
+    size_t done = 0;
+
+    while (done < bytes)
+    {
+        if (filePos >= bufferOffset && filePos < bufferOffset + (long)bufferLength) {
+            size_t n = bufferOffset + bufferLength - filePos;
+            if (n > bytes - done) n = bytes - done;
+            memcpy(out + done, readBuffer + (filePos - bufferOffset), n);
+            done    += n;
+            filePos += n;
+            continue;
+        }
+
+        size_t n;
+        if (stats) stats->numReads++;
+        if (bytes - done >= PFB_READ_BUFFER) {
+            size_t wanted = bytes - done;
+            n = source->read(out + done, wanted, filePos);
+            done    += n;
+            filePos += n;
+            if (n < wanted) break;
+        }
+        else {
+            n = source->read(readBuffer, PFB_READ_BUFFER, filePos);
+            if (n == 0) break;
+            bufferOffset = filePos;
+            bufferLength = n;
+        }
+    }
+
+    if (done < bytes) dataEof = true;
+    return done;
+}
+
+/// Read the buffer at filePos. Returns false if it then holds less than
+/// bytes.
+bool PfbFile::fillBuffer(size_t bytes)
+{
+    if (bytes > PFB_READ_BUFFER) return false;
+    if (stats) stats->numReads++;
+
+    bufferOffset = filePos;
+    bufferLength = source->read(readBuffer, PFB_READ_BUFFER, filePos);
+    return bufferLength >= bytes;
+}
+
+/// Next bytes of the file, in place in the mapping or readBuffer, the
+/// position moving past them. NULL if they can't be reached this way
+/// (stdio, end of file), readData() then does the work.
+inline const char *PfbFile::take(size_t bytes)
+{
+    const char *data;
+    if (mapData) {
+        if (mapPos + bytes > mapSize) return NULL;
+        data    = mapData + mapPos;
+        mapPos += bytes;
+        return data;
+    }
+    if (!source) return NULL;
+    if ((filePos < bufferOffset || filePos + bytes > bufferOffset + bufferLength)
+            && !fillBuffer(bytes))
+        return NULL;
+    data     = readBuffer + (filePos - bufferOffset);
+    filePos += bytes;
+    return data;
+}
+
+/// Next word, swapped. -1 at the end of the file.
+inline uint32_t PfbFile::readWord()
+{
+    uint32_t    word;
+    const char *data = take(4);
+    if (data)
+        memcpy(&word, data, 4);
+    else if (readData(&word, 4, 1) != 1)
+        return 0xffffffff;
+    return needBswap ? __builtin_bswap32(word) : word;
+}
+
+/// Next count words, swapped, without moving past them: they are taken
+/// then given back, no seek is made (nor counted). False if the file
+/// ends before.
+inline bool PfbFile::peekWords(uint32_t *dst, uint32_t count)
+{
+    size_t bytes = (size_t)count * 4;
+    if (!mapData && !source) {
+        // stdio goes back within its own buffer
+        long   pos = ftell(f);
+        size_t n   = fread(dst, 4, count, f);
+        fseek(f, pos, SEEK_SET);
+        if (n != count) return false;
+    }
+    else {
+        const char *data = take(bytes);
+        if (!data) return false;
+        memcpy(dst, data, bytes);
+        if (mapData) mapPos  -= bytes;
+        else         filePos -= bytes;
+    }
+    bswap(dst, count);
+    return true;
+}
+
+/// Next word, swapped, without moving past it. -1 at the end of the file.
+inline uint32_t PfbFile::peekWord()
+{
+    uint32_t word;
+    return peekWords(&word, 1) ? word : 0xffffffff;
+}
+
+/// Next count words, swapped
+inline void PfbFile::readWords(void *dst, uint32_t count)
+{
+    const char *data = take((size_t)count * 4);
+    if (data)
+        memcpy(dst, data, (size_t)count * 4);
+    else
+        readData(dst, 4, count);
+    bswap((uint32_t*)dst, count);
+}
+
+/// Fill the list with the next size elements of the file. Native-endian
+/// mapped data is used in place, without any copy.
+template <typename T, unsigned N>
+void PfbFile::readListData(PfbList<T,N> &list, unsigned size)
+{
+    if (mapData && !needBswap
+        && (((uintptr_t)(mapData + mapPos)) % sizeof(T)) == 0
+        && mapPos + (size_t)size * N * sizeof(T) <= mapSize)
+    {
+        list.attach((T*)(mapData + mapPos), size);
+        mapPos   += (size_t)size * N * sizeof(T);
+        mapShared = true;
+        return;
+    }
+
+    list.attach(arena->allocate<T>((size_t)size * N), size);
+    if (mapData && needBswap && mapPos + (size_t)size * N * sizeof(T) <= mapSize)
+    {
+        // Swap while copying out of the mapping
+        bswap32Copy((uint32_t*)list.get(0), (const uint32_t*)(mapData + mapPos), N * size);
+        mapPos += (size_t)size * N * sizeof(T);
+        return;
+    }
+    readData(list.get(0), sizeof(T) * N, size);
+    bswap(list.get(0), N * size);
+}
+/* }}} */
+
+//
+// STATS /* {{{ */
+//
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/// Size of one element of a list block, 0 for other blocks
+static uint32_t listElementSize(uint32_t type)
+{
+    switch (type)
+    {
+        case PFBBLOCK_LENGTHLISTS:   return 4;
+        case PFBBLOCK_VERTEXLISTS:   return 4*3;
+        case PFBBLOCK_COLORLISTS:    return 4*4;
+        case PFBBLOCK_NORMALLISTS:   return 4*3;
+        case PFBBLOCK_TEXCOORDLISTS: return 4*2;
+        default:                     return 0;
+    }
+}
+
+/// Account the header of the block being read (see setStats())
+void PfbFile::countBlock(uint32_t count, uint32_t totalSize)
+{
+    if (currentBlock >= PFBSTATS_BLOCK_TYPES) return;
+
+    PfbBlockStats &block = stats->blocks[currentBlock];
+    block.count += count;
+    block.bytes += 12 + (uint64_t)totalSize;
+
+    // Every list starts with 3 words, the rest are its elements
+    uint32_t elementSize = listElementSize(currentBlock);
+    if (elementSize && totalSize >= 12 * count)
+        block.numValues += (totalSize - 12 * count) / elementSize;
+}
+
+void PfbLoadStats::add(const PfbLoadStats &other)
+{
+    for (unsigned i=0; i<PFBSTATS_BLOCK_TYPES; ++i) {
+        blocks[i].numBlocks += other.blocks[i].numBlocks;
+        blocks[i].count     += other.blocks[i].count;
+        blocks[i].numValues += other.blocks[i].numValues;
+        blocks[i].bytes     += other.blocks[i].bytes;
+        blocks[i].time      += other.blocks[i].time;
+    }
+    numReads       += other.numReads;
+    numSeeks       += other.numSeeks;
+    numAllocations += other.numAllocations;
+    allocatedBytes += other.allocatedBytes;
+}
+
+void PfbLoadStats::print(FILE *out) const
+{
+    fprintf(out, "%-14s %6s %10s %12s %12s %10s\n", "block", "blocks", "count", "values", "bytes", "ms");
+    for (unsigned i=0; i<PFBSTATS_BLOCK_TYPES; ++i) {
+        const PfbBlockStats &block = blocks[i];
+        if (!block.numBlocks) continue;
+        const char *name = getBlockName(i);
+        fprintf(out, "%-14s %6u %10u %12llu %12llu %10.3f\n", name ? name : "?",
+                block.numBlocks, block.count, (unsigned long long)block.numValues,
+                (unsigned long long)block.bytes, block.time * 1e3);
+    }
+    fprintf(out, "%llu bytes in %.3f ms (%.1f MB/s): parse %.3f ms%s, node table %.3f ms, bounds %.3f ms\n",
+            (unsigned long long)fileSize, totalTime * 1e3, getMBPerSecond(),
+            parseTime * 1e3, parallel ? " (parallel)" : "", nodeTableTime * 1e3, boundsTime * 1e3);
+    fprintf(out, "%llu reads, %llu seeks, %llu allocations (%llu bytes)\n",
+            (unsigned long long)numReads, (unsigned long long)numSeeks,
+            (unsigned long long)numAllocations, (unsigned long long)allocatedBytes);
+}
+/* }}} */
+
 //
 // HEADER /* {{{ */
 //
 
-PfbFile::PfbHeader PfbFile::readHeader()
+PfbHeader PfbFile::readHeader()
 {
     if (error) return PfbHeader();
 
     PfbHeader header;
-    fread(&header, sizeof(PfbHeader), 1, f);
+    readData(&header, sizeof(PfbHeader), 1);
     if (header.magic == 0x00ce0adb) {
         needBswap = true;
         bswap(&header.magic);
@@ -300,6 +1292,32 @@ PfbFile::PfbHeader PfbFile::readHeader()
 }
 /* }}} */
 
+//
+// LAZY LISTS /* {{{ */
+//
+
+/// Record where each list is and skip it (PFBLOAD_LAZY)
+void PfbFile::skipLists(unsigned kind, unsigned numLists, unsigned elementSize)
+{
+    lazy->offsets[kind].resize(numLists);
+    lazy->states[kind].assign(numLists, PFBLAZY_PENDING);
+
+    for (unsigned i=0; i<numLists; ++i)
+    {
+        lazy->offsets[kind][i] = tellData();
+
+        struct {
+            uint32_t size;
+            int32_t  unknown1;
+            int32_t  unknown2;
+        } info;
+        readData(&info, sizeof(info), 1);
+        bswap(&info.size, 1);
+        seekData((long)info.size * elementSize, SEEK_CUR);
+    }
+}
+/* }}} */
+
 //
 // LENGTH /* {{{ */
 //
@@ -311,14 +1329,10 @@ void PfbFile::readLengthList(PfbLengthList &list)
         int32_t  unknown1;
         int32_t  unknown2;
     } info;
-    fread(&info, sizeof(info), 1, f);
+    readData(&info, sizeof(info), 1);
     bswap(&info.size, 3);
 
-    if (debugfile) fprintf(debugfile, "(%u)\n", info.size);
-    list.allocate(info.size);
-
-    fread(list.get(0), 4, info.size, f);
-    bswap(list.get(0), info.size);
+    readListData(list, info.size);
 }
 
 void PfbFile::readLengthLists()
@@ -328,14 +1342,22 @@ void PfbFile::readLengthLists()
         uint32_t totalSize;
     } info;
 
-    fread(&info, sizeof(info), 1, f);
+    readData(&info, sizeof(info), 1);
     bswap(&info.numLists, 2);
 
-    if (debugfile) fprintf(debugfile, "hidra::PfbLoader: %u length lists\n", info.numLists);
+    if (stats) countBlock(info.numLists, info.totalSize);
+    if (visitor) {
+        streamLists(info.numLists, &PfbVisitor::onLengthList);
+        return;
+    }
     tree->createLengthLists(info.numLists);
+    if (lazy) {
+        skipLists(PfbTree::LENGTH_LIST, info.numLists, 4);
+        return;
+    }
+    arena->reserve(info.totalSize);
 
     for (unsigned i=0; i<info.numLists; ++i) {
-        if (debugfile) fprintf(debugfile, "hidra::PfbLoader:   list[%u] ", i);
         readLengthList(tree->getLengthList(i));
     }
 }
@@ -352,14 +1374,10 @@ void PfbFile::readVertexList(PfbVertexList &list)
         int32_t  unknown1;
         int32_t  unknown2;
     } info;
-    fread(&info, sizeof(info), 1, f);
+    readData(&info, sizeof(info), 1);
     bswap(&info.size, 3);
 
-    if (debugfile) fprintf(debugfile, "(%u)\n", info.size);
-    list.allocate(info.size);
-
-    fread(list.get(0), 4*3, info.size, f);
-    bswap(list.get(0), 3 * info.size);
+    readListData(list, info.size);
 }
 
 void PfbFile::readVertexLists()
@@ -369,14 +1387,22 @@ void PfbFile::readVertexLists()
         uint32_t totalSize;
     } info;
 
-    fread(&info, sizeof(info), 1, f);
+    readData(&info, sizeof(info), 1);
     bswap(&info.numLists, 2);
 
-    if (debugfile) fprintf(debugfile, "hidra::PfbLoader: %u vertex lists\n", info.numLists);
+    if (stats) countBlock(info.numLists, info.totalSize);
+    if (visitor) {
+        streamLists(info.numLists, &PfbVisitor::onVertexList);
+        return;
+    }
     tree->createVertexLists(info.numLists);
+    if (lazy) {
+        skipLists(PfbTree::VERTEX_LIST, info.numLists, 12);
+        return;
+    }
+    arena->reserve(info.totalSize);
 
     for (unsigned i=0; i<info.numLists; ++i) {
-        if (debugfile) fprintf(debugfile, "hidra::PfbLoader:   list[%u] ", i);
         readVertexList(tree->getVertexList(i));
     }
 }
@@ -393,14 +1419,10 @@ void PfbFile::readColorList(PfbColorList &list)
         int32_t  unknown1;
         int32_t  unknown2;
     } info;
-    fread(&info, sizeof(info), 1, f);
+    readData(&info, sizeof(info), 1);
     bswap(&info.size, 3);
 
-    if (debugfile) fprintf(debugfile, "(%u)\n", info.size);
-    list.allocate(info.size);
-
-    fread(list.get(0), 4*4, info.size, f);
-    bswap(list.get(0), 4 * info.size);
+    readListData(list, info.size);
 }
 
 void PfbFile::readColorLists()
@@ -410,14 +1432,22 @@ void PfbFile::readColorLists()
         uint32_t totalSize;
     } info;
 
-    fread(&info, sizeof(info), 1, f);
+    readData(&info, sizeof(info), 1);
     bswap(&info.numLists, 2);
 
-    if (debugfile) fprintf(debugfile, "hidra::PfbLoader: %u color lists\n", info.numLists);
+    if (stats) countBlock(info.numLists, info.totalSize);
+    if (visitor) {
+        streamLists(info.numLists, &PfbVisitor::onColorList);
+        return;
+    }
     tree->createColorLists(info.numLists);
+    if (lazy) {
+        skipLists(PfbTree::COLOR_LIST, info.numLists, 16);
+        return;
+    }
+    arena->reserve(info.totalSize);
 
     for (unsigned i=0; i<info.numLists; ++i) {
-        if (debugfile) fprintf(debugfile, "hidra::PfbLoader:   list[%u] ", i);
         readColorList(tree->getColorList(i));
     }
 }
@@ -434,14 +1464,10 @@ void PfbFile::readNormalList(PfbNormalList &list)
         int32_t  unknown1;
         int32_t  unknown2;
     } info;
-    fread(&info, sizeof(info), 1, f);
+    readData(&info, sizeof(info), 1);
     bswap(&info.size, 3);
 
-    if (debugfile) fprintf(debugfile, "(%u)\n", info.size);
-    list.allocate(info.size);
-
-    fread(list.get(0), 4*3, info.size, f);
-    bswap(list.get(0), 3 * info.size);
+    readListData(list, info.size);
 }
 
 void PfbFile::readNormalLists()
@@ -451,14 +1477,22 @@ void PfbFile::readNormalLists()
         uint32_t totalSize;
     } info;
 
-    fread(&info, sizeof(info), 1, f);
+    readData(&info, sizeof(info), 1);
     bswap(&info.numLists, 2);
 
-    if (debugfile) fprintf(debugfile, "hidra::PfbLoader: %u normal lists\n", info.numLists);
+    if (stats) countBlock(info.numLists, info.totalSize);
+    if (visitor) {
+        streamLists(info.numLists, &PfbVisitor::onNormalList);
+        return;
+    }
     tree->createNormalLists(info.numLists);
+    if (lazy) {
+        skipLists(PfbTree::NORMAL_LIST, info.numLists, 12);
+        return;
+    }
+    arena->reserve(info.totalSize);
 
     for (unsigned i=0; i<info.numLists; ++i) {
-        if (debugfile) fprintf(debugfile, "hidra::PfbLoader:   list[%u] ", i);
         readNormalList(tree->getNormalList(i));
     }
 }
@@ -475,14 +1509,10 @@ void PfbFile::readTexcoordList(PfbTexcoordList &list)
         int32_t  unknown1;
         int32_t  unknown2;
     } info;
-    fread(&info, sizeof(info), 1, f);
+    readData(&info, sizeof(info), 1);
     bswap(&info.size, 3);
 
-    if (debugfile) fprintf(debugfile, "(%u)\n", info.size);
-    list.allocate(info.size);
-
-    fread(list.get(0), 4*2, info.size, f);
-    bswap(list.get(0), 2 * info.size);
+    readListData(list, info.size);
 }
 
 void PfbFile::readTexcoordLists()
@@ -492,14 +1522,22 @@ void PfbFile::readTexcoordLists()
         uint32_t totalSize;
     } info;
 
-    fread(&info, sizeof(info), 1, f);
+    readData(&info, sizeof(info), 1);
     bswap(&info.numLists, 2);
 
-    if (debugfile) fprintf(debugfile, "hidra::PfbLoader: %u texcoord lists\n", info.numLists);
+    if (stats) countBlock(info.numLists, info.totalSize);
+    if (visitor) {
+        streamLists(info.numLists, &PfbVisitor::onTexcoordList);
+        return;
+    }
     tree->createTexcoordLists(info.numLists);
+    if (lazy) {
+        skipLists(PfbTree::TEXCOORD_LIST, info.numLists, 8);
+        return;
+    }
+    arena->reserve(info.totalSize);
 
     for (unsigned i=0; i<info.numLists; ++i) {
-        if (debugfile) fprintf(debugfile, "hidra::PfbLoader:   list[%u] ", i);
         readTexcoordList(tree->getTexcoordList(i));
     }
 }
@@ -512,7 +1550,7 @@ void PfbFile::readTexcoordLists()
 void PfbFile::readMaterial(PfbMaterial &material)
 {
     uint32_t materialType;
-    fread(&materialType, sizeof(materialType), 1, f);
+    readData(&materialType, sizeof(materialType), 1);
     bswap(&materialType);
 
     switch (materialType)
@@ -527,7 +1565,7 @@ void PfbFile::readMaterial(PfbMaterial &material)
     }
     material.type = materialType;
 
-    fread(((uint32_t*)&material) + 1, sizeof(material) - 4, 1, f);
+    readData(((uint32_t*)&material) + 1, sizeof(material) - 4, 1);
     bswap(((uint32_t*)&material) + 1, (sizeof(material)/4) - 1);
 }
 
@@ -538,14 +1576,22 @@ void PfbFile::readMaterials()
         uint32_t totalSize;
     } info;
 
-    fread(&info, sizeof(info), 1, f);
+    readData(&info, sizeof(info), 1);
     bswap(&info.numMaterials, 2);
 
-    if (debugfile) fprintf(debugfile, "hidra::PfbLoader: %u materials\n", info.numMaterials);
+    if (stats) countBlock(info.numMaterials, info.totalSize);
+    if (visitor) {
+        for (unsigned i=0; i<info.numMaterials; ++i) {
+            PfbMaterial material;
+            readMaterial(material);
+            if (error) return;
+            visitor->onMaterial(i, material);
+        }
+        return;
+    }
     tree->createMaterials(info.numMaterials);
 
     for (unsigned i=0; i<info.numMaterials; ++i) {
-        if (debugfile) fprintf(debugfile, "hidra::PfbLoader:   material[%u]\n", i);
         readMaterial(tree->getMaterial(i));
         if (error) return;
     }
@@ -562,10 +1608,9 @@ void PfbFile::readTexture(PfbTexture &texture)
     PfbString str;
     readString(str);
     if (error) return;
-    texture.fileName = new char[str.length+1];
+    texture.fileName = arena->allocate<char>(str.length+1);
     strncpy(texture.fileName, str.str, str.length+1);
 
-    if (debugfile) fprintf(debugfile, "hidra::PfbLoader:   textureName=%s\n", texture.fileName);
 
     // Read Remaining...
     //uint32_t *remainingRead = (uint32_t*)&texture.five_1_a;
@@ -575,7 +1620,7 @@ void PfbFile::readTexture(PfbTexture &texture)
     //fprintf(stderr, "r2=%d\n", remainingSize2);
     //fread(remainingRead, remainingSize, 1, f);
     //bswap(remainingRead, remainingSize/4);
-    fseek(f,remainingSize,SEEK_CUR);
+    seekData(remainingSize, SEEK_CUR);
 
     // return 228+remainingSize+str.length+4;
 }
@@ -587,24 +1632,34 @@ void PfbFile::readTextures()
         uint32_t totalSize;
     } info;
 
-    fread(&info, sizeof(info), 1, f);
+    readData(&info, sizeof(info), 1);
     bswap(&info.numTextures, 2);
 
-    if (debugfile) fprintf(debugfile, "hidra::PfbLoader: %u textures\n", info.numTextures);
-    tree->createTextures(info.numTextures);
+    if (stats) countBlock(info.numTextures, info.totalSize);
+    if (!visitor) {
+        tree->createTextures(info.numTextures);
+        arena->reserve(info.totalSize);
+    }
 
-    long start=ftell(f);
+    long start=tellData();
 
     for (unsigned i=0; i<info.numTextures; ++i) {
-        if (debugfile) fprintf(debugfile, "hidra::PfbLoader:   texture[%u]\n", i);
+        if (visitor) {
+            PfbTexture texture;
+            readTexture(texture);
+            if (error) return;
+            visitor->onTexture(i, texture);
+            arena->clear();
+            continue;
+        }
         readTexture(tree->getTexture(i));
         if (error) return;
     }
 
-    long end=ftell(f);
+    long end=tellData();
     if (info.totalSize > end-start) {
         long offset = info.totalSize+start-end;
-        fseek(f,offset,SEEK_CUR);
+        seekData(offset,SEEK_CUR);
     }
 }
  /* }}} */
@@ -615,54 +1670,40 @@ void PfbFile::readTextures()
 
 void PfbFile::readGeoState(PfbGeoState &geostate)
 {
-    int32_t numValues;
-    fread(&numValues, sizeof(numValues), 1, f);
-    bswap(&numValues, 1);
+    int32_t numValues = readWord();
 
-    geostate.setNumValues(numValues);
+    geostate.setNumValues(numValues, arena);
     int32_t key;
     int32_t nextkey = 0;
     
     while (true)
     {
-        if (nextkey == 0) {
-            fread(&key, sizeof(key), 1, f);
-            bswap(&key);
-        }
+        if (nextkey == 0)
+            key = readWord();
         else {
             key = nextkey;
             nextkey = 0;
         }
         if (key == -1) return;
 
-        int32_t value;
-        fread(&value, sizeof(value), 1, f);
-        bswap(&value);
+        int32_t value = readWord();
         geostate.setValue(key,value);
         
         if ((key == 6) || (key == 13)) {
-            int32_t one;
-            fread(&one, sizeof(one), 1, f);
-            bswap(&one);
+            int32_t one = readWord();
             if (one == 1)
-                fseek(f,8,SEEK_CUR);
+                seekData(8,SEEK_CUR);
             else
                 nextkey = one;
         }
         
         if ((key == 17) || (key == 18) || (key == 25)) {
-            int32_t one;
-            fread(&one, sizeof(one), 1, f);
-            bswap(&one);
+            int32_t one = readWord();
             if (one == -1) {
-                fread(&one, sizeof(one), 1, f);
-                bswap(&one);
-                if (one != -1) {
-                    fseek(f,-4,SEEK_CUR);
+                // -1 -1 x: x is skipped, -1 y: y starts the next geostate
+                if ((int32_t)peekWord() != -1)
                     return;
-                }
-                fread(&one, sizeof(one), 1, f);
-                bswap(&one);
+                seekData(8,SEEK_CUR);
             }
             else
                 nextkey = one;
@@ -677,15 +1718,27 @@ void PfbFile::readGeoStates()
         uint32_t totalSize;
     } info;
 
-    fread(&info, sizeof(info), 1, f);
+    readData(&info, sizeof(info), 1);
     bswap(&info.numStates, 2);
 
+    if (stats) countBlock(info.numStates, info.totalSize);
+    if (visitor) {
+        for (unsigned i=0; i<info.numStates; ++i) {
+            {
+                PfbGeoState geostate;
+                readGeoState(geostate);
+                if (error) return;
+                visitor->onGeoState(i, geostate);
+            }
+            arena->clear();
+        }
+        return;
+    }
     tree->createGeoStates(info.numStates);
-    if (debugfile) fprintf(debugfile, "hidra::PfbLoader: %u geostates\n", info.numStates);
+    arena->reserve(info.totalSize);
 
     for (unsigned i=0; i<info.numStates; ++i)
     {
-        if (debugfile) fprintf(debugfile, "hidra::PfbLoader:   geostates[%u] ", i);
         readGeoState(tree->getGeoState(i));
         if (error) return;
     }
@@ -703,21 +1756,27 @@ void PfbFile::readGeoSets()
         uint32_t totalSize;
     } info;
 
-    fread(&info, sizeof(info), 1, f);
+    readData(&info, sizeof(info), 1);
     bswap(&info.numSets, 2);
     uint32_t sizePerSet  = info.totalSize / info.numSets;
     uint32_t padding     = sizePerSet - sizeof(PfbGeoSet);
 
+    if (stats) countBlock(info.numSets, info.totalSize);
+    if (visitor) {
+        for (unsigned i=0; i<info.numSets; ++i) {
+            PfbGeoSet geoset;
+            readWords(&geoset, sizeof(PfbGeoSet)/4);
+            seekData(padding, SEEK_CUR);
+            visitor->onGeoSet(i, geoset);
+        }
+        return;
+    }
     tree->createGeoSets(info.numSets);
-    if (debugfile) fprintf(debugfile, "hidra::PfbLoader: %u geosets\n", info.numSets);
 
     for (unsigned i=0; i<info.numSets; ++i)
     {
-        if (debugfile) fprintf(debugfile, "hidra::PfbLoader:   geoset[%u] ", i);
-        fread(&tree->getGeoSet(i), sizeof(PfbGeoSet), 1, f);
-        bswap((uint32_t*)&tree->getGeoSet(i), sizeof(PfbGeoSet)/4);
-        fseek(f, padding, SEEK_CUR);
-        if (debugfile) fprintf(debugfile, "(%u,%u)\n", tree->getGeoSet(i).stripType, tree->getGeoSet(i).numStrip);
+        readWords(&tree->getGeoSet(i), sizeof(PfbGeoSet)/4);
+        seekData(padding, SEEK_CUR);
     }
 } /* }}} */
 
@@ -726,8 +1785,7 @@ void PfbFile::readGeoSets()
 //
 void PfbFile::readString(PfbString &pstr)
 {
-    fread(&pstr.length, sizeof(pstr.length), 1, f);
-    bswap(&pstr.length);
+    pstr.length = readWord();
 
     if (pstr.length == 0xffffffff) pstr.length=0;
     if (pstr.length > 0x1000) {
@@ -735,87 +1793,72 @@ void PfbFile::readString(PfbString &pstr)
         error = "Invalid string length";
         return;
     }
-    pstr.str = new char[pstr.length+1];
+    pstr.str = (pstr.length < sizeof(pstr.buffer)) ? pstr.buffer : new char[pstr.length+1];
     pstr.str[pstr.length] = 0;
 
-    if (pstr.length > 0)
-        fread(pstr.str, pstr.length, 1, f);
+    if (pstr.length > 0) {
+        const char *data = take(pstr.length);
+        if (data)
+            memcpy(pstr.str, data, pstr.length);
+        else
+            readData(pstr.str, pstr.length, 1);
+    }
 }
 
 void PfbFile::readNodeEnd(PfbNodeEnd &nodeEnd, long namePosition)
 {
-    fread(&nodeEnd.mask[0],  4, 4, f);
-    fread(&nodeEnd.data0[0], 4, 4, f);
-    fseek(f, namePosition, SEEK_SET);
+    readWords(&nodeEnd.mask[0],  4);
+    readWords(&nodeEnd.data0[0], 4);
+    seekData(namePosition, SEEK_SET);
     readString(nodeEnd.name);
-    if (debugfile) fprintf(debugfile, "hidra::PfbLoader:   name=%s (%u)\n ", nodeEnd.name.str, nodeEnd.name.length);
-
-    bswap(&nodeEnd.mask[0], 4);
-    bswap(&nodeEnd.data0[0], 4);
 }
 
 void PfbFile::readChilds(PfbChilds &childs)
 {
-    uint32_t numChildren;
-    fread(&numChildren, 4, 1, f);
-    bswap(&numChildren);
+    uint32_t numChildren = readWord();
 
-    childs.setNumChildren(numChildren);
-    fread(&childs.childs[0], 4, numChildren, f);
-    bswap(&childs.childs[0], numChildren);
+    childs.setNumChildren(numChildren, arena);
+    readWords(&childs.childs[0], numChildren);
 }
 
 void PfbFile::readNodeLOD(PfbNodeLOD &lod)
 {
-    uint32_t numRanges;
-    fread(&numRanges, sizeof(numRanges), 1, f);
-    bswap(&numRanges);
+    uint32_t numRanges = readWord();
 
-    lod.setNumRanges(numRanges);
-    fread(lod.getRanges(0), 4, numRanges+1, f);
-    bswap(lod.getRanges(0),    numRanges+1);
+    lod.setNumRanges(numRanges, arena);
+    readWords(lod.getRanges(0), numRanges+1);
 
-    float *ones = new float[numRanges+1];
-    fread(&ones[0],   4, numRanges+1, f);
-    bswap(&ones[0],      numRanges+1);
-    delete[] ones;
+    // (numRanges+1) floats, all 1.0
+    seekData(4 * (numRanges+1), SEEK_CUR);
     
-    fread(lod.getCenter(), 4, 3, f);
-    bswap(lod.getCenter(), 3);
+    readWords(lod.getCenter(), 3);
 
-    int32_t minusOne[2];
-    fread(&minusOne[0], 4, 2, f);
-    bswap(&minusOne[0], 2);
+    // -1 -1
+    seekData(8, SEEK_CUR);
 
     readChilds(lod.getChilds());
 }
 
 void PfbFile::readNodeGeode(PfbNodeGeode &geode)
 {
-    uint32_t numGeosets;
-    fread(&numGeosets, 4, 1, f);
-    bswap(&numGeosets);
+    uint32_t numGeosets = readWord();
 
-    geode.setNumGeosets(numGeosets);
-    fread(geode.getGeosets(), 4, numGeosets, f);
-    bswap(geode.getGeosets(), numGeosets);
+    geode.setNumGeosets(numGeosets, arena);
+    readWords(geode.getGeosets(), numGeosets);
 }
 
 void PfbFile::readNodeSCS(PfbNodeSCS &scs)
 {
-    fread(scs.getMatrix(), 4, 16, f);
-    bswap(scs.getMatrix(), 16);
+    readWords(scs.getMatrix(), 16);
     readChilds(scs.getChilds());
 }
 
 void PfbFile::readNodeDCS(PfbNodeDCS &dcs)
 {
-    uint32_t mask;
-    fread(&mask, 4, 1, f);
-    bswap(&mask);
+    // mask
+    seekData(4, SEEK_CUR);
     
-    fread(dcs.getMatrix(), 4, 16, f);
-    bswap(dcs.getMatrix(), 16);
+    readWords(dcs.getMatrix(), 16);
     readChilds(dcs.getChilds());
 }
 
@@ -826,37 +1869,27 @@ void PfbFile::readNodeGroup(PfbNodeGroup &group)
 
 void PfbFile::readNode(PfbNode &node)
 {
-    uint32_t nodeSize;
-    fread(&nodeSize, sizeof(nodeSize), 1, f);
-    bswap(&nodeSize);
-
-    long pos = ftell(f);
+    uint32_t nodeSize = readWord();
+    long     pos      = tellData();
 
-    uint32_t type;
-    fread(&type, sizeof(type), 1, f);
-    bswap(&type);
-    node.setType(type);
+    uint32_t type = readWord();
+    node.setType(type, arena);
 
     switch (type)
     {
         case 2:  // Geode
-            if (debugfile) fprintf(debugfile, "hidra::PfbLoader:   node_Geode\n");
             readNodeGeode(*node.asGeode());
             break;
         case 5:  // Group
-            if (debugfile) fprintf(debugfile, "hidra::PfbLoader:   node_Group\n");
             readNodeGroup(*node.asGroup());
             break;
         case 6:  // SCS
-            if (debugfile) fprintf(debugfile, "hidra::PfbLoader:   node_SCS\n");
             readNodeSCS(*node.asSCS());
             break;
         case 7:  // DCS
-            if (debugfile) fprintf(debugfile, "hidra::PfbLoader:   node_DCS\n");
             readNodeDCS(*node.asDCS());
             break;
         case 11: // LOD
-            if (debugfile) fprintf(debugfile, "hidra::PfbLoader:   node_LOD\n");
             readNodeLOD(*node.asLOD());
             break;
         default:
@@ -867,7 +1900,7 @@ void PfbFile::readNode(PfbNode &node)
 
     PfbNodeEnd nodeEnd;
     readNodeEnd(nodeEnd, pos + nodeSize*4);
-    node.setName(nodeEnd.name.str, nodeEnd.name.length);
+    node.setName(nodeEnd.name.str, nodeEnd.name.length, arena);
 }
 
 void PfbFile::readNodes()
@@ -877,20 +1910,38 @@ void PfbFile::readNodes()
         uint32_t totalSize;   // 257 | 269
     } info;
 
-    fread(&info, sizeof(info), 1, f);
+    readData(&info, sizeof(info), 1);
     bswap(&info.numNodes, 2);
 
-    // long pos = ftell(f);
+    long pos = tellData();
 
-    if (debugfile) fprintf(debugfile, "hidra::PfbLoader: %u nodes\n", info.numNodes);
-    tree->createNodes(info.numNodes);
+    if (stats) countBlock(info.numNodes, info.totalSize);
+    if (visitor) {
+        for (unsigned i=0; i<info.numNodes; ++i) {
+            {
+                PfbNode node;
+                readNode(node);
+                if (error) return;
+                visitor->onNode(i, node);
+            }
+            arena->clear();
+        }
+    }
+    else {
+        tree->createNodes(info.numNodes);
+        arena->reserve(info.totalSize + info.numNodes * (sizeof(PfbNodeLOD) + 16));
 
-    for (unsigned i=0; i<info.numNodes; ++i) {
-        readNode(tree->getNode(i));
-        if (error) return;
+        for (unsigned i=0; i<info.numNodes; ++i) {
+            readNode(tree->getNode(i));
+            if (error) return;
+        }
     }
 
-    // fseek(f, pos + info.totalSize, SEEK_SET);
+    // Only the padding of PfbWriter (to 4 bytes) is skipped: totalSize is
+    // not a byte count in every exporter, parsing ends the block otherwise
+    long padding = pos + (long)info.totalSize - tellData();
+    if (padding > 0 && padding < 4)
+        seekData(padding, SEEK_CUR);
 }
  /* }}} */
 
@@ -903,9 +1954,10 @@ void PfbFile::skipBlock()
         uint32_t num;
         uint32_t totalSize;
     } info;
-    fread(&info, sizeof(info), 1, f);
-    bswap(&info.totalSize, 1);
-    fseek(f, info.totalSize, SEEK_CUR);
+    readData(&info, sizeof(info), 1);
+    bswap(&info.num, 2);
+    if (stats) countBlock(info.num, info.totalSize);
+    seekData(info.totalSize, SEEK_CUR);
 }
 
 //
@@ -917,10 +1969,38 @@ void PfbFile::readNext()
     if (error) return;
 
     uint32_t type;
-    fread(&type, 4, 1, f);
-    if (feof(f)) return;
+    readData(&type, 4, 1);
+    if (endOfData()) return;
     bswap(&type);
 
+    double start = 0;
+    if (stats) {
+        start        = now();
+        currentBlock = type;
+    }
+
+    const char *blockName = getBlockName(type);
+    PfbTraceEvent event(blockName ? blockName : "Unknown block", "openpfb.block");
+
+    if (visitor || event.isActive()) {
+        uint32_t info[2] = { 0, 0 }; // count, totalSize
+        peekWords(info, 2);
+
+        PfbBlockInfo block;
+        block.type      = type;
+        block.offset    = tellData() - 4;
+        block.count     = info[0];
+        block.totalSize = info[1];
+        block.numValues = 0;
+        if (visitor) visitor->onBlock(block);
+
+        event.addArg("file", name.c_str());
+        event.addArg("type", type);
+        event.addArg("offset", block.offset);
+        event.addArg("count", block.count);
+        event.addArg("bytes", 12 + (uint64_t)block.totalSize);
+    }
+
     switch(type)
     {
         case 0: // Materials
@@ -930,7 +2010,6 @@ void PfbFile::readNext()
             readTextures();
             break;
         case 2: // Texenv?
-            if (debugfile) fprintf(debugfile, "hidra::PfbLoader: WARNING, Ignoring TexEnv\n");
             skipBlock();
             break;
         case 3: // GeoStates
@@ -956,15 +2035,12 @@ void PfbFile::readNext()
             break;
         case 17: // TexGens
             skipBlock();
-            if (debugfile) fprintf(debugfile, "hidra::PfbLoader: WARNING, Ignoring TexGens\n");
             break;
         case 18: // Light models
             skipBlock();
-            if (debugfile) fprintf(debugfile, "hidra::PfbLoader: WARNING, Ignoring LightModels\n");
             break;
         case 27: // Images (TODO)
             skipBlock();
-            if (debugfile) fprintf(debugfile, "hidra::PfbLoader: WARNING, Ignoring Images\n");
             break;
         case 12: // Nodes
             readNodes();
@@ -973,21 +2049,433 @@ void PfbFile::readNext()
             printf("hidra::PfbLoader: Unknown block ID: 0x%08x (%u)\n", type, type);
             error = "Unknown block ID";
     }
+
+    if (stats && type < PFBSTATS_BLOCK_TYPES) {
+        stats->blocks[type].numBlocks++;
+        stats->blocks[type].time += now() - start;
+    }
 }
 
 auto_ptr<PfbTree> PfbFile::load()
 {
     if (error) return auto_ptr<PfbTree>(NULL);
-    // debugfile = stderr;
+    PfbTraceEvent event("load");
+
+    // debugfile prints the stats of loads that don't ask for them
+    PfbLoadStats debugStats;
+    if (!stats && debugfile) stats = &debugStats;
+    if (stats) {
+        long size = getFileSize();
+        stats->clear();
+        stats->fileSize = (size > 0) ? size : 0;
+    }
+    double start = stats ? now() : 0;
 
-    tree = new PfbTree();
+    tree  = new PfbTree();
+    arena = &tree->getArena();
     readHeader();
 
-    while (!error) {
+    if ((flags & PFBLOAD_LAZY) && !error) {
+        // The tree reads the lists later, from its own file descriptor,
+        // from the mapping or from the caller's source
+        if (mapData) {
+            lazy = new PfbLazyLists(NULL, false, mapData, mapSize, needBswap);
+            mapShared = true;
+        }
+        else if (f)
+            lazy = new PfbLazyLists(new PfbFdSource(dup(fileno(f)), 0, -1, true), true, NULL, 0, needBswap);
+        else
+            lazy = new PfbLazyLists(source, false, NULL, 0, needBswap);
+        tree->lazy = lazy;
+    }
+
+    bool parallel = (flags & PFBLOAD_PARALLEL) && !error && loadParallel();
+    if (stats) stats->parallel = parallel;
+
+    while (!parallel && !error) {
         readNext();
-        if (feof(f)) break;
+        if (endOfData()) break;
+    }
+
+    if (mapShared && mapOwned)
+        tree->adoptMapping(mapData, mapSize);
+
+    double parsed = stats ? now() : 0;
+    if (!error) {
+        PfbTraceEvent tableEvent("buildNodeTable");
+        tree->buildNodeTable();
     }
+    double tabled = stats ? now() : 0;
 
+    // Lazy trees would read all their vertex lists
+    if (!error && !(flags & (PFBLOAD_NOBOUNDS | PFBLOAD_LAZY))) {
+        PfbTraceEvent boundsEvent("computeBounds");
+        tree->computeBounds((flags & PFBLOAD_PARALLEL) ? 0 : 1);
+    }
+
+    if (stats) {
+        double end = now();
+        stats->parseTime      = parsed - start;
+        stats->nodeTableTime  = tabled - parsed;
+        stats->boundsTime     = end - tabled;
+        stats->totalTime      = end - start;
+        stats->numAllocations = arena->getNumAllocations();
+        stats->allocatedBytes = arena->getSize();
+        if (stats == &debugStats) {
+            fprintf(debugfile, "hidra::PfbLoader: %s\n", name.c_str());
+            stats->print(debugfile);
+            stats = NULL;
+        }
+    }
+    if (event.isActive()) {
+        long size = getFileSize();
+        event.addArg("file", name.c_str());
+        event.addArg("flags", flags);
+        event.addArg("bytes", (size > 0) ? size : 0);
+        event.addArg("nodes", tree->getNumNodes());
+        event.addArg("geosets", tree->getNumGeosets());
+        if (error) event.addArg("error", error);
+    }
     return auto_ptr<PfbTree>(tree);
 }
+
+//
+// VISITOR /* {{{ */
+//
+
+/// Give numLists lists to the visitor callback, in chunks of at most
+/// PFB_VISIT_CHUNK bytes.
+template <typename T, unsigned N>
+void PfbFile::streamLists(uint32_t numLists,
+        void (PfbVisitor::*callback)(uint32_t, const PfbListChunk<T,N> &))
+{
+    const uint32_t chunkSize = PFB_VISIT_CHUNK / (N * sizeof(T));
+
+    for (uint32_t i=0; i<numLists && !error; ++i)
+    {
+        struct {
+            uint32_t size;
+            int32_t  unknown1;
+            int32_t  unknown2;
+        } info;
+        if (readData(&info, sizeof(info), 1) != 1) {
+            error = "Unexpected end of file";
+            return;
+        }
+        bswap(&info.size, 3);
+
+        PfbListChunk<T,N> chunk;
+        chunk.listSize = info.size;
+        chunk.first    = 0;
+        do {
+            chunk.count = info.size - chunk.first;
+            if (chunk.count > chunkSize) chunk.count = chunkSize;
+
+            size_t bytes = (size_t)chunk.count * N * sizeof(T);
+            if (mapData && !needBswap && mapPos + bytes <= mapSize
+                && ((uintptr_t)(mapData + mapPos)) % sizeof(T) == 0)
+            {
+                chunk.data = (const T*)(mapData + mapPos);
+                mapPos += bytes;
+            }
+            else {
+                if (readData(chunkBuffer, N * sizeof(T), chunk.count) != chunk.count) {
+                    error = "Unexpected end of file";
+                    return;
+                }
+                bswap((T*)chunkBuffer, chunk.count * N);
+                chunk.data = (const T*)chunkBuffer;
+            }
+
+            (visitor->*callback)(i, chunk);
+            chunk.first += chunk.count;
+        }
+        while (chunk.first < info.size);
+    }
+}
+
+bool PfbFile::visit(PfbVisitor &visitor)
+{
+    if (error) return false;
+
+    // Nodes, geostates and textures are built one by one in a scratch
+    // arena, emptied after each of them.
+    PfbArena scratch;
+    arena             = &scratch;
+    this->visitor     = &visitor;
+    this->chunkBuffer = new char[PFB_VISIT_CHUNK];
+
+    PfbTraceEvent event("visit");
+    event.addArg("file", name.c_str());
+
+    PfbLoadStats debugStats;
+    if (!stats && debugfile) stats = &debugStats;
+    if (stats) {
+        long size = getFileSize();
+        stats->clear();
+        stats->fileSize = (size > 0) ? size : 0;
+    }
+    double start = stats ? now() : 0;
+
+    PfbHeader header = readHeader();
+    if (!error) visitor.onHeader(header);
+
+    while (!error) {
+        readNext();
+        if (endOfData()) break;
+    }
+
+    if (stats) {
+        stats->parseTime = stats->totalTime = now() - start;
+        if (stats == &debugStats) {
+            fprintf(debugfile, "hidra::PfbLoader: %s\n", name.c_str());
+            stats->print(debugfile);
+            stats = NULL;
+        }
+    }
+
+    delete[] chunkBuffer;
+    chunkBuffer   = NULL;
+    this->visitor = NULL;
+    arena         = NULL;
+    return error == NULL;
+}
+/* }}} */
+
+//
+// TABLE OF CONTENTS /* {{{ */
+//
+
+const char *getBlockName(uint32_t type)
+{
+    switch (type)
+    {
+        case PFBBLOCK_MATERIALS:     return "Materials";
+        case PFBBLOCK_TEXTURES:      return "Textures";
+        case PFBBLOCK_TEXENVS:       return "TexEnvs";
+        case PFBBLOCK_GEOSTATES:     return "GeoStates";
+        case PFBBLOCK_LENGTHLISTS:   return "LengthLists";
+        case PFBBLOCK_VERTEXLISTS:   return "VertexLists";
+        case PFBBLOCK_COLORLISTS:    return "ColorLists";
+        case PFBBLOCK_NORMALLISTS:   return "NormalLists";
+        case PFBBLOCK_TEXCOORDLISTS: return "TexcoordLists";
+        case PFBBLOCK_GEOSETS:       return "GeoSets";
+        case PFBBLOCK_NODES:         return "Nodes";
+        case PFBBLOCK_TEXGENS:       return "TexGens";
+        case PFBBLOCK_LIGHTMODELS:   return "LightModels";
+        case PFBBLOCK_IMAGES:        return "Images";
+        default:                     return NULL;
+    }
+}
+
+long PfbFile::getFileSize()
+{
+    if (mapData) return mapSize;
+    if (source)  return source->getSize();
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0) return -1;
+    return st.st_size;
+}
+
+/// Walk the block headers from the current position, without decoding
+/// the blocks. Returns true if the blocks exactly cover the end of the
+/// file; otherwise some totalSize does not mean what we think.
+bool PfbFile::scanBlocks(vector<PfbBlockInfo> &blocks)
+{
+    long end = getFileSize();
+    long pos = tellData();
+
+    while (pos + 12 <= end)
+    {
+        struct {
+            uint32_t type;
+            uint32_t count;
+            uint32_t totalSize;
+        } header;
+        seekData(pos, SEEK_SET);
+        readData(&header, sizeof(header), 1);
+        bswap(&header.type, 3);
+
+        if (getBlockName(header.type) == NULL) return false;
+
+        // totalSize is not a byte count in every exporter for the nodes
+        // (see readNodes()): they are measured as they are read
+        if (header.type == PFBBLOCK_NODES) {
+            long size = measureNodes(header.count, pos + 12, end);
+            if (size < 0) return false;
+            long padding = (long)header.totalSize - size;
+            header.totalSize = (padding > 0 && padding < 4) ? header.totalSize : size;
+        }
+        if (pos + 12 + (long)header.totalSize > end) return false;
+
+        PfbBlockInfo block;
+        block.type      = header.type;
+        block.offset    = pos;
+        block.count     = header.count;
+        block.totalSize = header.totalSize;
+        block.numValues = 0;
+
+        uint32_t elementSize = listElementSize(block.type);
+        if (elementSize && block.totalSize >= 12 * block.count)
+            block.numValues = (block.totalSize - 12 * block.count) / elementSize;
+
+        blocks.push_back(block);
+        pos += block.getSize();
+    }
+    return pos == end;
+}
+
+/// Bytes of the numNodes nodes at pos, skipped as readNode() reads them
+/// (a size in words, the words, then the name), -1 past end
+long PfbFile::measureNodes(uint32_t numNodes, long pos, long end)
+{
+    seekData(pos, SEEK_SET);
+    for (uint32_t i=0; i<numNodes; ++i) {
+        uint32_t nodeSize = readWord();
+        if (nodeSize > (uint32_t)(end - tellData()) / 4) return -1;
+        seekData((long)nodeSize * 4, SEEK_CUR);
+
+        uint32_t length = readWord();
+        if (length == 0xffffffff) length = 0;
+        if (length > 0x1000 || tellData() + (long)length > end) return -1;
+        seekData(length, SEEK_CUR);
+    }
+    return tellData() - pos;
+}
+
+PfbToc PfbFile::scan()
+{
+    PfbToc toc;
+    memset(&toc.header, 0, sizeof(toc.header));
+    toc.bigEndian = false;
+    toc.fileSize  = 0;
+    toc.complete  = false;
+    if (error) return toc;
+
+    seekData(0, SEEK_SET);
+    toc.header    = readHeader();
+    toc.bigEndian = needBswap != isNativeBigEndian();
+    toc.fileSize  = getFileSize();
+    if (!error)
+        toc.complete = scanBlocks(toc.blocks);
+
+    seekData(0, SEEK_SET);
+    return toc;
+}
+/* }}} */
+
+//
+// PARALLEL LOADING /* {{{ */
+//
+
+struct PfbBlockTask : public PfbTask
+{
+    vector<PfbFile*> &workers;
+
+    PfbBlockTask(vector<PfbFile*> &workers) : workers(workers) {}
+
+    void run(unsigned i)
+    {
+        workers[i]->readNext();
+    }
+};
+
+static bool biggerBlock(const PfbBlockInfo &a, const PfbBlockInfo &b)
+{
+    return a.totalSize > b.totalSize;
+}
+
+/// Find the blocks from their headers, then decode them concurrently.
+/// Returns false (with the file rewound after the header) when the block
+/// layout does not allow it; the caller then loads sequentially.
+bool PfbFile::loadParallel()
+{
+    long start = tellData();
+    long end   = getFileSize();
+
+    // Phase 1: walk the block headers
+    vector<PfbBlockInfo> blocks;
+    bool valid;
+    {
+        PfbTraceEvent event("scanBlocks");
+        valid = scanBlocks(blocks);
+        event.addArg("blocks", blocks.size());
+    }
+
+    // Same block type twice would have two workers filling the same tree
+    // lists.
+    uint32_t seen = 0;
+    for (unsigned i=0; valid && i<blocks.size(); ++i) {
+        if (seen & (1u << blocks[i].type)) valid = false;
+        seen |= 1u << blocks[i].type;
+    }
+
+    if (!valid) {
+        seekData(start, SEEK_SET);
+        return false;
+    }
+
+    // Phase 2: decode, biggest blocks first
+    std::sort(blocks.begin(), blocks.end(), biggerBlock);
+    vector<PfbFile*> workers(blocks.size());
+    vector<PfbLoadStats> workerStats(stats ? blocks.size() : 0);
+    for (unsigned i=0; i<blocks.size(); ++i) {
+        workers[i] = new PfbFile(*this, blocks[i].offset);
+        if (stats) workers[i]->setStats(&workerStats[i]);
+    }
+
+    {
+        PfbTraceEvent event("decodeBlocks");
+        PfbBlockTask task(workers);
+        parallelFor(task, blocks.size());
+    }
+
+    long firstError = end;
+    for (unsigned i=0; i<workers.size(); ++i) {
+        if (workers[i]->error && blocks[i].offset < firstError) {
+            error      = workers[i]->error;
+            firstError = blocks[i].offset;
+        }
+        if (workers[i]->mapShared) mapShared = true;
+        if (stats) stats->add(workerStats[i]);
+        arena->adopt(*workers[i]->arena);
+        delete workers[i];
+    }
+    return true;
+}
+/* }}} */
+
+//
+// BATCH LOADING /* {{{ */
+//
+
+struct PfbLoadManyTask : public PfbTask
+{
+    const vector<string>  &names;
+    vector<PfbLoadResult> &results;
+    unsigned               flags;
+
+    PfbLoadManyTask(const vector<string> &names, vector<PfbLoadResult> &results, unsigned flags)
+        : names(names), results(results), flags(flags) {}
+
+    void run(unsigned i)
+    {
+        PfbFile file(names[i], flags);
+        auto_ptr<PfbTree> tree = file.load();
+
+        PfbLoadResult &result = results[i];
+        result.name  = names[i];
+        result.error = file.getError();
+        result.tree  = file.loadFailed() ? NULL : tree.release();
+    }
+};
+
+vector<PfbLoadResult> PfbFile::loadMany(const vector<string> &names, unsigned numThreads, unsigned flags)
+{
+    vector<PfbLoadResult> results(names.size());
+    PfbLoadManyTask task(names, results, flags);
+    parallelFor(task, names.size(), numThreads);
+    return results;
+}
+/* }}} */
 }
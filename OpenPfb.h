@@ -4,26 +4,95 @@
 #include <stdint.h>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
 
 #include <memory>
 #include <string>
+#include <vector>
+#include <new>
 
 namespace openpfb
 {
-    extern FILE *debugfile; // default is NULL, change to activate debugging
+    extern FILE *debugfile; // default is NULL, set to print the PfbLoadStats of every load()
+
+    /// @class PfbArena
+    ///
+    /// @brief Memory owned by a PfbTree
+    ///
+    /// Allocations are carved out of big chunks and are only released all
+    /// together, when the arena is destroyed.
+    class PfbArena
+    {
+        public:
+            PfbArena();
+            ~PfbArena();
+
+            /// Allocate bytes, 16-byte aligned
+            void *allocate(size_t bytes) {
+                bytes = (bytes + 15) & ~(size_t)15;
+                if (bytes > left) grow(bytes);
+                void *ret = current;
+                current += bytes;
+                left    -= bytes;
+                used    += bytes;
+                allocations++;
+                return ret;
+            }
+            template <typename T>
+            T *allocate(size_t num) { return (T*)allocate(num * sizeof(T)); }
+
+            /// Make sure the next bytes of allocations fit in one chunk
+            void reserve(size_t bytes) { if (bytes > left) grow(bytes); }
+
+            /// Take ownership of other's memory, other is left empty
+            void adopt(PfbArena &other);
+
+            /// Release all allocations at once. The biggest chunk is kept
+            /// for the next allocations.
+            void clear();
+
+            /// Bytes handed out so far
+            size_t getSize() const { return used; }
+            /// Allocations handed out so far
+            size_t getNumAllocations() const { return allocations; }
+            /// Number of chunks allocated from the system
+            size_t getNumChunks() const { return chunks.size(); }
+
+        private:
+            std::vector<char*>  chunks;
+            std::vector<size_t> chunkSizes;
+            char  *current;
+            size_t left;
+            size_t used;
+            size_t allocations;
+
+            void grow(size_t bytes);
+
+            PfbArena(const PfbArena &);
+            PfbArena &operator=(const PfbArena &);
+    };
 
     template <typename T, unsigned N>
     class PfbList
     {
         public:
-            PfbList() : size(0), array(NULL) {}
+            PfbList() : size(0), array(NULL), owner(true) {}
             ~PfbList() {
-                if (array) delete[] array;
+                if (array && owner) delete[] array;
             }
             void allocate(unsigned size) {
                 this->size = size;
                 array = new T[size * N];
+                owner = true;
+            }
+            /// Make the list point to external data (not owned, not freed)
+            void attach(T *data, unsigned size) {
+                this->size = size;
+                array = data;
+                owner = false;
             }
+            /// True if the list data is owned by someone else (see attach)
+            bool isAttached() const { return !owner; }
             T *get(unsigned i) {
                 return array + i * N;
             }
@@ -40,6 +109,7 @@ namespace openpfb
         private:
             unsigned size;
             T *array;
+            bool owner;
     };
 
     class PfbVertexList : public PfbList<float,3> {};
@@ -98,15 +168,23 @@ namespace openpfb
     class PfbGeoState
     {
         public:
-        PfbGeoState() : numValues(0), values(NULL) {}
-        ~PfbGeoState() { if (values) delete[]values; }
+        PfbGeoState() : numValues(0), values(NULL), owner(true) {}
+        ~PfbGeoState() { if (values && owner) delete[]values; }
 
-        void setNumValues(unsigned num) {
+        void setNumValues(unsigned num, PfbArena *arena = NULL) {
             numValues=num;
-            values=new int32_t[num];
+            owner = (arena == NULL);
+            values = arena ? arena->allocate<int32_t>(num) : new int32_t[num];
             for (unsigned i=0; i<num; ++i)
                 values[i] = -1;
         }
+        /// Use external storage for the values (not freed)
+        void attachValues(int32_t num, int32_t *values) {
+            numValues = num;
+            this->values = values;
+            owner = false;
+        }
+        int32_t getNumValues() const { return numValues; }
         int32_t getValue(int i) const {
             if ((i-1)<numValues) return values[i-1]; else return 0;
         }
@@ -117,6 +195,7 @@ namespace openpfb
         private:
         int32_t  numValues;
         int32_t *values;
+        bool     owner;
     };
 
     struct PfbGeoSet
@@ -147,11 +226,14 @@ namespace openpfb
     {
         uint32_t numChildren;
         uint32_t *childs; // (numChildren) uint
+        bool      owner;  // childs is not in an arena
 
         PfbChilds();
         ~PfbChilds();
         
-        void     setNumChildren(uint32_t num);
+        void     setNumChildren(uint32_t num, PfbArena *arena = NULL);
+        /// Use external storage for the children ids (not freed)
+        void     attachChildren(uint32_t num, uint32_t *childs);
         uint32_t getNumChildren() const     { return numChildren; }
         uint32_t getChild(uint32_t i) const { return childs[i]; }
     };
@@ -163,12 +245,15 @@ namespace openpfb
             float    *ranges;      // (numRanges+1) float
             float     center[3];   // center of geometry (?)
             PfbChilds childs;
+            bool      owner;
 
         public:
             PfbNodeLOD();
             ~PfbNodeLOD();
 
-            void setNumRanges(uint32_t num);
+            void setNumRanges(uint32_t num, PfbArena *arena = NULL);
+            /// Use external storage for the (num+1) ranges (not freed)
+            void attachRanges(uint32_t num, float *ranges);
 
             /// Return the number of defined ranges
             uint32_t     getNumRanges() const        { return numRanges;  }
@@ -196,12 +281,15 @@ namespace openpfb
         private:
             uint32_t  numGeosets;
             uint32_t *geosets;
+            bool      owner;
 
         public:
             PfbNodeGeode();
             ~PfbNodeGeode();
 
-            void setNumGeosets(uint32_t num);
+            void setNumGeosets(uint32_t num, PfbArena *arena = NULL);
+            /// Use external storage for the geosets ids (not freed)
+            void attachGeosets(uint32_t num, uint32_t *geosets);
             uint32_t getNumGeosets() const     { return numGeosets; }
 
             uint32_t *getGeosets()             { return geosets; }
@@ -245,6 +333,8 @@ namespace openpfb
     {
         private:
             uint32_t type;
+            bool     ownData; // payload is not in an arena
+            bool     ownName; // name is not in an arena
             union {
                 PfbNodeGeode *geode; // type 2
                 PfbNodeGroup *group; // type 5
@@ -264,18 +354,173 @@ namespace openpfb
             PfbNodeDCS   *asDCS()   { return (type==7)  ? data.dcs   : NULL; }
             PfbNodeLOD   *asLOD()   { return (type==11) ? data.lod   : NULL; }
 
-            void setType(uint32_t type);
+            const PfbNodeGeode *asGeode() const { return (type==2)  ? data.geode : NULL; }
+            const PfbNodeGroup *asGroup() const { return (type==5)  ? data.group : NULL; }
+            const PfbNodeSCS   *asSCS()   const { return (type==6)  ? data.scs   : NULL; }
+            const PfbNodeDCS   *asDCS()   const { return (type==7)  ? data.dcs   : NULL; }
+            const PfbNodeLOD   *asLOD()   const { return (type==11) ? data.lod   : NULL; }
+
+            /// Create the payload for the type, in arena if given
+            void setType(uint32_t type, PfbArena *arena = NULL);
             uint32_t getType() const { return type; }
 
-            void setName(const char *str, uint32_t strlength);
+            void setName(const char *str, uint32_t strlength, PfbArena *arena = NULL);
+            /// Use an external, nul-terminated name (not freed)
+            void attachName(char *str);
             const char *getName() const { return name; }
     };
+
+    class PfbTree;
+    class PfbNodeHandle;
+
+    /// @class PfbNodeTable
+    ///
+    /// @brief Flat copy of the nodes of a tree
+    ///
+    /// One type and one payload index per node; the children of all the
+    /// nodes in one array (CSR: the children of node i are
+    /// children[childOffsets[i] .. childOffsets[i+1])), same for the
+    /// geosets of the geodes; matrices, LOD ranges and centers in dense
+    /// tables indexed by the payload index. Walking it touches contiguous
+    /// memory only.
+    class PfbNodeTable
+    {
+        public:
+            PfbNodeTable() : childOffsets(1, 0), geosetOffsets(1, 0) {}
+
+            /// Copy the nodes of tree. Names still point into the tree.
+            void build(PfbTree &tree);
+
+            uint32_t      getNumNodes() const { return types.size(); }
+            PfbNodeHandle getNode(uint32_t i) const;
+            PfbNodeHandle getRootNode() const;
+
+            uint32_t getType(uint32_t i) const { return types[i]; }
+            const char *getName(uint32_t i) const { return names[i]; }
+
+            uint32_t        getNumChildren(uint32_t i) const { return childOffsets[i+1] - childOffsets[i]; }
+            const uint32_t *getChildren(uint32_t i) const    { return children.empty() ? NULL : &children[0] + childOffsets[i]; }
+
+            /// SCS/DCS matrix (float[16])
+            const float *getMatrix(uint32_t i) const { return &matrices[16 * payloads[i]]; }
+
+            /// LOD ranges (getNumRanges() + 1 floats) and center (float[3])
+            uint32_t     getNumRanges(uint32_t i) const {
+                return rangeOffsets[payloads[i] + 1] - rangeOffsets[payloads[i]] - 1;
+            }
+            const float *getRanges(uint32_t i) const { return &ranges[rangeOffsets[payloads[i]]]; }
+            const float *getCenter(uint32_t i) const { return &centers[3 * payloads[i]]; }
+
+            /// Geosets of a geode
+            uint32_t getNumGeosets(uint32_t i) const {
+                return geosetOffsets[payloads[i] + 1] - geosetOffsets[payloads[i]];
+            }
+            const uint32_t *getGeosets(uint32_t i) const { return geosets.empty() ? NULL : &geosets[0] + geosetOffsets[payloads[i]]; }
+
+        private:
+            std::vector<uint8_t>     types;
+            std::vector<uint32_t>    payloads;      // in the table of the type
+            std::vector<const char*> names;
+            std::vector<uint32_t>    childOffsets;  // numNodes + 1
+            std::vector<uint32_t>    children;
+            std::vector<float>       matrices;      // 16 per SCS/DCS
+            std::vector<uint32_t>    rangeOffsets;  // numLODs + 1
+            std::vector<float>       ranges;
+            std::vector<float>       centers;       // 3 per LOD
+            std::vector<uint32_t>    geosetOffsets; // numGeodes + 1
+            std::vector<uint32_t>    geosets;
+    };
+
+    /// @class PfbNodeHandle
+    ///
+    /// @brief Node of a PfbNodeTable, passed by value
+    class PfbNodeHandle
+    {
+        public:
+            PfbNodeHandle(const PfbNodeTable &table, uint32_t id) : table(&table), id(id) {}
+
+            uint32_t getId() const   { return id; }
+            uint32_t getType() const { return table->getType(id); }
+            const char *getName() const { return table->getName(id); }
+
+            bool isGeode() const { return getType() == 2;  }
+            bool isGroup() const { return getType() == 5;  }
+            bool isSCS() const   { return getType() == 6;  }
+            bool isDCS() const   { return getType() == 7;  }
+            bool isLOD() const   { return getType() == 11; }
+
+            uint32_t        getNumChildren() const    { return table->getNumChildren(id); }
+            const uint32_t *getChildren() const       { return table->getChildren(id); }
+            PfbNodeHandle   getChild(uint32_t i) const { return PfbNodeHandle(*table, getChildren()[i]); }
+
+            /// SCS and DCS only
+            const float *getMatrix() const { return table->getMatrix(id); }
+
+            /// LOD only
+            uint32_t     getNumRanges() const { return table->getNumRanges(id); }
+            const float *getRanges() const    { return table->getRanges(id); }
+            const float *getCenter() const    { return table->getCenter(id); }
+
+            /// Geode only
+            uint32_t        getNumGeosets() const { return table->getNumGeosets(id); }
+            const uint32_t *getGeosets() const    { return table->getGeosets(id); }
+
+        private:
+            const PfbNodeTable *table;
+            uint32_t            id;
+    };
+
+    inline PfbNodeHandle PfbNodeTable::getNode(uint32_t i) const { return PfbNodeHandle(*this, i); }
+    inline PfbNodeHandle PfbNodeTable::getRootNode() const       { return PfbNodeHandle(*this, 0); }
    
+    /// @struct PfbBox
+    ///
+    /// @brief Axis aligned box, empty when min > max
+    struct PfbBox
+    {
+        float min[3];
+        float max[3];
+
+        /// Empty box
+        PfbBox();
+
+        bool isEmpty() const { return min[0] > max[0]; }
+        void extend(const PfbBox &box);
+        bool overlaps(const PfbBox &box) const;
+        float area() const;
+    };
+
+    /// Box of count points src[3*i]
+    PfbBox computeBox(const float *points, uint32_t count);
+
+    /// Box containing box transformed by m (row vectors)
+    PfbBox transformBox(const PfbBox &box, const float *m);
+
+    /// @struct PfbBounds
+    ///
+    /// @brief Box and sphere containing some geometry
+    struct PfbBounds
+    {
+        PfbBox box;
+        float  center[3];
+        float  radius;    // -1 when empty
+
+        /// Empty bounds
+        PfbBounds();
+
+        bool isEmpty() const { return box.isEmpty(); }
+    };
+
+    struct PfbLazyLists;
+
     /// @class PfbTree
     ///
     /// @brief Scene graph
     class PfbTree
     {
+        friend class PfbFile;
+        friend struct PfbLazyLists;
+
         public:
             PfbTree();
             ~PfbTree();
@@ -286,11 +531,11 @@ namespace openpfb
             PfbNode         &getRootNode()                 { return getNode(0); }
             PfbNode         &getNode(unsigned i)           { return nodes[i];   }
 
-            PfbLengthList   &getLengthList(unsigned i)     { return lengthList[i];   }
-            PfbVertexList   &getVertexList(unsigned i)     { return vertexList[i];   }
-            PfbNormalList   &getNormalList(unsigned i)     { return normalList[i];   }
-            PfbTexcoordList &getTexcoordList(unsigned i)   { return texcoordList[i]; }
-            PfbColorList    &getColorList(unsigned i)      { return colorList[i];    }
+            PfbLengthList   &getLengthList(unsigned i)     { if (lazy) loadList(LENGTH_LIST, i);   return lengthList[i];   }
+            PfbVertexList   &getVertexList(unsigned i)     { if (lazy) loadList(VERTEX_LIST, i);   return vertexList[i];   }
+            PfbNormalList   &getNormalList(unsigned i)     { if (lazy) loadList(NORMAL_LIST, i);   return normalList[i];   }
+            PfbTexcoordList &getTexcoordList(unsigned i)   { if (lazy) loadList(TEXCOORD_LIST, i); return texcoordList[i]; }
+            PfbColorList    &getColorList(unsigned i)      { if (lazy) loadList(COLOR_LIST, i);    return colorList[i];    }
             PfbMaterial     &getMaterial(unsigned i)       { return materials[i];    }
             PfbTexture      &getTexture(unsigned i)        { return textures[i];     }
             PfbGeoState     &getGeoState(unsigned i)       { return geostates[i];    }
@@ -333,6 +578,41 @@ namespace openpfb
 
             /// @}
 
+            /// @name Bounds
+            /// @{
+
+            /// True once computeBounds() ran, as load() does unless
+            /// PFBLOAD_NOBOUNDS or PFBLOAD_LAZY is given
+            bool haveBounds() const { return boundsComputed; }
+
+            /// Bounds of the vertex list of geoset i
+            const PfbBounds &getGeoSetBounds(unsigned i) const { return geosetBounds[i]; }
+
+            /// Bounds of node i and everything below it, in the space of
+            /// its parents (its own SCS/DCS matrix applied, DCS with its
+            /// current matrix). All the children of LOD nodes count.
+            const PfbBounds &getNodeBounds(unsigned i) const { return nodeBounds[i]; }
+
+            /// Compute the bounds of the geosets, concurrently on
+            /// numThreads threads (0 = one per processor), then of the
+            /// nodes from the geodes up. To be called again after the
+            /// tree has changed.
+            void computeBounds(unsigned numThreads = 0);
+
+            /// @}
+
+            /// Flat copy of the nodes, built by load(). To be built again
+            /// with buildNodeTable() after the nodes have changed.
+            const PfbNodeTable &getNodeTable() const { return nodeTable; }
+            void buildNodeTable() { nodeTable.build(*this); }
+
+            /// Memory of the loaded nodes, lists, names, ...
+            PfbArena &getArena() { return arena; }
+
+            /// Keep a mapped file alive as long as the tree exists.
+            /// Used when lists point directly into the mapping.
+            void adoptMapping(void *address, size_t length);
+
         private:
             PfbLengthList *lengthList;
             PfbVertexList *vertexList;
@@ -355,40 +635,403 @@ namespace openpfb
             unsigned numGeoStates;
             unsigned numGeoSets;
             unsigned numNodes;
+
+            void    *mapAddress;
+            size_t   mapLength;
+
+            PfbNodeTable           nodeTable;
+            bool                   boundsComputed;
+            std::vector<PfbBounds> geosetBounds;
+            std::vector<PfbBounds> nodeBounds;
+            const PfbBounds &computeNodeBounds(uint32_t i, std::vector<unsigned char> &state);
+
+            PfbArena arena;
+
+            // PFBLOAD_LAZY: lists still in the file
+            enum ListKind {
+                LENGTH_LIST, VERTEX_LIST, COLOR_LIST, NORMAL_LIST, TEXCOORD_LIST,
+                NUM_LIST_KINDS
+            };
+            PfbLazyLists *lazy;
+            void loadList(ListKind kind, unsigned i);
+            template <typename T, unsigned N>
+            void decodeList(PfbList<T,N> &list, long offset);
     };
    
     struct PfbString; 
     struct PfbNodeEnd;
+    struct PfbBlockTask;
+
+/// Map the file in memory instead of reading it with stdio. Lists of
+/// native-endian files then point straight into the mapping.
+#define PFBLOAD_MMAP 0x0001
+
+/// Locate the blocks from their headers first, then decode them
+/// concurrently with positioned reads.
+#define PFBLOAD_PARALLEL 0x0002
+
+/// Only record where the attribute lists are. A list is read the first
+/// time it is accessed (thread-safe).
+#define PFBLOAD_LAZY 0x0004
+
+/// Do not compute the bounds of the geosets and nodes after loading (see
+/// PfbTree::computeBounds())
+#define PFBLOAD_NOBOUNDS 0x0008
+
+    /// @struct PfbLoadResult
+    ///
+    /// @brief Outcome of one file of PfbFile::loadMany()
+    struct PfbLoadResult
+    {
+        std::string name;
+        PfbTree    *tree;  // NULL on failure, to be deleted by the caller
+        const char *error; // NULL on success
+
+        PfbLoadResult() : tree(NULL), error(NULL) {}
+    };
+
+#define PFBBLOCK_MATERIALS    0
+#define PFBBLOCK_TEXTURES     1
+#define PFBBLOCK_TEXENVS      2
+#define PFBBLOCK_GEOSTATES    3
+#define PFBBLOCK_LENGTHLISTS  4
+#define PFBBLOCK_VERTEXLISTS  5
+#define PFBBLOCK_COLORLISTS   6
+#define PFBBLOCK_NORMALLISTS  7
+#define PFBBLOCK_TEXCOORDLISTS 8
+#define PFBBLOCK_GEOSETS      10
+#define PFBBLOCK_NODES        12
+#define PFBBLOCK_TEXGENS      17
+#define PFBBLOCK_LIGHTMODELS  18
+#define PFBBLOCK_IMAGES       27
+
+    /// Return a printable name for a PFBBLOCK_* type, NULL if unknown
+    const char *getBlockName(uint32_t type);
+
+    struct PfbHeader
+    {
+        uint32_t magic; // 0xdb0ace00
+        uint32_t unknown1;
+        uint32_t unknown2;
+        uint32_t unknown3;
+    };
+
+    /// @struct PfbBlockInfo
+    ///
+    /// @brief Location and size of a top-level block
+    struct PfbBlockInfo
+    {
+        uint32_t type;        // PFBBLOCK_*
+        long     offset;      // position of the block in the file
+        uint32_t count;       // number of elements (lists, nodes, ...)
+        uint32_t totalSize;   // bytes of the elements, after the block header
+        uint32_t numValues;   // lists only: vertices, colors, ... in all lists
+
+        /// Size of the block in the file, header included
+        long getSize() const { return 12 + (long)totalSize; }
+    };
+
+    /// @struct PfbToc
+    ///
+    /// @brief Table of contents of a file, see PfbFile::scan()
+    struct PfbToc
+    {
+        PfbHeader header;
+        bool      bigEndian;
+        long      fileSize;
+        std::vector<PfbBlockInfo> blocks;
+
+        /// True when the blocks exactly cover the file
+        bool      complete;
+    };
+
+/// Most bytes of list data in one PfbListChunk
+#define PFB_VISIT_CHUNK (64*1024)
+
+    /// @struct PfbListChunk
+    ///
+    /// @brief Consecutive elements of a list, given to a PfbVisitor
+    template <typename T, unsigned N>
+    struct PfbListChunk
+    {
+        uint32_t listSize; // number of elements in the whole list
+        uint32_t first;    // index of the first element of the chunk
+        uint32_t count;    // number of elements in the chunk
+        const T *data;     // count * N values
+
+        const T *get(unsigned i) const { return data + i * N; }
+    };
+
+#define PFBSTATS_BLOCK_TYPES 32
+
+    /// @struct PfbBlockStats
+    ///
+    /// @brief Blocks of one type read by a load, see PfbLoadStats
+    struct PfbBlockStats
+    {
+        uint32_t numBlocks;
+        uint32_t count;     // elements (lists, nodes, ...)
+        uint64_t numValues; // lists only: vertices, colors, ... in all lists
+        uint64_t bytes;     // in the file, block headers included
+        double   time;      // seconds, summed over the workers with PFBLOAD_PARALLEL
+    };
+
+    /// @struct PfbLoadStats
+    ///
+    /// @brief Measures of one PfbFile::load() or visit(), see
+    /// PfbFile::setStats()
+    struct PfbLoadStats
+    {
+        PfbBlockStats blocks[PFBSTATS_BLOCK_TYPES]; // indexed by PFBBLOCK_*
+
+        uint64_t fileSize;
+        uint64_t numReads;       // read calls to the file (none when mapped)
+        uint64_t numSeeks;
+        uint64_t numAllocations; // from the tree arena
+        uint64_t allocatedBytes;
+
+        /// The blocks were decoded concurrently: PFBLOAD_PARALLEL was
+        /// given and the block layout allowed it (otherwise the load is
+        /// sequential)
+        bool     parallel;
+
+        double   parseTime;      // seconds: header and blocks
+        double   nodeTableTime;
+        double   boundsTime;
+        double   totalTime;
+
+        PfbLoadStats() { clear(); }
+        void clear() { memset(this, 0, sizeof(*this)); }
+
+        /// Add the counters and block measures of other
+        void add(const PfbLoadStats &other);
+
+        /// File megabytes (2^20 bytes) loaded per second
+        double getMBPerSecond() const { return totalTime > 0 ? fileSize / 1048576.0 / totalTime : 0; }
+
+        /// Print a summary, one line per block type
+        void print(FILE *out) const;
+    };
+
+    /// @class PfbVisitor
+    ///
+    /// @brief Receives the content of a file as it is parsed, see
+    /// PfbFile::visit(). Objects given to callbacks are only valid during
+    /// the call. Lists arrive in chunks of bounded size, in order; an empty
+    /// list comes as one empty chunk.
+    class PfbVisitor
+    {
+        public:
+            virtual ~PfbVisitor() {}
+
+            virtual void onHeader(const PfbHeader &) {}
+
+            /// Called before the content of every block, even skipped ones
+            virtual void onBlock(const PfbBlockInfo &) {}
+
+            virtual void onMaterial(uint32_t /*id*/, const PfbMaterial &) {}
+            virtual void onTexture(uint32_t /*id*/, const PfbTexture &) {}
+            virtual void onGeoState(uint32_t /*id*/, const PfbGeoState &) {}
+
+            virtual void onLengthList(uint32_t /*id*/, const PfbListChunk<uint32_t,1> &) {}
+            virtual void onVertexList(uint32_t /*id*/, const PfbListChunk<float,3> &) {}
+            virtual void onColorList(uint32_t /*id*/, const PfbListChunk<float,4> &) {}
+            virtual void onNormalList(uint32_t /*id*/, const PfbListChunk<float,3> &) {}
+            virtual void onTexcoordList(uint32_t /*id*/, const PfbListChunk<float,2> &) {}
+
+            virtual void onGeoSet(uint32_t /*id*/, const PfbGeoSet &) {}
+            virtual void onNode(uint32_t /*id*/, const PfbNode &) {}
+    };
+
+    /// @class PfbSource
+    ///
+    /// @brief Where a PfbFile reads its data, see PfbFile(PfbSource &)
+    ///
+    /// Derive from it to load from anywhere (pack files, network,
+    /// decompressor, ...). read() is called at any offset, and
+    /// concurrently with PFBLOAD_PARALLEL and PFBLOAD_LAZY.
+    class PfbSource
+    {
+        public:
+            virtual ~PfbSource() {}
+
+            /// Copy the size bytes at offset to dst. Returns the number of
+            /// bytes copied, less than size only at the end of the data
+            /// or on error.
+            virtual size_t read(void *dst, size_t size, uint64_t offset) = 0;
+
+            /// Size of the data in bytes
+            virtual uint64_t getSize() = 0;
+
+            /// All the data in memory, read in place without any copy,
+            /// NULL (the default) if it is not. The loaded tree aliases
+            /// it: writing to its lists writes to the data.
+            virtual char *getData() { return NULL; }
+    };
+
+    /// @class PfbFdSource
+    ///
+    /// @brief Data at an offset of an open file, e.g. a pfb stored in a
+    /// pack file
+    class PfbFdSource : public PfbSource
+    {
+        public:
+            /// @param size     bytes from offset, < 0 up to the end of the file
+            /// @param closeFd  close fd when the source is destroyed
+            PfbFdSource(int fd, long offset = 0, long size = -1, bool closeFd = false);
+            ~PfbFdSource();
+
+            size_t read(void *dst, size_t size, uint64_t offset);
+            uint64_t getSize() { return size; }
+
+        private:
+            int      fd;
+            uint64_t offset;
+            uint64_t size;
+            bool     closeFd;
+    };
+
+    /// @class PfbMemorySource
+    ///
+    /// @brief Data already in memory. Nothing is copied: native-endian
+    /// lists point into it, it must outlive the loaded tree, and
+    /// changes to these lists are made in the data. Copy read-only
+    /// memory first, or load it through a PfbSource without getData().
+    class PfbMemorySource : public PfbSource
+    {
+        public:
+            PfbMemorySource(void *data, size_t size) : data((char*)data), size(size) {}
+
+            size_t read(void *dst, size_t size, uint64_t offset);
+            uint64_t getSize() { return size; }
+            char *getData() { return data; }
+
+        private:
+            char   *data;
+            size_t  size;
+    };
 
     /// @class PfbFile
     ///
     /// @brief PFB Loader
     class PfbFile
     {
-        struct PfbHeader
-        {
-            uint32_t magic; // 0xdb0ace00
-            uint32_t unknown1;
-            uint32_t unknown2;
-            uint32_t unknown3;
-        };
+        friend struct PfbBlockTask;
 
         public:
-            PfbFile(const std::string &name);
+            /// @param flags  combination of PFBLOAD_* values
+            PfbFile(const std::string &name, unsigned flags = 0);
+
+            /// Read from source, which must outlive the PfbFile, and the
+            /// loaded tree with PFBLOAD_LAZY or a memory source.
+            /// PFBLOAD_MMAP is ignored, the data of memory sources is
+            /// always used in place. name only identifies the data in
+            /// stats and traces.
+            PfbFile(PfbSource &source, unsigned flags = 0, const std::string &name = "");
             ~PfbFile();
 
             std::auto_ptr<PfbTree> load();
             bool loadFailed() const;
+
+            /// Fill stats during the next load() or visit(), NULL (the
+            /// default) to measure nothing. stats is cleared first.
+            void setStats(PfbLoadStats *stats) { this->stats = stats; }
             const char *getError() const;
 
+            /// Parse the file without building a tree: its content is given
+            /// to the visitor. Memory use does not depend on the file size.
+            /// Returns false on failure (see getError()).
+            bool visit(PfbVisitor &visitor);
+
+            /// Build the table of contents of the file, reading only the
+            /// block headers. The scan stops at the first block that is
+            /// not understood (then toc.complete is false). The size of
+            /// the nodes block is measured from its nodes: its totalSize
+            /// is not a byte count in every exporter.
+            PfbToc scan();
+
+            /// Load several files concurrently on numThreads threads
+            /// (0 = one per processor). Results are in the order of names.
+            static std::vector<PfbLoadResult> loadMany(
+                    const std::vector<std::string> &names,
+                    unsigned numThreads = 0, unsigned flags = 0);
+
         private:
             std::string   name;
+            unsigned flags;
             FILE    *f;
             PfbTree *tree;
-            char    *error;
+            const char *error;
+            bool     needBswap; // file endianness differs from ours
+            PfbArena *arena;    // where the tree content is allocated
+            PfbLazyLists *lazy; // PFBLOAD_LAZY
+
+            // setStats()
+            PfbLoadStats *stats;
+            uint32_t      currentBlock; // type of the block being read
+
+            void countBlock(uint32_t count, uint32_t totalSize);
+
+            // visit()
+            PfbVisitor *visitor;
+            char       *chunkBuffer;
+
+            template <typename T, unsigned N>
+            void streamLists(uint32_t numLists,
+                    void (PfbVisitor::*callback)(uint32_t, const PfbListChunk<T,N> &));
+
+            // PFBLOAD_MMAP, or the data of a memory source
+            char    *mapData;
+            size_t   mapSize;
+            size_t   mapPos;
+            bool     mapShared; // some lists point into the mapping
+            bool     mapOwned;  // mapped by us
+
+            // Files that are not mapped, and sources, are read through
+            // readBuffer. PFBLOAD_PARALLEL: workers decoding one block
+            // each, with their own buffer.
+            PfbFile   *parent;
+            PfbSource *source;
+            bool       ownSource;
+            long       filePos;
+            char      *readBuffer;
+            long       bufferOffset;
+            size_t     bufferLength;
+
+            bool     dataEof;
+
+            PfbFile(PfbFile &parent, long offset);
+            long getFileSize();
+            bool scanBlocks(std::vector<PfbBlockInfo> &blocks);
+            long measureNodes(uint32_t numNodes, long pos, long end);
+            bool loadParallel();
+            size_t readPositioned(void *dst, size_t bytes);
+            bool   fillBuffer(size_t bytes);
+
+            void bswap(uint32_t *array, uint32_t size = 1) const;
+            void bswap(int32_t  *array, uint32_t size = 1) const;
+            void bswap(float    *array, uint32_t size = 1) const;
+
+            size_t readData(void *dst, size_t size, size_t count);
+
+            // Typed reads in our byte order, served from the mapping or
+            // readBuffer without any call when possible
+            inline const char *take(size_t bytes);
+            inline uint32_t    readWord();
+            inline uint32_t    peekWord();
+            inline bool        peekWords(uint32_t *dst, uint32_t count);
+            inline void        readWords(void *dst, uint32_t count);
+            void   seekData(long offset, int whence);
+            long   tellData();
+            bool   endOfData();
+
+            template <typename T, unsigned N>
+            void readListData(PfbList<T,N> &list, unsigned size);
 
             PfbHeader readHeader();
 
+            void skipLists(unsigned kind, unsigned numLists, unsigned elementSize);
+
             void readLengthList(PfbLengthList &list);
             void readLengthLists();
 
@@ -0,0 +1,150 @@
+#include "OpenPfbBswap.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define OPENPFB_X86 1
+#include <immintrin.h>
+#endif
+
+namespace openpfb
+{
+
+//
+// SCALAR /* {{{ */
+//
+
+static void swapScalar(uint32_t *array, size_t size)
+{
+    for (size_t i=0; i<size; ++i)
+        array[i] = __builtin_bswap32(array[i]);
+}
+
+static void swapCopyScalar(uint32_t *dst, const uint32_t *src, size_t size)
+{
+    for (size_t i=0; i<size; ++i)
+        dst[i] = __builtin_bswap32(src[i]);
+}
+/* }}} */
+
+#ifdef OPENPFB_X86
+
+//
+// SSSE3 /* {{{ */
+//
+
+__attribute__((target("ssse3")))
+static void swapCopySSSE3(uint32_t *dst, const uint32_t *src, size_t size)
+{
+    const __m128i mask = _mm_set_epi8(12,13,14,15, 8,9,10,11, 4,5,6,7, 0,1,2,3);
+
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + i + 4));
+        __m128i c = _mm_loadu_si128((const __m128i*)(src + i + 8));
+        __m128i d = _mm_loadu_si128((const __m128i*)(src + i + 12));
+        _mm_storeu_si128((__m128i*)(dst + i),      _mm_shuffle_epi8(a, mask));
+        _mm_storeu_si128((__m128i*)(dst + i + 4),  _mm_shuffle_epi8(b, mask));
+        _mm_storeu_si128((__m128i*)(dst + i + 8),  _mm_shuffle_epi8(c, mask));
+        _mm_storeu_si128((__m128i*)(dst + i + 12), _mm_shuffle_epi8(d, mask));
+    }
+    for (; i + 4 <= size; i += 4) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_shuffle_epi8(a, mask));
+    }
+    swapCopyScalar(dst + i, src + i, size - i);
+}
+
+__attribute__((target("ssse3")))
+static void swapSSSE3(uint32_t *array, size_t size)
+{
+    swapCopySSSE3(array, array, size);
+}
+/* }}} */
+
+//
+// AVX2 /* {{{ */
+//
+
+__attribute__((target("avx2")))
+static void swapCopyAVX2(uint32_t *dst, const uint32_t *src, size_t size)
+{
+    const __m256i mask = _mm256_set_epi8(
+            12,13,14,15, 8,9,10,11, 4,5,6,7, 0,1,2,3,
+            12,13,14,15, 8,9,10,11, 4,5,6,7, 0,1,2,3);
+
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src + i + 8));
+        __m256i c = _mm256_loadu_si256((const __m256i*)(src + i + 16));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(src + i + 24));
+        _mm256_storeu_si256((__m256i*)(dst + i),      _mm256_shuffle_epi8(a, mask));
+        _mm256_storeu_si256((__m256i*)(dst + i + 8),  _mm256_shuffle_epi8(b, mask));
+        _mm256_storeu_si256((__m256i*)(dst + i + 16), _mm256_shuffle_epi8(c, mask));
+        _mm256_storeu_si256((__m256i*)(dst + i + 24), _mm256_shuffle_epi8(d, mask));
+    }
+    for (; i + 8 <= size; i += 8) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(src + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_shuffle_epi8(a, mask));
+    }
+    swapCopyScalar(dst + i, src + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static void swapAVX2(uint32_t *array, size_t size)
+{
+    swapCopyAVX2(array, array, size);
+}
+/* }}} */
+
+#endif
+
+//
+// DISPATCH /* {{{ */
+//
+
+static const PfbBswapKernel *selectKernels()
+{
+    static PfbBswapKernel kernels[4];
+    unsigned n = 0;
+
+    PfbBswapKernel scalar = { "scalar", swapScalar, swapCopyScalar };
+    kernels[n++] = scalar;
+
+#ifdef OPENPFB_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+        PfbBswapKernel ssse3 = { "ssse3", swapSSSE3, swapCopySSSE3 };
+        kernels[n++] = ssse3;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        PfbBswapKernel avx2 = { "avx2", swapAVX2, swapCopyAVX2 };
+        kernels[n++] = avx2;
+    }
+#endif
+
+    PfbBswapKernel end = { NULL, NULL, NULL };
+    kernels[n] = end;
+    return kernels;
+}
+
+const PfbBswapKernel *getBswapKernels()
+{
+    static const PfbBswapKernel *kernels = selectKernels();
+    return kernels;
+}
+
+static const PfbBswapKernel *selectBest()
+{
+    const PfbBswapKernel *k = getBswapKernels();
+    while (k[1].name) ++k;
+    return k;
+}
+
+const PfbBswapKernel &getBswapKernel()
+{
+    static const PfbBswapKernel *best = selectBest();
+    return *best;
+}
+/* }}} */
+}
@@ -0,0 +1,47 @@
+#ifndef _OPENPFB_BSWAP_H
+#define _OPENPFB_BSWAP_H
+
+#include <stdint.h>
+#include <cstdlib>
+
+namespace openpfb
+{
+    /// @struct PfbBswapKernel
+    ///
+    /// @brief 32-bit byte swapping routines for bulk data
+    struct PfbBswapKernel
+    {
+        const char *name;
+
+        /// Swap size words in place
+        void (*swap)(uint32_t *array, size_t size);
+
+        /// Copy size words from src to dst, swapping them on the way
+        void (*swapCopy)(uint32_t *dst, const uint32_t *src, size_t size);
+    };
+
+    /// Return the fastest kernel supported by the running CPU
+    const PfbBswapKernel &getBswapKernel();
+
+    /// Return the kernels supported by the running CPU, slowest first.
+    /// The list is terminated by a kernel with a NULL name.
+    const PfbBswapKernel *getBswapKernels();
+
+    /// Swap size words in place, using the fastest kernel
+    inline void bswap32(uint32_t *array, size_t size) {
+        getBswapKernel().swap(array, size);
+    }
+
+    /// Copy and swap size words in one pass, using the fastest kernel
+    inline void bswap32Copy(uint32_t *dst, const uint32_t *src, size_t size) {
+        getBswapKernel().swapCopy(dst, src, size);
+    }
+
+    /// True if this machine stores words most significant byte first
+    inline bool isNativeBigEndian() {
+        const uint32_t one = 1;
+        return *(const unsigned char*)&one == 0;
+    }
+}
+
+#endif
@@ -0,0 +1,401 @@
+#include "OpenPfbBvh.h"
+#include "OpenPfbScene.h"
+#include "OpenPfbThreads.h"
+
+#include <algorithm>
+#include <cfloat>
+
+using namespace std;
+
+namespace openpfb
+{
+
+//
+// PRIMITIVES /* {{{ */
+//
+// Box of every geoset in its own space first (the tree bounds, or computed
+// concurrently), then the world box of the geodes from a PfbTraversal.
+//
+
+class PfbGeosetBoxTask : public PfbTask
+{
+    public:
+        PfbGeosetBoxTask(PfbTree &tree, vector<PfbBox> &boxes) : tree(tree), boxes(boxes) {}
+
+        void run(unsigned i) {
+            int32_t id = tree.getGeoSet(i).lengthListId;
+            if (id < 0 || !tree.haveVertexList() || (uint32_t)id >= tree.getNumVertexList()) return;
+            PfbVertexList &list = tree.getVertexList(id);
+            if (list.getSize()) boxes[i] = computeBox(list.get(0), list.getSize());
+        }
+
+    private:
+        PfbTree        &tree;
+        vector<PfbBox> &boxes;
+};
+
+/// Primitive of every geode entry of a traversal
+struct PfbBvhGeodes
+{
+    const vector<PfbBox> &geosetBoxes;
+    vector<uint32_t>     &primNodes;
+    vector<PfbBox>       &primBoxes;
+
+    PfbBvhGeodes(const vector<PfbBox> &geosetBoxes, vector<uint32_t> &primNodes, vector<PfbBox> &primBoxes) :
+        geosetBoxes(geosetBoxes), primNodes(primNodes), primBoxes(primBoxes) {}
+
+    void operator()(uint32_t node, const float *m, const uint32_t *geosets, uint32_t numGeosets) {
+        PfbBox local;
+        for (uint32_t i=0; i<numGeosets; ++i) {
+            if (geosets[i] < geosetBoxes.size()) local.extend(geosetBoxes[geosets[i]]);
+        }
+        if (!local.isEmpty()) {
+            primNodes.push_back(node);
+            primBoxes.push_back(transformBox(local, m));
+        }
+    }
+};
+/* }}} */
+
+//
+// BUILD /* {{{ */
+//
+// The primitives are sorted in place (order) while splitting. Ranges
+// smaller than the grain become jobs, built concurrently in their own
+// node arrays, which are then appended to the top levels.
+//
+
+#define PFBBVH_BINS     16
+#define PFBBVH_MAX_LEAF 4
+
+struct PfbBvhJob
+{
+    uint32_t begin, end;
+    uint32_t slot;              // node of the top levels to replace
+    vector<PfbBvhNode> nodes;   // nodes[0] is the root
+};
+
+struct PfbBvhBuilder
+{
+    const vector<PfbBox> &boxes;
+    vector<float>         centers; // 3 per primitive
+    vector<uint32_t>      order;
+
+    PfbBvhBuilder(const vector<PfbBox> &boxes) : boxes(boxes), centers(3 * boxes.size()), order(boxes.size()) {
+        for (uint32_t i=0; i<boxes.size(); ++i) {
+            order[i] = i;
+            for (unsigned a=0; a<3; ++a)
+                centers[3*i + a] = 0.5f * (boxes[i].min[a] + boxes[i].max[a]);
+        }
+    }
+
+    static void setBox(PfbBvhNode &node, const PfbBox &box) {
+        memcpy(node.min, box.min, sizeof(node.min));
+        memcpy(node.max, box.max, sizeof(node.max));
+    }
+
+    /// Split [begin,end) along the best binned SAH plane, return the
+    /// middle, or begin for a leaf
+    uint32_t split(uint32_t begin, uint32_t end, const PfbBox &bounds) {
+        uint32_t count = end - begin;
+        if (count <= 2) return begin;
+
+        PfbBox centroids;
+        for (uint32_t i=begin; i<end; ++i) {
+            const float *c = &centers[3*order[i]];
+            for (unsigned a=0; a<3; ++a) {
+                if (c[a] < centroids.min[a]) centroids.min[a] = c[a];
+                if (c[a] > centroids.max[a]) centroids.max[a] = c[a];
+            }
+        }
+
+        float    bestCost  = FLT_MAX;
+        int      bestAxis  = -1;
+        unsigned bestSplit = 0;
+        for (unsigned a=0; a<3; ++a) {
+            float extent = centroids.max[a] - centroids.min[a];
+            if (extent <= 0) continue;
+            float scale = PFBBVH_BINS / extent;
+
+            PfbBox   bins[PFBBVH_BINS];
+            uint32_t counts[PFBBVH_BINS] = { 0 };
+            for (uint32_t i=begin; i<end; ++i) {
+                unsigned b = min((unsigned)((centers[3*order[i] + a] - centroids.min[a]) * scale), (unsigned)PFBBVH_BINS - 1);
+                bins[b].extend(boxes[order[i]]);
+                counts[b]++;
+            }
+
+            // Right sides swept from the end, left sides from the start
+            float    rightArea[PFBBVH_BINS];
+            uint32_t rightCount[PFBBVH_BINS];
+            PfbBox   box;
+            uint32_t n = 0;
+            for (unsigned b=PFBBVH_BINS; b-->1;) {
+                box.extend(bins[b]);
+                n += counts[b];
+                rightArea[b]  = box.area();
+                rightCount[b] = n;
+            }
+            box = PfbBox();
+            n = 0;
+            for (unsigned b=1; b<PFBBVH_BINS; ++b) {
+                box.extend(bins[b-1]);
+                n += counts[b-1];
+                if (n == 0 || rightCount[b] == 0) continue;
+                float cost = box.area() * n + rightArea[b] * rightCount[b];
+                if (cost < bestCost) {
+                    bestCost  = cost;
+                    bestAxis  = a;
+                    bestSplit = b;
+                }
+            }
+        }
+
+        // Traversal cost 1, intersection cost 1 per primitive
+        float area = bounds.area();
+        bool leafCheaper = (bestAxis < 0) || (area > 0 && 1 + bestCost / area >= count);
+        if (leafCheaper && count <= PFBBVH_MAX_LEAF) return begin;
+
+        if (bestAxis < 0) {
+            // Same centers: halves
+            return begin + count / 2;
+        }
+
+        float scale = PFBBVH_BINS / (centroids.max[bestAxis] - centroids.min[bestAxis]);
+        uint32_t *mid = partition(&order[begin], &order[0] + end, BinBefore(*this, bestAxis, centroids.min[bestAxis], scale, bestSplit));
+        return mid - &order[0];
+    }
+
+    struct BinBefore
+    {
+        const PfbBvhBuilder &builder;
+        unsigned axis;
+        float    base, scale;
+        unsigned split;
+
+        BinBefore(const PfbBvhBuilder &builder, unsigned axis, float base, float scale, unsigned split) :
+            builder(builder), axis(axis), base(base), scale(scale), split(split) {}
+
+        bool operator()(uint32_t prim) const {
+            unsigned b = min((unsigned)((builder.centers[3*prim + axis] - base) * scale), (unsigned)PFBBVH_BINS - 1);
+            return b < split;
+        }
+    };
+
+    PfbBox getBounds(uint32_t begin, uint32_t end) const {
+        PfbBox box;
+        for (uint32_t i=begin; i<end; ++i)
+            box.extend(boxes[order[i]]);
+        return box;
+    }
+
+    /// Build [begin,end) into nodes[slot]. Ranges of at most grain
+    /// primitives become jobs when jobs is not NULL.
+    void build(uint32_t begin, uint32_t end, uint32_t slot, vector<PfbBvhNode> &nodes,
+            uint32_t grain, vector<PfbBvhJob*> *jobs) {
+        if (jobs && end - begin <= grain) {
+            PfbBvhJob *job = new PfbBvhJob;
+            job->begin = begin;
+            job->end   = end;
+            job->slot  = slot;
+            jobs->push_back(job);
+            return;
+        }
+
+        PfbBox bounds = getBounds(begin, end);
+        setBox(nodes[slot], bounds);
+        uint32_t mid = split(begin, end, bounds);
+        if (mid == begin) {
+            nodes[slot].index = begin;
+            nodes[slot].count = end - begin;
+            return;
+        }
+
+        uint32_t children = nodes.size();
+        nodes[slot].index = children;
+        nodes[slot].count = 0;
+        nodes.resize(children + 2);
+        build(begin, mid, children,     nodes, grain, jobs);
+        build(mid,   end, children + 1, nodes, grain, jobs);
+    }
+};
+
+class PfbBvhTask : public PfbTask
+{
+    public:
+        PfbBvhTask(PfbBvhBuilder &builder, vector<PfbBvhJob*> &jobs) : builder(builder), jobs(jobs) {}
+
+        void run(unsigned i) {
+            PfbBvhJob &job = *jobs[i];
+            job.nodes.resize(1);
+            builder.build(job.begin, job.end, 0, job.nodes, 0, NULL);
+        }
+
+    private:
+        PfbBvhBuilder      &builder;
+        vector<PfbBvhJob*> &jobs;
+};
+
+PfbBvh::PfbBvh() :
+    nodes(NULL),
+    numNodes(0)
+{
+}
+
+PfbBvh::~PfbBvh()
+{
+    free(nodes);
+}
+
+void PfbBvh::build(PfbTree &tree, unsigned numThreads)
+{
+    free(nodes);
+    nodes    = NULL;
+    numNodes = 0;
+    primNodes.clear();
+    primBoxes.clear();
+    if (tree.getNumNodes() == 0) return;
+    if (numThreads == 0) numThreads = getNumProcessors();
+
+    vector<PfbBox> geosetBoxes(tree.getNumGeosets());
+    if (tree.haveBounds()) {
+        for (uint32_t i=0; i<geosetBoxes.size(); ++i)
+            geosetBoxes[i] = tree.getGeoSetBounds(i).box;
+    }
+    else {
+        PfbGeosetBoxTask boxTask(tree, geosetBoxes);
+        parallelFor(boxTask, geosetBoxes.size(), numThreads);
+    }
+
+    vector<uint32_t> walkNodes;
+    vector<PfbBox>   walkBoxes;
+    PfbTraversal traversal;
+    traversal.build(tree);
+    traversal.forEachGeode(PfbBvhGeodes(geosetBoxes, walkNodes, walkBoxes));
+    uint32_t numPrims = walkNodes.size();
+    if (numPrims == 0) return;
+
+    // Top levels, then the jobs
+    PfbBvhBuilder builder(walkBoxes);
+    uint32_t grain = max(numPrims / (8 * numThreads), (uint32_t)1024);
+    vector<PfbBvhNode>  top(1);
+    vector<PfbBvhJob*>  jobs;
+    builder.build(0, numPrims, 0, top, grain, &jobs);
+    PfbBvhTask task(builder, jobs);
+    parallelFor(task, jobs.size(), numThreads);
+
+    // A job root takes its slot, its other nodes go at the end
+    size_t total = top.size();
+    for (unsigned j=0; j<jobs.size(); ++j)
+        total += jobs[j]->nodes.size() - 1;
+    void *mem;
+    if (posix_memalign(&mem, 64, total * sizeof(PfbBvhNode)) != 0) throw std::bad_alloc();
+    nodes    = (PfbBvhNode*)mem;
+    numNodes = total;
+    memcpy(nodes, &top[0], top.size() * sizeof(PfbBvhNode));
+    uint32_t next = top.size();
+    for (unsigned j=0; j<jobs.size(); ++j) {
+        PfbBvhJob &job = *jobs[j];
+        uint32_t offset = next - 1;
+        for (uint32_t n=0; n<job.nodes.size(); ++n) {
+            PfbBvhNode node = job.nodes[n];
+            if (node.count == 0) node.index += offset;
+            nodes[n ? offset + n : job.slot] = node;
+        }
+        next += job.nodes.size() - 1;
+        delete jobs[j];
+    }
+
+    primNodes.resize(numPrims);
+    primBoxes.resize(numPrims);
+    for (uint32_t i=0; i<numPrims; ++i) {
+        primNodes[i] = walkNodes[builder.order[i]];
+        primBoxes[i] = walkBoxes[builder.order[i]];
+    }
+}
+
+PfbBox PfbBvh::getBounds() const
+{
+    PfbBox box;
+    if (numNodes) {
+        memcpy(box.min, nodes[0].min, sizeof(box.min));
+        memcpy(box.max, nodes[0].max, sizeof(box.max));
+    }
+    return box;
+}
+/* }}} */
+
+//
+// QUERIES /* {{{ */
+//
+
+struct PfbBoxTest
+{
+    const PfbBox &box;
+
+    PfbBoxTest(const PfbBox &box) : box(box) {}
+
+    bool operator()(const float *min, const float *max) const {
+        return min[0] <= box.max[0] && box.min[0] <= max[0] &&
+               min[1] <= box.max[1] && box.min[1] <= max[1] &&
+               min[2] <= box.max[2] && box.min[2] <= max[2];
+    }
+};
+
+struct PfbSphereTest
+{
+    const float *center;
+    float        radius2;
+
+    PfbSphereTest(const float *center, float radius) : center(center), radius2(radius * radius) {}
+
+    bool operator()(const float *min, const float *max) const {
+        float d2 = 0;
+        for (unsigned a=0; a<3; ++a) {
+            float d = (center[a] < min[a]) ? min[a] - center[a] : (center[a] > max[a]) ? center[a] - max[a] : 0;
+            d2 += d * d;
+        }
+        return d2 <= radius2;
+    }
+};
+
+template <typename Test>
+void PfbBvh::query(const Test &test, vector<uint32_t> &result) const
+{
+    if (numNodes == 0) return;
+    size_t first = result.size();
+
+    vector<uint32_t> stack;
+    stack.reserve(64);
+    stack.push_back(0);
+    while (!stack.empty()) {
+        const PfbBvhNode &node = nodes[stack.back()];
+        stack.pop_back();
+        if (!test(node.min, node.max)) continue;
+        if (node.count) {
+            for (uint32_t i=node.index; i<node.index + node.count; ++i) {
+                if (test(primBoxes[i].min, primBoxes[i].max))
+                    result.push_back(primNodes[i]);
+            }
+        }
+        else {
+            stack.push_back(node.index + 1);
+            stack.push_back(node.index);
+        }
+    }
+
+    sort(result.begin() + first, result.end());
+    result.erase(unique(result.begin() + first, result.end()), result.end());
+}
+
+void PfbBvh::queryBox(const PfbBox &box, vector<uint32_t> &result) const
+{
+    query(PfbBoxTest(box), result);
+}
+
+void PfbBvh::querySphere(const float *center, float radius, vector<uint32_t> &result) const
+{
+    query(PfbSphereTest(center, radius), result);
+}
+/* }}} */
+}
@@ -0,0 +1,76 @@
+#ifndef _OPENPFB_BVH_H
+#define _OPENPFB_BVH_H
+
+#include "OpenPfb.h"
+
+namespace openpfb
+{
+    /// @struct PfbBvhNode
+    ///
+    /// @brief Node of a PfbBvh, two per cache line. The two children of
+    /// an inner node are next to each other.
+    struct PfbBvhNode
+    {
+        float    min[3];
+        uint32_t index;  // inner node: first child, leaf: first primitive
+        float    max[3];
+        uint32_t count;  // leaf: number of primitives, inner node: 0
+    };
+
+    /// @class PfbBvh
+    ///
+    /// @brief Bounding volume hierarchy over the geodes of a tree
+    ///
+    /// The primitives are the geodes as reached from the root, with their
+    /// world box: the boxes of the vertex lists of their geosets, taken
+    /// through the SCS and DCS matrices above them (DCS with their current
+    /// matrix). A geode reached through several paths is several
+    /// primitives. All the children of LOD nodes are included.
+    ///
+    /// The hierarchy is built top-down with a binned SAH; the subtrees of
+    /// the top levels are built concurrently.
+    class PfbBvh
+    {
+        public:
+            PfbBvh();
+            ~PfbBvh();
+
+            /// Build the hierarchy of tree on numThreads threads (0 = one
+            /// per processor)
+            void build(PfbTree &tree, unsigned numThreads = 0);
+
+            /// Nodes, the root first, 64-byte aligned
+            uint32_t          getNumNodes() const { return numNodes; }
+            const PfbBvhNode *getNodes() const    { return nodes; }
+
+            /// Box of the whole tree
+            PfbBox getBounds() const;
+
+            /// Primitives, in the order of the leaves
+            uint32_t      getNumPrimitives() const             { return primNodes.size(); }
+            uint32_t      getPrimitiveNode(uint32_t i) const   { return primNodes[i]; }
+            const PfbBox &getPrimitiveBox(uint32_t i) const    { return primBoxes[i]; }
+
+            /// Append to result the geodes (node ids) whose world box
+            /// overlaps box, each once, sorted
+            void queryBox(const PfbBox &box, std::vector<uint32_t> &result) const;
+
+            /// Append to result the geodes (node ids) whose world box is
+            /// within radius of center, each once, sorted
+            void querySphere(const float *center, float radius, std::vector<uint32_t> &result) const;
+
+        private:
+            PfbBvhNode            *nodes;
+            uint32_t               numNodes;
+            std::vector<uint32_t>  primNodes;
+            std::vector<PfbBox>    primBoxes;
+
+            template <typename Test>
+            void query(const Test &test, std::vector<uint32_t> &result) const;
+
+            PfbBvh(const PfbBvh &);
+            PfbBvh &operator=(const PfbBvh &);
+    };
+}
+
+#endif
@@ -0,0 +1,713 @@
+#include "OpenPfbCache.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace openpfb
+{
+
+//
+// FILE LAYOUT /* {{{ */
+//
+// PfbCacheHeader, then the sections, every one 16-byte aligned. All
+// references are offsets from the start of the file (0 = none), all values
+// are in the byte order of the machine that wrote the cache.
+//
+
+#define PFBCACHE_MAGIC      "PFBCACHE"
+#define PFBCACHE_VERSION    1
+#define PFBCACHE_BYTEORDER  0x01020304
+#define PFBCACHE_ALIGN      16
+
+/// Bytes of the source file hashed at its start and its end, plus
+/// PFBCACHE_SAMPLES pages in between, to detect content changes cheaply.
+#define PFBCACHE_EDGE       (64*1024)
+#define PFBCACHE_PAGE       4096
+#define PFBCACHE_SAMPLES    16
+
+enum PfbCacheSection {
+    SECTION_LENGTHLISTS, SECTION_VERTEXLISTS, SECTION_COLORLISTS,
+    SECTION_NORMALLISTS, SECTION_TEXCOORDLISTS,
+    SECTION_MATERIALS, SECTION_TEXTURES, SECTION_GEOSTATES,
+    SECTION_GEOSETS, SECTION_NODES,
+    NUM_SECTIONS
+};
+
+struct PfbCacheKey
+{
+    uint64_t size;
+    int64_t  mtime;
+    int64_t  mtimeNsec;
+    uint64_t sampleHash; // PFBCACHE_EDGE and PFBCACHE_SAMPLES bytes
+    uint64_t hash;       // whole file
+};
+
+struct PfbCacheHeader
+{
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    byteOrder;    // PFBCACHE_BYTEORDER
+    uint32_t    pointerSize;  // PfbTexture layout depends on it
+    uint32_t    present;      // bit per section: the tree has the array
+    uint64_t    fileSize;     // of the cache
+    PfbCacheKey source;
+    uint32_t    counts[NUM_SECTIONS];
+    uint32_t    pad;
+    uint64_t    offsets[NUM_SECTIONS];
+};
+
+/// Lists: table of { data, size }
+struct PfbCacheList
+{
+    uint64_t data;
+    uint32_t size;
+    uint32_t pad;
+};
+
+/// GeoStates: table of { values, numValues }
+struct PfbCacheGeoState
+{
+    uint64_t values;
+    int32_t  numValues;
+    uint32_t pad;
+};
+
+/// Nodes: table of { payload, name, type }. The payload is an array of
+/// 32-bit words:
+///   geode:    numGeosets, geosets[]
+///   group:    numChildren, childs[]
+///   scs, dcs: matrix[16], numChildren, childs[]
+///   lod:      numRanges, ranges[numRanges+1], center[3], numChildren, childs[]
+struct PfbCacheNode
+{
+    uint64_t payload;
+    uint64_t name;
+    uint32_t type;
+    uint32_t pad;
+};
+
+// Textures are stored as PfbTexture, fileName holding an offset.
+/* }}} */
+
+//
+// SOURCE KEY /* {{{ */
+//
+
+static uint64_t hashBytes(const void *data, size_t size, uint64_t h)
+{
+    const unsigned char *p = (const unsigned char*)data;
+    for (; size >= 8; size -= 8, p += 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h  = (h ^ w) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    for (; size > 0; --size, ++p)
+        h = (h ^ *p) * 0x100000001b3ULL;
+    return h;
+}
+
+static bool hashRange(int fd, char *buffer, off_t offset, size_t length, uint64_t &h)
+{
+    ssize_t n = pread(fd, buffer, length, offset);
+    if (n != (ssize_t)length) return false;
+    h = hashBytes(buffer, length, h);
+    return true;
+}
+
+/// Size, time and hashes of the source file. The whole file is only read
+/// if fullHash is set (key.hash is 0 otherwise).
+static bool readSourceKey(const string &name, PfbCacheKey &key, bool fullHash)
+{
+    int fd = open(name.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    memset(&key, 0, sizeof(key));
+    key.size      = st.st_size;
+    key.mtime     = st.st_mtim.tv_sec;
+    key.mtimeNsec = st.st_mtim.tv_nsec;
+
+    uint64_t size = key.size;
+    char *buffer  = new char[PFBCACHE_EDGE];
+    bool ok       = true;
+
+    // sampled hash
+    uint64_t h = hashBytes(&size, sizeof(size), 0xcbf29ce484222325ULL);
+    if (size <= 2 * PFBCACHE_EDGE) {
+        for (uint64_t pos = 0; ok && pos < size; pos += PFBCACHE_EDGE) {
+            size_t length = (size - pos < PFBCACHE_EDGE) ? size - pos : PFBCACHE_EDGE;
+            ok = hashRange(fd, buffer, pos, length, h);
+        }
+    }
+    else {
+        ok = hashRange(fd, buffer, 0, PFBCACHE_EDGE, h);
+        for (unsigned i=1; ok && i<=PFBCACHE_SAMPLES; ++i) {
+            uint64_t pos = PFBCACHE_EDGE + (size - 2 * PFBCACHE_EDGE - PFBCACHE_PAGE) * i / (PFBCACHE_SAMPLES + 1);
+            ok = hashRange(fd, buffer, pos, PFBCACHE_PAGE, h);
+        }
+        if (ok) ok = hashRange(fd, buffer, size - PFBCACHE_EDGE, PFBCACHE_EDGE, h);
+    }
+    key.sampleHash = h;
+
+    // full hash, in chunks that keep the word alignment of hashBytes
+    if (ok && fullHash) {
+        h = hashBytes(&size, sizeof(size), 0xcbf29ce484222325ULL);
+        for (uint64_t pos = 0; ok && pos < size; pos += PFBCACHE_EDGE) {
+            size_t length = (size - pos < PFBCACHE_EDGE) ? size - pos : PFBCACHE_EDGE;
+            ok = hashRange(fd, buffer, pos, length, h);
+        }
+        key.hash = h;
+    }
+
+    delete[] buffer;
+    close(fd);
+    return ok;
+}
+/* }}} */
+
+//
+// WRITER /* {{{ */
+//
+
+class PfbCacheWriter
+{
+    public:
+        PfbCacheWriter(FILE *f) : f(f), pos(0), failed(false) {}
+
+        uint64_t write(const void *data, size_t bytes) {
+            uint64_t ret = pos;
+            if (bytes && fwrite(data, 1, bytes, f) != bytes) failed = true;
+            pos += bytes;
+            return ret;
+        }
+        uint64_t writeAligned(const void *data, size_t bytes) {
+            align();
+            return write(data, bytes);
+        }
+        void align() {
+            static const char zeros[PFBCACHE_ALIGN] = { 0 };
+            size_t pad = (PFBCACHE_ALIGN - pos % PFBCACHE_ALIGN) % PFBCACHE_ALIGN;
+            write(zeros, pad);
+        }
+        uint64_t tell() const { return pos; }
+        bool fail() const { return failed; }
+
+    private:
+        FILE    *f;
+        uint64_t pos;
+        bool     failed;
+};
+
+template <typename T, unsigned N>
+static void writeList(PfbCacheWriter &out, PfbList<T,N> &list, PfbCacheList &entry)
+{
+    entry.size = list.getSize();
+    entry.pad  = 0;
+    entry.data = entry.size ? out.writeAligned(list.get(0), entry.size * N * sizeof(T)) : 0;
+}
+
+template <typename L>
+static void writeLists(PfbCacheWriter &out, PfbTree &tree, PfbCacheHeader &header,
+        unsigned section, bool have, unsigned num, L &(PfbTree::*getList)(unsigned))
+{
+    if (!have) return;
+    vector<PfbCacheList> entries(num);
+    for (unsigned i=0; i<num; ++i)
+        writeList(out, (tree.*getList)(i), entries[i]);
+
+    header.present |= 1u << section;
+    header.counts[section]  = num;
+    header.offsets[section] = out.writeAligned(num ? &entries[0] : NULL, num * sizeof(PfbCacheList));
+}
+
+static void writeChilds(vector<uint32_t> &words, const PfbChilds &childs)
+{
+    words.push_back(childs.getNumChildren());
+    for (uint32_t i=0; i<childs.getNumChildren(); ++i)
+        words.push_back(childs.getChild(i));
+}
+
+static void writeFloats(vector<uint32_t> &words, const float *values, unsigned num)
+{
+    for (unsigned i=0; i<num; ++i) {
+        uint32_t w;
+        memcpy(&w, values + i, 4);
+        words.push_back(w);
+    }
+}
+
+static void writeNode(PfbCacheWriter &out, const PfbNode &node, PfbCacheNode &entry)
+{
+    vector<uint32_t> words;
+
+    if (const PfbNodeGeode *geode = node.asGeode()) {
+        words.push_back(geode->getNumGeosets());
+        words.insert(words.end(), geode->getGeosets(), geode->getGeosets() + geode->getNumGeosets());
+    }
+    else if (const PfbNodeGroup *group = node.asGroup()) {
+        writeChilds(words, group->getChilds());
+    }
+    else if (node.getType() == 6 || node.getType() == 7) {
+        const PfbNodeTransform *t = node.asSCS() ? node.asSCS() : node.asDCS();
+        writeFloats(words, t->getMatrix(), 16);
+        writeChilds(words, t->getChilds());
+    }
+    else if (const PfbNodeLOD *lod = node.asLOD()) {
+        words.push_back(lod->getNumRanges());
+        writeFloats(words, lod->getRanges(0), lod->getNumRanges() + 1);
+        writeFloats(words, lod->getCenter(), 3);
+        writeChilds(words, lod->getChilds());
+    }
+
+    entry.type    = node.getType();
+    entry.pad     = 0;
+    entry.payload = words.empty() ? 0 : out.writeAligned(&words[0], words.size() * 4);
+    entry.name    = node.getName() ? out.writeAligned(node.getName(), strlen(node.getName()) + 1) : 0;
+}
+
+static bool writeTree(FILE *f, PfbTree &tree, const PfbCacheKey &source)
+{
+    PfbCacheWriter out(f);
+    PfbCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    out.write(&header, sizeof(header)); // rewritten at the end
+
+    writeLists(out, tree, header, SECTION_LENGTHLISTS,   tree.haveLengthList(),   tree.getNumLengthList(),   &PfbTree::getLengthList);
+    writeLists(out, tree, header, SECTION_VERTEXLISTS,   tree.haveVertexList(),   tree.getNumVertexList(),   &PfbTree::getVertexList);
+    writeLists(out, tree, header, SECTION_COLORLISTS,    tree.haveColorList(),    tree.getNumColorList(),    &PfbTree::getColorList);
+    writeLists(out, tree, header, SECTION_NORMALLISTS,   tree.haveNormalList(),   tree.getNumNormalList(),   &PfbTree::getNormalList);
+    writeLists(out, tree, header, SECTION_TEXCOORDLISTS, tree.haveTexcoordList(), tree.getNumTexcoordList(), &PfbTree::getTexcoordList);
+
+    if (tree.haveMaterials()) {
+        unsigned num = tree.getNumMaterials();
+        header.present |= 1u << SECTION_MATERIALS;
+        header.counts[SECTION_MATERIALS]  = num;
+        header.offsets[SECTION_MATERIALS] = out.writeAligned(num ? &tree.getMaterial(0) : NULL, num * sizeof(PfbMaterial));
+    }
+
+    if (tree.haveTextures()) {
+        unsigned num = tree.getNumTextures();
+        vector<PfbTexture> textures(num);
+        for (unsigned i=0; i<num; ++i) {
+            textures[i] = tree.getTexture(i);
+            const char *fileName = textures[i].fileName;
+            textures[i].fileName = fileName ? (char*)(uintptr_t)out.writeAligned(fileName, strlen(fileName) + 1) : NULL;
+        }
+        header.present |= 1u << SECTION_TEXTURES;
+        header.counts[SECTION_TEXTURES]  = num;
+        header.offsets[SECTION_TEXTURES] = out.writeAligned(num ? &textures[0] : NULL, num * sizeof(PfbTexture));
+    }
+
+    if (tree.getNumGeoStates()) {
+        unsigned num = tree.getNumGeoStates();
+        vector<PfbCacheGeoState> entries(num);
+        for (unsigned i=0; i<num; ++i) {
+            PfbGeoState &geostate = tree.getGeoState(i);
+            vector<int32_t> values(geostate.getNumValues());
+            for (int32_t v=0; v<geostate.getNumValues(); ++v)
+                values[v] = geostate.getValue(v + 1);
+            entries[i].numValues = geostate.getNumValues();
+            entries[i].pad       = 0;
+            entries[i].values    = values.empty() ? 0 : out.writeAligned(&values[0], values.size() * 4);
+        }
+        header.present |= 1u << SECTION_GEOSTATES;
+        header.counts[SECTION_GEOSTATES]  = num;
+        header.offsets[SECTION_GEOSTATES] = out.writeAligned(&entries[0], num * sizeof(PfbCacheGeoState));
+    }
+
+    if (tree.getNumGeosets()) {
+        unsigned num = tree.getNumGeosets();
+        header.present |= 1u << SECTION_GEOSETS;
+        header.counts[SECTION_GEOSETS]  = num;
+        header.offsets[SECTION_GEOSETS] = out.writeAligned(&tree.getGeoSet(0), num * sizeof(PfbGeoSet));
+    }
+
+    if (tree.getNumNodes()) {
+        unsigned num = tree.getNumNodes();
+        vector<PfbCacheNode> entries(num);
+        for (unsigned i=0; i<num; ++i)
+            writeNode(out, tree.getNode(i), entries[i]);
+        header.present |= 1u << SECTION_NODES;
+        header.counts[SECTION_NODES]  = num;
+        header.offsets[SECTION_NODES] = out.writeAligned(&entries[0], num * sizeof(PfbCacheNode));
+    }
+    out.align();
+
+    memcpy(header.magic, PFBCACHE_MAGIC, 8);
+    header.version     = PFBCACHE_VERSION;
+    header.byteOrder   = PFBCACHE_BYTEORDER;
+    header.pointerSize = sizeof(void*);
+    header.fileSize    = out.tell();
+    header.source      = source;
+
+    if (fseek(f, 0, SEEK_SET) != 0) return false;
+    fwrite(&header, sizeof(header), 1, f);
+    return !out.fail() && !ferror(f);
+}
+/* }}} */
+
+//
+// READER /* {{{ */
+//
+
+class PfbCacheReader
+{
+    public:
+        PfbCacheReader(char *base, size_t size) :
+            base(base), size(size), header((const PfbCacheHeader*)base) {}
+
+        /// Pointer to num elements at offset, NULL if outside the file
+        template <typename T>
+        T *get(uint64_t offset, uint64_t num) const {
+            if (offset == 0 || offset % sizeof(uint32_t) != 0) return NULL;
+            if (offset > size || num > (size - offset) / sizeof(T)) return NULL;
+            return (T*)(base + offset);
+        }
+
+        /// Nul-terminated string at offset, NULL if outside the file
+        char *getString(uint64_t offset) const {
+            if (offset == 0 || offset >= size) return NULL;
+            if (!memchr(base + offset, 0, size - offset)) return NULL;
+            return base + offset;
+        }
+
+        bool have(unsigned section) const { return (header->present >> section) & 1; }
+        uint32_t count(unsigned section) const { return header->counts[section]; }
+        uint64_t offset(unsigned section) const { return header->offsets[section]; }
+
+    private:
+        char   *base;
+        size_t  size;
+        const PfbCacheHeader *header;
+};
+
+template <typename T, unsigned N>
+static bool readList(const PfbCacheReader &in, const PfbCacheList &entry, PfbList<T,N> &list)
+{
+    if (entry.size == 0) {
+        list.attach(NULL, 0);
+        return true;
+    }
+    T *data = in.get<T>(entry.data, (uint64_t)entry.size * N);
+    if (!data) return false;
+    list.attach(data, entry.size);
+    return true;
+}
+
+template <typename L>
+static bool readLists(const PfbCacheReader &in, PfbTree &tree, unsigned section,
+        void (PfbTree::*create)(unsigned), L &(PfbTree::*getList)(unsigned))
+{
+    if (!in.have(section)) return true;
+    unsigned num = in.count(section);
+    const PfbCacheList *entries = in.get<PfbCacheList>(in.offset(section), num);
+    if (!entries && num) return false;
+
+    (tree.*create)(num);
+    for (unsigned i=0; i<num; ++i)
+        if (!readList(in, entries[i], (tree.*getList)(i))) return false;
+    return true;
+}
+
+/// Read the childs at words[pos], advancing pos
+static bool readChilds(const PfbCacheReader &in, const PfbCacheNode &entry,
+        uint32_t *words, uint64_t &pos, PfbChilds &childs)
+{
+    if (!in.get<uint32_t>(entry.payload, pos + 1)) return false;
+    uint32_t num = words[pos++];
+    if (!in.get<uint32_t>(entry.payload, pos + num)) return false;
+    childs.attachChildren(num, words + pos);
+    pos += num;
+    return true;
+}
+
+static bool readNode(const PfbCacheReader &in, const PfbCacheNode &entry,
+        PfbNode &node, PfbArena &arena)
+{
+    node.setType(entry.type, &arena);
+    if (entry.name) {
+        char *name = in.getString(entry.name);
+        if (!name) return false;
+        node.attachName(name);
+    }
+
+    uint32_t *words = in.get<uint32_t>(entry.payload, 1);
+    uint64_t  pos   = 0;
+
+    if (PfbNodeGeode *geode = node.asGeode()) {
+        if (!words) return false;
+        uint32_t num = words[0];
+        if (!in.get<uint32_t>(entry.payload, 1 + (uint64_t)num)) return false;
+        geode->attachGeosets(num, words + 1);
+    }
+    else if (PfbNodeGroup *group = node.asGroup()) {
+        return words && readChilds(in, entry, words, pos, group->getChilds());
+    }
+    else if (entry.type == 6 || entry.type == 7) {
+        PfbNodeTransform *t = node.asSCS() ? node.asSCS() : node.asDCS();
+        if (!in.get<uint32_t>(entry.payload, 16)) return false;
+        memcpy(t->getMatrix(), words, 16 * sizeof(float));
+        pos = 16;
+        return readChilds(in, entry, words, pos, t->getChilds());
+    }
+    else if (PfbNodeLOD *lod = node.asLOD()) {
+        if (!words) return false;
+        uint32_t num = words[0];
+        if (!in.get<uint32_t>(entry.payload, 1 + (uint64_t)num + 1 + 3)) return false;
+        lod->attachRanges(num, (float*)(words + 1));
+        memcpy(lod->getCenter(), words + 2 + num, 3 * sizeof(float));
+        pos = 2 + (uint64_t)num + 3;
+        return readChilds(in, entry, words, pos, lod->getChilds());
+    }
+    return true;
+}
+
+static bool readTree(char *base, size_t size, PfbTree &tree)
+{
+    PfbCacheReader in(base, size);
+
+    if (!readLists(in, tree, SECTION_LENGTHLISTS,   &PfbTree::createLengthLists,   &PfbTree::getLengthList))   return false;
+    if (!readLists(in, tree, SECTION_VERTEXLISTS,   &PfbTree::createVertexLists,   &PfbTree::getVertexList))   return false;
+    if (!readLists(in, tree, SECTION_COLORLISTS,    &PfbTree::createColorLists,    &PfbTree::getColorList))    return false;
+    if (!readLists(in, tree, SECTION_NORMALLISTS,   &PfbTree::createNormalLists,   &PfbTree::getNormalList))   return false;
+    if (!readLists(in, tree, SECTION_TEXCOORDLISTS, &PfbTree::createTexcoordLists, &PfbTree::getTexcoordList)) return false;
+
+    if (in.have(SECTION_MATERIALS)) {
+        unsigned num = in.count(SECTION_MATERIALS);
+        const PfbMaterial *materials = in.get<PfbMaterial>(in.offset(SECTION_MATERIALS), num);
+        if (!materials && num) return false;
+        tree.createMaterials(num);
+        if (num) memcpy(&tree.getMaterial(0), materials, num * sizeof(PfbMaterial));
+    }
+
+    if (in.have(SECTION_TEXTURES)) {
+        unsigned num = in.count(SECTION_TEXTURES);
+        const PfbTexture *textures = in.get<PfbTexture>(in.offset(SECTION_TEXTURES), num);
+        if (!textures && num) return false;
+        tree.createTextures(num);
+        for (unsigned i=0; i<num; ++i) {
+            PfbTexture &texture = tree.getTexture(i);
+            texture = textures[i];
+            if (textures[i].fileName) {
+                texture.fileName = in.getString((uintptr_t)textures[i].fileName);
+                if (!texture.fileName) return false;
+            }
+        }
+    }
+
+    if (in.have(SECTION_GEOSTATES)) {
+        unsigned num = in.count(SECTION_GEOSTATES);
+        const PfbCacheGeoState *entries = in.get<PfbCacheGeoState>(in.offset(SECTION_GEOSTATES), num);
+        if (!entries) return false;
+        tree.createGeoStates(num);
+        for (unsigned i=0; i<num; ++i) {
+            if (entries[i].numValues <= 0) continue;
+            int32_t *values = in.get<int32_t>(entries[i].values, entries[i].numValues);
+            if (!values) return false;
+            tree.getGeoState(i).attachValues(entries[i].numValues, values);
+        }
+    }
+
+    if (in.have(SECTION_GEOSETS)) {
+        unsigned num = in.count(SECTION_GEOSETS);
+        const PfbGeoSet *geosets = in.get<PfbGeoSet>(in.offset(SECTION_GEOSETS), num);
+        if (!geosets) return false;
+        tree.createGeoSets(num);
+        memcpy(&tree.getGeoSet(0), geosets, num * sizeof(PfbGeoSet));
+    }
+
+    if (in.have(SECTION_NODES)) {
+        unsigned num = in.count(SECTION_NODES);
+        const PfbCacheNode *entries = in.get<PfbCacheNode>(in.offset(SECTION_NODES), num);
+        if (!entries) return false;
+        tree.createNodes(num);
+        for (unsigned i=0; i<num; ++i)
+            if (!readNode(in, entries[i], tree.getNode(i), tree.getArena())) return false;
+    }
+    return true;
+}
+/* }}} */
+
+//
+// CACHE /* {{{ */
+//
+
+PfbCache::PfbCache(const string &sourceName, const string &cacheName, unsigned flags) :
+    sourceName(sourceName),
+    cacheName(cacheName.empty() ? getDefaultName(sourceName) : cacheName),
+    flags(flags),
+    error(NULL)
+{
+}
+
+string PfbCache::getDefaultName(const string &sourceName)
+{
+    return sourceName + ".cache";
+}
+
+char *PfbCache::mapValid(size_t &size)
+{
+    int fd = open(cacheName.c_str(), O_RDONLY);
+    if (fd < 0) {
+        error = "No cache file";
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(PfbCacheHeader)) {
+        close(fd);
+        error = "Invalid cache file";
+        return NULL;
+    }
+
+    // Copy-on-write, so that the tree content stays writable
+    size = st.st_size;
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        error = "Can't map cache file";
+        return NULL;
+    }
+
+    const PfbCacheHeader *header = (const PfbCacheHeader*)addr;
+    if (memcmp(header->magic, PFBCACHE_MAGIC, 8) != 0
+            || header->version != PFBCACHE_VERSION
+            || header->byteOrder != PFBCACHE_BYTEORDER
+            || header->pointerSize != sizeof(void*)
+            || header->fileSize != size) {
+        munmap(addr, size);
+        error = "Invalid cache file";
+        return NULL;
+    }
+
+    bool verify = (flags & PFBCACHE_VERIFY_CONTENT) != 0;
+    PfbCacheKey key;
+    if (!readSourceKey(sourceName, key, verify)) {
+        munmap(addr, size);
+        error = "Can't read source file";
+        return NULL;
+    }
+    if (key.size != header->source.size
+            || key.mtime != header->source.mtime
+            || key.mtimeNsec != header->source.mtimeNsec
+            || key.sampleHash != header->source.sampleHash
+            || (verify && key.hash != header->source.hash)) {
+        munmap(addr, size);
+        error = "Cache is out of date";
+        return NULL;
+    }
+
+    error = NULL;
+    return (char*)addr;
+}
+
+bool PfbCache::isValid()
+{
+    size_t size;
+    char *addr = mapValid(size);
+    if (!addr) return false;
+    munmap(addr, size);
+    return true;
+}
+
+auto_ptr<PfbTree> PfbCache::load()
+{
+    size_t size;
+    char *addr = mapValid(size);
+    if (!addr) return auto_ptr<PfbTree>(NULL);
+
+    auto_ptr<PfbTree> tree(new PfbTree());
+    tree->adoptMapping(addr, size);
+    if (!readTree(addr, size, *tree)) {
+        error = "Corrupted cache file";
+        return auto_ptr<PfbTree>(NULL);
+    }
+    tree->buildNodeTable();
+    return tree;
+}
+
+bool PfbCache::save(PfbTree &tree)
+{
+    PfbCacheKey key;
+    if (!readSourceKey(sourceName, key, true)) {
+        error = "Can't read source file";
+        return false;
+    }
+    return write(tree, key);
+}
+
+bool PfbCache::rebuild(unsigned loadFlags)
+{
+    PfbCacheKey key;
+    if (!readSourceKey(sourceName, key, true)) {
+        error = "Can't read source file";
+        return false;
+    }
+
+    PfbFile file(sourceName, loadFlags);
+    auto_ptr<PfbTree> tree = file.load();
+    if (file.loadFailed()) {
+        error = file.getError();
+        return false;
+    }
+    return write(*tree, key);
+}
+
+bool PfbCache::write(PfbTree &tree, const PfbCacheKey &source)
+{
+    // Written aside then renamed: readers never see a partial cache
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".tmp%d", (int)getpid());
+    string tmpName = cacheName + suffix;
+
+    FILE *f = fopen(tmpName.c_str(), "wb");
+    if (!f) {
+        error = "Can't create cache file";
+        return false;
+    }
+    bool ok = writeTree(f, tree, source);
+    if (fclose(f) != 0) ok = false;
+
+    if (!ok || rename(tmpName.c_str(), cacheName.c_str()) != 0) {
+        unlink(tmpName.c_str());
+        error = "Can't write cache file";
+        return false;
+    }
+    error = NULL;
+    return true;
+}
+
+auto_ptr<PfbTree> PfbCache::loadCached(unsigned loadFlags)
+{
+    auto_ptr<PfbTree> tree = load();
+    if (tree.get()) {
+        if (!(loadFlags & (PFBLOAD_NOBOUNDS | PFBLOAD_LAZY)))
+            tree->computeBounds((loadFlags & PFBLOAD_PARALLEL) ? 0 : 1);
+        return tree;
+    }
+
+    // Keyed before parsing: a source modified meanwhile invalidates the cache
+    PfbCacheKey key;
+    bool haveKey = readSourceKey(sourceName, key, true);
+
+    PfbFile file(sourceName, loadFlags);
+    tree = file.load();
+    if (file.loadFailed()) {
+        error = file.getError();
+        return auto_ptr<PfbTree>(NULL);
+    }
+    // A cache that can't be written is not an error, the tree is loaded
+    if (haveKey) write(*tree, key);
+    error = NULL;
+    return tree;
+}
+/* }}} */
+}
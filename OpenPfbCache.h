@@ -0,0 +1,75 @@
+#ifndef _OPENPFB_CACHE_H
+#define _OPENPFB_CACHE_H
+
+#include "OpenPfb.h"
+
+namespace openpfb
+{
+    struct PfbCacheKey;
+
+/// Validate a cache with a hash of the whole source file, not only of its
+/// size, modification time and sampled content (slower, reads the source).
+#define PFBCACHE_VERIFY_CONTENT 0x0001
+
+    /// @class PfbCache
+    ///
+    /// @brief Native-endian image of a loaded PfbTree
+    ///
+    /// The cache file holds the tree content aligned, with offsets instead
+    /// of pointers. Loading it is a single mmap: lists, children, names,
+    /// ... point into the mapping, nothing is decoded or byte swapped.
+    ///
+    /// A cache remembers the size, modification time and content hash of
+    /// its source file, it is ignored as soon as one of them changes.
+    class PfbCache
+    {
+        public:
+            /// @param sourceName  the pfb file
+            /// @param cacheName   default is getDefaultName(sourceName)
+            /// @param flags       combination of PFBCACHE_* values
+            PfbCache(const std::string &sourceName,
+                    const std::string &cacheName = "", unsigned flags = 0);
+
+            /// Name of the cache of a pfb file: sourceName + ".cache"
+            static std::string getDefaultName(const std::string &sourceName);
+
+            /// True if the cache file exists and matches the source file
+            bool isValid();
+
+            /// Map the cache file. Fails if it is not valid. The bounds
+            /// of the tree are not computed (see PfbTree::computeBounds()).
+            std::auto_ptr<PfbTree> load();
+
+            /// Write tree as the cache of the source file. The tree must
+            /// have been loaded from the current source file. The cache is
+            /// replaced atomically.
+            bool save(PfbTree &tree);
+
+            /// Load the source file (PfbFile with loadFlags) and write its
+            /// cache, valid or not. The source is keyed before it is
+            /// parsed: if it changes meanwhile, the cache is outdated.
+            bool rebuild(unsigned loadFlags = 0);
+
+            /// Load the cache if it is valid. Otherwise load the source
+            /// file (PfbFile with loadFlags) and write the cache. The
+            /// bounds are computed as PfbFile::load() does.
+            std::auto_ptr<PfbTree> loadCached(unsigned loadFlags = 0);
+
+            bool loadFailed() const { return error != NULL; }
+            const char *getError() const { return error; }
+
+            const std::string &getCacheName() const { return cacheName; }
+
+        private:
+            std::string sourceName;
+            std::string cacheName;
+            unsigned    flags;
+            const char *error;
+
+            /// Map the cache and check it against the source, NULL if not valid
+            char *mapValid(size_t &size);
+            bool  write(PfbTree &tree, const PfbCacheKey &source);
+    };
+}
+
+#endif
@@ -0,0 +1,262 @@
+#include "OpenPfbLod.h"
+#include "OpenPfbScene.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+namespace openpfb
+{
+
+//
+// BUILD /* {{{ */
+//
+// The tree is walked with the combined matrices, the LODs being recorded
+// in pre-order, then sorted by level (stable, so that the LODs under the
+// same parent stay together).
+//
+
+static const float identity[16] = { 1,0,0,0, 0,1,0,0, 0,0,1,0, 0,0,0,1 };
+
+struct PfbLodEntry
+{
+    uint32_t node;
+    float    center[3];
+    int32_t  parent;      // pre-order index
+    int32_t  parentChild;
+    uint32_t depth;
+};
+
+struct PfbLodWalker
+{
+    PfbTree              &tree;
+    vector<PfbLodEntry>   entries;
+    vector<unsigned char> active; // node being walked (cycles)
+
+    PfbLodWalker(PfbTree &tree) : tree(tree), active(tree.getNumNodes(), 0) {}
+
+    void walkChildren(const PfbChilds &childs, const float *m, int32_t parent, int32_t parentChild, uint32_t depth) {
+        for (uint32_t i=0; i<childs.getNumChildren(); ++i)
+            walk(childs.getChild(i), m, parent, parentChild, depth);
+    }
+
+    void walk(uint32_t nodeId, const float *m, int32_t parent, int32_t parentChild, uint32_t depth) {
+        if (nodeId >= tree.getNumNodes() || active[nodeId]) return;
+        active[nodeId] = 1;
+        PfbNode &node = tree.getNode(nodeId);
+
+        float combined[16];
+        if (PfbNodeSCS *scs = node.asSCS()) {
+            multMatrix(combined, scs->getMatrix(), m);
+            walkChildren(scs->getChilds(), combined, parent, parentChild, depth);
+        }
+        else if (PfbNodeDCS *dcs = node.asDCS()) {
+            multMatrix(combined, dcs->getMatrix(), m);
+            walkChildren(dcs->getChilds(), combined, parent, parentChild, depth);
+        }
+        else if (PfbNodeGroup *group = node.asGroup()) {
+            walkChildren(group->getChilds(), m, parent, parentChild, depth);
+        }
+        else if (PfbNodeLOD *lod = node.asLOD()) {
+            PfbLodEntry entry;
+            entry.node        = nodeId;
+            entry.parent      = parent;
+            entry.parentChild = parentChild;
+            entry.depth       = depth;
+            transformPoints(entry.center, lod->getCenter(), 1, m);
+            entries.push_back(entry);
+
+            int32_t self = entries.size() - 1;
+            const PfbChilds &childs = lod->getChilds();
+            for (uint32_t i=0; i<childs.getNumChildren(); ++i)
+                walk(childs.getChild(i), m, self, i, depth + 1);
+        }
+        active[nodeId] = 0;
+    }
+};
+
+struct PfbLodDepthBefore
+{
+    const vector<PfbLodEntry> &entries;
+
+    PfbLodDepthBefore(const vector<PfbLodEntry> &entries) : entries(entries) {}
+
+    bool operator()(uint32_t a, uint32_t b) const { return entries[a].depth < entries[b].depth; }
+};
+
+PfbLodSelector::PfbLodSelector() :
+    hysteresis(0),
+    fadeRange(0),
+    numEvaluated(0)
+{
+}
+
+void PfbLodSelector::build(PfbTree &tree)
+{
+    PfbLodWalker walker(tree);
+    if (tree.getNumNodes()) walker.walk(0, identity, -1, -1, 0);
+    const vector<PfbLodEntry> &entries = walker.entries;
+    uint32_t num = entries.size();
+
+    vector<uint32_t> order(num), index(num);
+    for (uint32_t i=0; i<num; ++i)
+        order[i] = i;
+    stable_sort(order.begin(), order.end(), PfbLodDepthBefore(entries));
+    for (uint32_t i=0; i<num; ++i)
+        index[order[i]] = i;
+
+    nodes.resize(num);
+    centerX.resize(num);
+    centerY.resize(num);
+    centerZ.resize(num);
+    parent.resize(num);
+    parentChild.resize(num);
+    rangeFirst.resize(num);
+    numChildren.resize(num);
+    levels.clear();
+    ranges.clear();
+    rangesSq.clear();
+    children.clear();
+
+    for (uint32_t i=0; i<num; ++i) {
+        const PfbLodEntry &entry = entries[order[i]];
+        if (levels.size() <= entry.depth) levels.push_back(i);
+
+        nodes[i]       = entry.node;
+        centerX[i]     = entry.center[0];
+        centerY[i]     = entry.center[1];
+        centerZ[i]     = entry.center[2];
+        parent[i]      = (entry.parent < 0) ? -1 : (int32_t)index[entry.parent];
+        parentChild[i] = entry.parentChild;
+
+        const PfbNodeLOD &lod = *tree.getNode(entry.node).asLOD();
+        uint32_t count = min(lod.getNumRanges(), lod.getChilds().getNumChildren());
+        rangeFirst[i]  = ranges.size();
+        numChildren[i] = count;
+        for (uint32_t r=0; r<=count; ++r) {
+            float range = *lod.getRanges(r);
+            ranges.push_back(range);
+            rangesSq.push_back(range > 0 ? range * range : 0);
+            children.push_back(r < count ? lod.getChilds().getChild(r) : 0);
+        }
+    }
+    levels.push_back(num);
+
+    active.assign(num, -1);
+    blend.assign(num, 0);
+    blendChild.assign(num, -1);
+    distancesSq.assign(num, 0);
+    numEvaluated = 0;
+}
+/* }}} */
+
+//
+// SELECT /* {{{ */
+//
+// Level by level: the squared distances of 4 LODs at a time are computed
+// with SSE, then the ranges of the reachable ones are searched.
+//
+
+void PfbLodSelector::selectEntry(uint32_t i, float d2)
+{
+    const float *sq = &rangesSq[rangeFirst[i]];
+    uint32_t     n  = numChildren[i];
+    int32_t      previous = active[i];
+
+    int32_t child = -1;
+    if (previous >= 0 && (uint32_t)previous < n && hysteresis > 0) {
+        float lo = 1 - hysteresis, hi = 1 + hysteresis;
+        if (sq[previous] * lo * lo <= d2 && d2 < sq[previous + 1] * hi * hi)
+            child = previous;
+    }
+    for (uint32_t c=0; child < 0 && c<n; ++c) {
+        if (sq[c] <= d2 && d2 < sq[c + 1])
+            child = c;
+    }
+
+    active[i]     = child;
+    blend[i]      = 0;
+    blendChild[i] = -1;
+    if (child >= 0 && fadeRange > 0) {
+        float far = ranges[rangeFirst[i] + child + 1];
+        float t   = (sqrtf(d2) - (far - fadeRange)) / fadeRange;
+        if (t > 0) {
+            blend[i]      = (t < 1) ? t : 1;
+            blendChild[i] = ((uint32_t)child + 1 < n) ? child + 1 : -1;
+        }
+    }
+    numEvaluated++;
+}
+
+void PfbLodSelector::select(const float *viewpoints, unsigned numViewpoints, float scale)
+{
+    numEvaluated = 0;
+    float scaleSq = scale * scale;
+
+    for (unsigned l=0; l+1<levels.size(); ++l) {
+        uint32_t begin = levels[l], end = levels[l + 1];
+
+        // Reached when below the active child, or the one blended in
+        for (uint32_t i=begin; i<end; ++i) {
+            int32_t p = parent[i];
+            bool reached = (p < 0) || active[p] == parentChild[i] ||
+                (blend[p] > 0 && blendChild[p] == parentChild[i]);
+            if (!reached) {
+                active[i]      = -1;
+                blend[i]       = 0;
+                blendChild[i]  = -1;
+                distancesSq[i] = -1;
+                continue;
+            }
+            distancesSq[i] = FLT_MAX;
+        }
+
+        uint32_t i = begin;
+#ifdef __SSE2__
+        __m128 s = _mm_set1_ps(scaleSq);
+        for (; i + 4 <= end; i += 4) {
+            __m128 mask = _mm_cmpge_ps(_mm_loadu_ps(&distancesSq[i]), _mm_setzero_ps());
+            if (_mm_movemask_ps(mask) == 0) continue;
+
+            __m128 x = _mm_loadu_ps(&centerX[i]);
+            __m128 y = _mm_loadu_ps(&centerY[i]);
+            __m128 z = _mm_loadu_ps(&centerZ[i]);
+            __m128 best = _mm_set1_ps(FLT_MAX);
+            for (unsigned v=0; v<numViewpoints; ++v) {
+                const float *p = viewpoints + 3*v;
+                __m128 dx = _mm_sub_ps(x, _mm_set1_ps(p[0]));
+                __m128 dy = _mm_sub_ps(y, _mm_set1_ps(p[1]));
+                __m128 dz = _mm_sub_ps(z, _mm_set1_ps(p[2]));
+                __m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+                best = _mm_min_ps(best, d2);
+            }
+            // Unreached ones keep their -1
+            best = _mm_or_ps(_mm_and_ps(mask, _mm_mul_ps(best, s)), _mm_andnot_ps(mask, _mm_set1_ps(-1)));
+            _mm_storeu_ps(&distancesSq[i], best);
+        }
+#endif
+        for (; i < end; ++i) {
+            if (distancesSq[i] < 0) continue;
+            float best = FLT_MAX;
+            for (unsigned v=0; v<numViewpoints; ++v) {
+                const float *p = viewpoints + 3*v;
+                float dx = centerX[i] - p[0], dy = centerY[i] - p[1], dz = centerZ[i] - p[2];
+                float d2 = dx*dx + dy*dy + dz*dz;
+                if (d2 < best) best = d2;
+            }
+            distancesSq[i] = best * scaleSq;
+        }
+
+        for (i=begin; i<end; ++i) {
+            if (distancesSq[i] >= 0) selectEntry(i, distancesSq[i]);
+        }
+    }
+}
+/* }}} */
+}
@@ -0,0 +1,88 @@
+#ifndef _OPENPFB_LOD_H
+#define _OPENPFB_LOD_H
+
+#include "OpenPfb.h"
+
+namespace openpfb
+{
+    /// @class PfbLodSelector
+    ///
+    /// @brief Active child of every LOD node of a tree, for viewpoints
+    ///
+    /// build() gathers the LOD nodes as reached from the root (a LOD
+    /// reached through several paths is several entries) into flat
+    /// arrays: world center (through the SCS and DCS matrices above it,
+    /// DCS with their current matrix), ranges, children, and the LOD and
+    /// child it is reached through. Entries are ordered by nesting level,
+    /// so that select() only evaluates the LODs below active children.
+    ///
+    /// Child i of a LOD is active when ranges[i] <= distance * scale <
+    /// ranges[i+1], the distance being the one to the closest viewpoint.
+    class PfbLodSelector
+    {
+        public:
+            PfbLodSelector();
+
+            void build(PfbTree &tree);
+
+            /// Keep the active child of the previous select() while the
+            /// distance stays within its ranges widened by this fraction
+            /// (0 = no hysteresis)
+            void setHysteresis(float fraction) { hysteresis = fraction; }
+
+            /// Blend towards the next child over this distance before the
+            /// end of the range of the active one (0 = no blending)
+            void setFadeRange(float distance) { fadeRange = distance; }
+
+            /// Select the active children for numViewpoints points
+            /// (3 floats each)
+            void select(const float *viewpoints, unsigned numViewpoints, float scale = 1);
+
+            uint32_t getNumLods() const             { return nodes.size(); }
+            /// Node id of a LOD entry
+            uint32_t getNode(uint32_t lod) const    { return nodes[lod]; }
+
+            /// Active child index, -1 if none (out of the ranges or below
+            /// an inactive child)
+            int32_t getActiveChild(uint32_t lod) const { return active[lod]; }
+            /// Node id of child i of a LOD entry
+            uint32_t getChildNode(uint32_t lod, int32_t i) const { return children[rangeFirst[lod] + i]; }
+
+            /// How far the active child is faded towards getBlendChild():
+            /// 0 only the active child, up to 1
+            float   getBlend(uint32_t lod) const      { return blend[lod]; }
+            /// Child faded in, -1 when the active child fades out
+            int32_t getBlendChild(uint32_t lod) const { return blendChild[lod]; }
+
+            /// Entries evaluated by the last select()
+            uint32_t getNumEvaluated() const { return numEvaluated; }
+
+        private:
+            float hysteresis;
+            float fadeRange;
+
+            // Entry data (SoA)
+            std::vector<uint32_t> nodes;
+            std::vector<float>    centerX, centerY, centerZ;
+            std::vector<int32_t>  parent;       // entry of the LOD above, -1 none
+            std::vector<int32_t>  parentChild;  // child of parent reached through
+            std::vector<uint32_t> rangeFirst;   // in ranges, rangesSq and children
+            std::vector<uint32_t> numChildren;  // children with a range
+            std::vector<uint32_t> levels;       // first entry of each level, + end
+
+            std::vector<float>    ranges;       // numChildren + 1 per entry
+            std::vector<float>    rangesSq;     // squared, negative ones as 0
+            std::vector<uint32_t> children;     // numChildren + 1 per entry
+
+            // Result of select()
+            std::vector<int32_t>  active;
+            std::vector<float>    blend;
+            std::vector<int32_t>  blendChild;
+            std::vector<float>    distancesSq;  // scaled, -1 when not reached
+            uint32_t              numEvaluated;
+
+            void selectEntry(uint32_t i, float d2);
+    };
+}
+
+#endif
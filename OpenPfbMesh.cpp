@@ -0,0 +1,776 @@
+#include "OpenPfbMesh.h"
+#include "OpenPfbThreads.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+namespace openpfb
+{
+
+//
+// VERTEX LAYOUT /* {{{ */
+//
+
+PfbVertexLayout::PfbVertexLayout() : stride(0)
+{
+    for (unsigned a=0; a<PFBATTRIB_COUNT; ++a)
+        offsets[a] = -1;
+}
+
+PfbVertexLayout PfbVertexLayout::packed(unsigned mask, unsigned align)
+{
+    PfbVertexLayout layout;
+    for (unsigned a=0; a<PFBATTRIB_COUNT; ++a) {
+        if (!(mask & PFBATTRIB_BIT(a))) continue;
+        layout.offsets[a] = layout.stride;
+        layout.stride    += getNumComponents(a) * sizeof(float);
+    }
+    if (align > 1)
+        layout.stride = (layout.stride + align - 1) / align * align;
+    return layout;
+}
+
+unsigned PfbVertexLayout::getNumComponents(unsigned attrib)
+{
+    static const unsigned components[PFBATTRIB_COUNT] = { 3, 3, 2, 4 };
+    return (attrib < PFBATTRIB_COUNT) ? components[attrib] : 0;
+}
+/* }}} */
+
+//
+// INTERLEAVING /* {{{ */
+//
+// Every attribute of a geoset is contiguous in its list: the vertices are
+// written attribute by attribute, with a copy of fixed size (known at
+// compile time) per vertex.
+//
+
+template <unsigned N>
+static void copyValues(char *dst, uint32_t stride, const float *src, uint32_t count)
+{
+    for (uint32_t i=0; i<count; ++i, dst += stride, src += N)
+        memcpy(dst, src, N * sizeof(float));
+}
+
+template <unsigned N>
+static void fillValue(char *dst, uint32_t stride, const float *value, uint32_t count)
+{
+    float v[N];
+    memcpy(v, value, sizeof(v));
+    for (uint32_t i=0; i<count; ++i, dst += stride)
+        memcpy(dst, v, sizeof(v));
+}
+
+/// Write N floats per vertex from a list of size values (per vertex, per
+/// strip or overall), def for the missing ones
+template <unsigned N>
+static void writeAttrib(char *dst, uint32_t stride, uint32_t numVertices,
+        const float *src, uint32_t size, const PfbLengthList *lengths, const float *def)
+{
+    if (size == numVertices) {
+        copyValues<N>(dst, stride, src, numVertices);
+    }
+    else if (size == 1) {
+        fillValue<N>(dst, stride, src, numVertices);
+    }
+    else if (lengths && size == lengths->getSize()) {
+        uint32_t done = 0;
+        for (uint32_t s=0; s<size && done<numVertices; ++s) {
+            uint32_t n = *lengths->get(s);
+            if (n > numVertices - done) n = numVertices - done;
+            fillValue<N>(dst + (size_t)done * stride, stride, src + s * N, n);
+            done += n;
+        }
+        fillValue<N>(dst + (size_t)done * stride, stride, def, numVertices - done);
+    }
+    else {
+        uint32_t n = (size < numVertices) ? size : numVertices;
+        copyValues<N>(dst, stride, src, n);
+        fillValue<N>(dst + (size_t)n * stride, stride, def, numVertices - n);
+    }
+}
+
+template <unsigned N>
+static void writeList(char *dst, uint32_t stride, uint32_t numVertices,
+        PfbList<float,N> *list, const PfbLengthList *lengths, const float *def)
+{
+    if (list && list->getSize())
+        writeAttrib<N>(dst, stride, numVertices, list->get(0), list->getSize(), lengths, def);
+    else
+        fillValue<N>(dst, stride, def, numVertices);
+}
+
+uint32_t getNumVertices(PfbTree &tree, const PfbGeoSet &geoset)
+{
+    if (geoset.lengthListId < 0) return 0;
+    unsigned id = geoset.lengthListId;
+
+    if (tree.haveVertexList())
+        return (id < tree.getNumVertexList()) ? tree.getVertexList(id).getSize() : 0;
+
+    uint32_t num = 0;
+    if (tree.haveLengthList() && id < tree.getNumLengthList()) {
+        PfbLengthList &lengths = tree.getLengthList(id);
+        for (uint32_t s=0; s<lengths.getSize(); ++s)
+            num += *lengths.get(s);
+    }
+    return num;
+}
+
+uint32_t buildVertices(PfbTree &tree, const PfbGeoSet &geoset,
+        const PfbVertexLayout &layout, void *dst)
+{
+    uint32_t numVertices = getNumVertices(tree, geoset);
+    if (numVertices == 0) return 0;
+    unsigned id = geoset.lengthListId;
+
+    static const float zero[4]  = { 0, 0, 0, 0 };
+    static const float white[4] = { 1, 1, 1, 1 };
+
+    const PfbLengthList *lengths = NULL;
+    if (tree.haveLengthList() && id < tree.getNumLengthList())
+        lengths = &tree.getLengthList(id);
+
+    char    *out    = (char*)dst;
+    uint32_t stride = layout.stride;
+
+    if (layout.has(PFBATTRIB_POSITION)) {
+        PfbVertexList *list = (tree.haveVertexList() && id < tree.getNumVertexList()) ? &tree.getVertexList(id) : NULL;
+        writeList(out + layout.offsets[PFBATTRIB_POSITION], stride, numVertices, list, lengths, zero);
+    }
+    if (layout.has(PFBATTRIB_NORMAL)) {
+        PfbNormalList *list = (tree.haveNormalList() && id < tree.getNumNormalList()) ? &tree.getNormalList(id) : NULL;
+        writeList(out + layout.offsets[PFBATTRIB_NORMAL], stride, numVertices, list, lengths, zero);
+    }
+    if (layout.has(PFBATTRIB_TEXCOORD)) {
+        PfbTexcoordList *list = (tree.haveTexcoordList() && id < tree.getNumTexcoordList()) ? &tree.getTexcoordList(id) : NULL;
+        writeList(out + layout.offsets[PFBATTRIB_TEXCOORD], stride, numVertices, list, lengths, zero);
+    }
+    if (layout.has(PFBATTRIB_COLOR)) {
+        PfbColorList *list = (tree.haveColorList() && id < tree.getNumColorList()) ? &tree.getColorList(id) : NULL;
+        writeList(out + layout.offsets[PFBATTRIB_COLOR], stride, numVertices, list, lengths, white);
+    }
+    return numVertices;
+}
+/* }}} */
+
+//
+// VERTEX BUFFER /* {{{ */
+//
+
+/// Interleave geoset i at its place in the buffer
+struct PfbVertexTask : public PfbTask
+{
+    PfbTree               &tree;
+    const uint32_t        *geosets;
+    const PfbVertexLayout &layout;
+    const uint32_t        *firsts;
+    char                  *data;
+
+    PfbVertexTask(PfbTree &tree, const uint32_t *geosets, const PfbVertexLayout &layout,
+            const uint32_t *firsts, char *data) :
+        tree(tree), geosets(geosets), layout(layout), firsts(firsts), data(data) {}
+
+    void run(unsigned i) {
+        if (firsts[i+1] == firsts[i]) return;
+        buildVertices(tree, tree.getGeoSet(geosets[i]), layout,
+                data + (size_t)firsts[i] * layout.stride);
+    }
+};
+
+PfbVertexBuffer::PfbVertexBuffer() :
+    data(NULL),
+    capacity(0),
+    firsts(1, 0)
+{
+}
+
+PfbVertexBuffer::~PfbVertexBuffer()
+{
+    free(data);
+}
+
+void PfbVertexBuffer::build(PfbTree &tree, const uint32_t *geosets, uint32_t numGeosets,
+        const PfbVertexLayout &layout, unsigned numThreads)
+{
+    this->layout = layout;
+
+    // Vertex ranges first, so that every geoset knows where to go
+    firsts.resize(numGeosets + 1);
+    firsts[0] = 0;
+    for (uint32_t i=0; i<numGeosets; ++i) {
+        uint32_t num = (geosets[i] < tree.getNumGeosets()) ? openpfb::getNumVertices(tree, tree.getGeoSet(geosets[i])) : 0;
+        firsts[i+1] = firsts[i] + num;
+    }
+
+    size_t size = getSize();
+    if (size > capacity) {
+        free(data);
+        data = NULL;
+        capacity = 0;
+        void *mem;
+        if (posix_memalign(&mem, 64, size) != 0) throw std::bad_alloc();
+        data = (char*)mem;
+        capacity = size;
+    }
+    if (size == 0) return;
+
+    // Small geosets are not worth a thread
+    if (numGeosets < 2 || size < 64 * 1024) numThreads = 1;
+
+    PfbVertexTask task(tree, geosets, layout, &firsts[0], data);
+    parallelFor(task, numGeosets, numThreads);
+}
+
+void PfbVertexBuffer::build(PfbTree &tree, const PfbNodeGeode &geode,
+        const PfbVertexLayout &layout, unsigned numThreads)
+{
+    build(tree, geode.getGeosets(), geode.getNumGeosets(), layout, numThreads);
+}
+/* }}} */
+//
+// INDEXED MESH /* {{{ */
+//
+
+/// Values of a vertex compared when merging: the floats of the layout
+/// attributes, as bits or rounded to multiples of epsilon
+static void makeKeys(const char *vertices, uint32_t numVertices, const PfbVertexLayout &layout,
+        float epsilon, vector<int32_t> &keys, unsigned &keySize)
+{
+    keySize = 0;
+    for (unsigned a=0; a<PFBATTRIB_COUNT; ++a)
+        if (layout.has(a)) keySize += PfbVertexLayout::getNumComponents(a);
+
+    keys.resize((size_t)numVertices * keySize);
+    int32_t *key = keys.empty() ? NULL : &keys[0];
+    float    inv = (epsilon > 0) ? 1.0f / epsilon : 0;
+
+    for (uint32_t v=0; v<numVertices; ++v) {
+        const char *vertex = vertices + (size_t)v * layout.stride;
+        for (unsigned a=0; a<PFBATTRIB_COUNT; ++a) {
+            if (!layout.has(a)) continue;
+            const float *values = (const float*)(vertex + layout.offsets[a]);
+            for (unsigned c=0; c<PfbVertexLayout::getNumComponents(a); ++c) {
+                float x = values[c];
+                if (epsilon > 0) {
+                    float q = x * inv + (x < 0 ? -0.5f : 0.5f);
+                    *key++ = (q >= 2147483520.0f) ? 0x7fffffff : (q <= -2147483520.0f) ? (int32_t)0x80000000 : (int32_t)q;
+                }
+                else {
+                    memcpy(key++, &x, sizeof(x));
+                }
+            }
+        }
+    }
+}
+
+static uint32_t hashKey(const int32_t *key, unsigned size)
+{
+    uint32_t h = 2166136261u;
+    for (unsigned i=0; i<size; ++i) {
+        h ^= (uint32_t)key[i];
+        h *= 0x9e3779b1u;
+        h ^= h >> 15;
+    }
+    return h;
+}
+
+/// Triangles of the geoset, as indices of its unmerged vertices
+static void makeTriangles(PfbTree &tree, const PfbGeoSet &geoset, uint32_t numVertices,
+        vector<uint32_t> &triangles)
+{
+    unsigned id = geoset.lengthListId;
+    vector<uint32_t> lengths;
+    if (tree.haveLengthList() && id < tree.getNumLengthList()) {
+        PfbLengthList &list = tree.getLengthList(id);
+        if (list.getSize()) lengths.assign(list.get(0), list.get(0) + list.getSize());
+    }
+    if (lengths.empty()) lengths.push_back(numVertices);
+    triangles.reserve(3 * (size_t)numVertices);
+
+    bool strips = (geoset.stripType != 8);
+    uint32_t first = 0;
+    for (unsigned s=0; s<lengths.size() && first<numVertices; ++s) {
+        uint32_t n = lengths[s];
+        if (n > numVertices - first) n = numVertices - first;
+
+        for (uint32_t k=2; k<n; ++k) {
+            if (!strips) {
+                triangles.push_back(first);
+                triangles.push_back(first + k - 1);
+            }
+            else if (k & 1) {
+                triangles.push_back(first + k - 1);
+                triangles.push_back(first + k - 2);
+            }
+            else {
+                triangles.push_back(first + k - 2);
+                triangles.push_back(first + k - 1);
+            }
+            triangles.push_back(first + k);
+        }
+        first += n;
+    }
+}
+
+PfbIndexedMesh::PfbIndexedMesh() :
+    numVertices(0),
+    numSourceVertices(0)
+{
+}
+
+void PfbIndexedMesh::build(PfbTree &tree, const PfbGeoSet &geoset,
+        const PfbVertexLayout &layout, float epsilon)
+{
+    this->layout = layout;
+    numVertices  = 0;
+    vertices.clear();
+    indices16.clear();
+    indices32.clear();
+
+    // Unmerged vertices, padding bytes cleared
+    numSourceVertices = openpfb::getNumVertices(tree, geoset);
+    vector<char> source((size_t)numSourceVertices * layout.stride, 0);
+    if (numSourceVertices) buildVertices(tree, geoset, layout, &source[0]);
+
+    vector<uint32_t> triangles;
+    makeTriangles(tree, geoset, numSourceVertices, triangles);
+
+    // Merge identical vertices: remap[source vertex] = merged vertex
+    vector<int32_t> keys;
+    unsigned keySize;
+    makeKeys(source.empty() ? NULL : &source[0], numSourceVertices, layout, epsilon, keys, keySize);
+
+    uint32_t capacity = 16;
+    while (capacity < numSourceVertices * 2) capacity *= 2;
+    vector<uint32_t> table(capacity, 0xffffffff);
+    vector<uint32_t> remap(numSourceVertices);
+    vector<uint32_t> firstSource;
+    firstSource.reserve(numSourceVertices);
+
+    const int32_t *keyData = keys.empty() ? NULL : &keys[0];
+    for (uint32_t v=0; v<numSourceVertices; ++v) {
+        const int32_t *key = keyData + (size_t)v * keySize;
+        uint32_t slot = hashKey(key, keySize) & (capacity - 1);
+        for (;;) {
+            uint32_t m = table[slot];
+            if (m == 0xffffffff) {
+                table[slot] = numVertices;
+                remap[v] = numVertices++;
+                firstSource.push_back(v);
+                break;
+            }
+            if (memcmp(keyData + (size_t)firstSource[m] * keySize, key, keySize * sizeof(int32_t)) == 0) {
+                remap[v] = m;
+                break;
+            }
+            slot = (slot + 1) & (capacity - 1);
+        }
+    }
+
+    vertices.resize((size_t)numVertices * layout.stride);
+    for (uint32_t m=0; m<numVertices; ++m)
+        memcpy(&vertices[(size_t)m * layout.stride], &source[(size_t)firstSource[m] * layout.stride], layout.stride);
+
+    // Indices, without the triangles that merging made degenerate
+    vector<uint32_t> indices;
+    indices.reserve(triangles.size());
+    for (size_t t=0; t+2<triangles.size(); t+=3) {
+        uint32_t a = remap[triangles[t]], b = remap[triangles[t+1]], c = remap[triangles[t+2]];
+        if (a == b || b == c || a == c) continue;
+        indices.push_back(a);
+        indices.push_back(b);
+        indices.push_back(c);
+    }
+
+    if (is16Bit())
+        indices16.assign(indices.begin(), indices.end());
+    else
+        indices32.swap(indices);
+}
+
+/// Convert geoset i into mesh i
+struct PfbIndexedMeshTask : public PfbTask
+{
+    PfbTree               &tree;
+    const uint32_t        *geosets;
+    const PfbVertexLayout &layout;
+    float                  epsilon;
+    PfbIndexedMesh        *meshes;
+
+    PfbIndexedMeshTask(PfbTree &tree, const uint32_t *geosets, const PfbVertexLayout &layout,
+            float epsilon, PfbIndexedMesh *meshes) :
+        tree(tree), geosets(geosets), layout(layout), epsilon(epsilon), meshes(meshes) {}
+
+    void run(unsigned i) {
+        if (geosets[i] < tree.getNumGeosets())
+            meshes[i].build(tree, tree.getGeoSet(geosets[i]), layout, epsilon);
+        else
+            meshes[i] = PfbIndexedMesh();
+    }
+};
+
+void buildIndexedMeshes(PfbTree &tree, const uint32_t *geosets, uint32_t numGeosets,
+        const PfbVertexLayout &layout, float epsilon, PfbIndexedMesh *meshes,
+        unsigned numThreads)
+{
+    PfbIndexedMeshTask task(tree, geosets, layout, epsilon, meshes);
+    parallelFor(task, numGeosets, numThreads);
+}
+/* }}} */
+//
+// VERTEX CACHE OPTIMIZATION /* {{{ */
+//
+
+#define PFBMESH_FORSYTH_CACHE   32 // LRU cache modeled by the Forsyth scores
+#define PFBMESH_FORSYTH_VALENCE 32 // valence scores are tabulated up to this
+#define PFBMESH_FIFO_CACHE      16 // FIFO cache used to find the clusters
+
+static void getIndices(const PfbIndexedMesh &mesh, vector<uint32_t> &indices)
+{
+    indices.resize(mesh.getNumIndices());
+    for (uint32_t i=0; i<indices.size(); ++i)
+        indices[i] = mesh.getIndex(i);
+}
+
+static void setIndices(PfbIndexedMesh &mesh, const vector<uint32_t> &indices)
+{
+    if (mesh.is16Bit()) {
+        uint16_t *dst = mesh.getIndices16();
+        for (uint32_t i=0; i<indices.size(); ++i)
+            dst[i] = (uint16_t)indices[i];
+    }
+    else if (!indices.empty()) {
+        memcpy(mesh.getIndices32(), &indices[0], indices.size() * sizeof(uint32_t));
+    }
+}
+
+/// Cache misses of every triangle with a FIFO cache
+static uint32_t simulateFifo(const vector<uint32_t> &indices, uint32_t numVertices,
+        unsigned cacheSize, vector<unsigned char> *triangleMisses)
+{
+    // Vertex v is in the cache if it went in less than cacheSize misses ago
+    vector<uint32_t> stamps(numVertices, 0);
+    uint32_t misses = 0;
+    if (triangleMisses) triangleMisses->resize(indices.size() / 3);
+
+    for (size_t t=0; t+2<indices.size(); t+=3) {
+        unsigned triangle = 0;
+        for (unsigned k=0; k<3; ++k) {
+            uint32_t v = indices[t+k];
+            if (stamps[v] && misses - stamps[v] < cacheSize) continue;
+            stamps[v] = ++misses;
+            ++triangle;
+        }
+        if (triangleMisses) (*triangleMisses)[t/3] = triangle;
+    }
+    return misses;
+}
+
+static PfbVertexCacheStats analyze(const vector<uint32_t> &indices, uint32_t numVertices, unsigned cacheSize)
+{
+    PfbVertexCacheStats stats;
+    stats.acmr = stats.atvr = 0;
+    if (indices.empty()) return stats;
+
+    vector<unsigned char> used(numVertices, 0);
+    uint32_t numUsed = 0;
+    for (size_t i=0; i<indices.size(); ++i)
+        if (!used[indices[i]]) used[indices[i]] = 1, ++numUsed;
+
+    uint32_t misses = simulateFifo(indices, numVertices, cacheSize, NULL);
+    stats.acmr = (float)misses / (indices.size() / 3);
+    stats.atvr = (float)misses / numUsed;
+    return stats;
+}
+
+PfbVertexCacheStats analyzeVertexCache(const PfbIndexedMesh &mesh, unsigned cacheSize)
+{
+    vector<uint32_t> indices;
+    getIndices(mesh, indices);
+    return analyze(indices, mesh.getNumVertices(), cacheSize);
+}
+
+/// Vertex scores of "Linear-speed vertex cache optimisation" (T. Forsyth)
+struct PfbForsythScores
+{
+    float cache[PFBMESH_FORSYTH_CACHE];
+    float valence[PFBMESH_FORSYTH_VALENCE];
+
+    PfbForsythScores() {
+        const float decayPower = 1.5f, lastTriangle = 0.75f;
+        const float valenceScale = 2.0f, valencePower = 0.5f;
+
+        for (unsigned i=0; i<PFBMESH_FORSYTH_CACHE; ++i) {
+            if (i < 3)
+                cache[i] = lastTriangle;
+            else
+                cache[i] = powf(1.0f - (float)(i - 3) / (PFBMESH_FORSYTH_CACHE - 3), decayPower);
+        }
+        valence[0] = 0;
+        for (unsigned i=1; i<PFBMESH_FORSYTH_VALENCE; ++i)
+            valence[i] = valenceScale * powf((float)i, -valencePower);
+    }
+
+    float score(int cachePos, uint32_t remaining) const {
+        if (remaining == 0) return -1;
+        float s = (cachePos < 0) ? 0 : cache[cachePos];
+        return s + valence[(remaining < PFBMESH_FORSYTH_VALENCE) ? remaining : PFBMESH_FORSYTH_VALENCE - 1];
+    }
+};
+
+static void optimizeForsyth(const vector<uint32_t> &indices, uint32_t numVertices, vector<uint32_t> &out)
+{
+    static const PfbForsythScores scores;
+    uint32_t numTriangles = indices.size() / 3;
+    out.clear();
+    out.reserve(indices.size());
+    if (numTriangles == 0) return;
+
+    // Triangles not yet added, per vertex
+    vector<uint32_t> remaining(numVertices, 0);
+    for (size_t i=0; i<indices.size(); ++i)
+        remaining[indices[i]]++;
+    vector<uint32_t> offsets(numVertices + 1, 0);
+    for (uint32_t v=0; v<numVertices; ++v)
+        offsets[v+1] = offsets[v] + remaining[v];
+    vector<uint32_t> adjacency(indices.size());
+    vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+    for (size_t i=0; i<indices.size(); ++i)
+        adjacency[fill[indices[i]]++] = i / 3;
+
+    vector<int>   cachePos(numVertices, -1);
+    vector<float> vertexScore(numVertices);
+    for (uint32_t v=0; v<numVertices; ++v)
+        vertexScore[v] = scores.score(-1, remaining[v]);
+
+    vector<float> triangleScore(numTriangles);
+    vector<unsigned char> added(numTriangles, 0);
+    int best = 0;
+    for (uint32_t t=0; t<numTriangles; ++t) {
+        triangleScore[t] = vertexScore[indices[3*t]] + vertexScore[indices[3*t+1]] + vertexScore[indices[3*t+2]];
+        if (triangleScore[t] > triangleScore[best]) best = t;
+    }
+
+    uint32_t cache[PFBMESH_FORSYTH_CACHE + 3];
+    unsigned cacheSize = 0;
+    uint32_t cursor    = 0;
+
+    for (uint32_t n=0; n<numTriangles; ++n) {
+        // No candidate around the cache: take the next triangle left
+        if (best < 0) {
+            while (added[cursor]) ++cursor;
+            best = cursor;
+        }
+        added[best] = 1;
+        const uint32_t *tri = &indices[3 * best];
+        out.insert(out.end(), tri, tri + 3);
+
+        for (unsigned k=0; k<3; ++k) {
+            uint32_t v = tri[k];
+            uint32_t *begin = &adjacency[offsets[v]];
+            uint32_t *end   = begin + remaining[v];
+            uint32_t *it    = std::find(begin, end, (uint32_t)best);
+            *it = end[-1];
+            remaining[v]--;
+        }
+
+        // Triangle vertices first, then the previous content
+        uint32_t newCache[PFBMESH_FORSYTH_CACHE + 3];
+        unsigned newSize = 0;
+        for (unsigned k=0; k<3; ++k)
+            newCache[newSize++] = tri[k];
+        for (unsigned i=0; i<cacheSize; ++i)
+            if (cache[i] != tri[0] && cache[i] != tri[1] && cache[i] != tri[2])
+                newCache[newSize++] = cache[i];
+
+        // Rescore the vertices that moved, in or out of the cache
+        for (unsigned i=0; i<newSize; ++i) {
+            uint32_t v = newCache[i];
+            int pos = (i < PFBMESH_FORSYTH_CACHE) ? (int)i : -1;
+            cachePos[v] = pos;
+            float score = scores.score(pos, remaining[v]);
+            float delta = score - vertexScore[v];
+            vertexScore[v] = score;
+            for (uint32_t a=offsets[v]; a<offsets[v]+remaining[v]; ++a)
+                triangleScore[adjacency[a]] += delta;
+        }
+        cacheSize = (newSize < PFBMESH_FORSYTH_CACHE) ? newSize : PFBMESH_FORSYTH_CACHE;
+        memcpy(cache, newCache, cacheSize * sizeof(uint32_t));
+
+        // Best triangle using a cached vertex
+        best = -1;
+        float bestScore = -1;
+        for (unsigned i=0; i<cacheSize; ++i) {
+            uint32_t v = cache[i];
+            for (uint32_t a=offsets[v]; a<offsets[v]+remaining[v]; ++a) {
+                uint32_t t = adjacency[a];
+                if (triangleScore[t] > bestScore) {
+                    bestScore = triangleScore[t];
+                    best = t;
+                }
+            }
+        }
+    }
+}
+
+/// Triangles [first, first+count) of indices, in position space
+struct PfbCluster
+{
+    uint32_t first;
+    uint32_t count;
+    float    key;  // how much the cluster faces outward
+};
+
+static bool clusterFacesMore(const PfbCluster &a, const PfbCluster &b)
+{
+    return a.key > b.key;
+}
+
+static void optimizeOverdraw(const PfbIndexedMesh &mesh, vector<uint32_t> &indices, float threshold)
+{
+    uint32_t numTriangles = indices.size() / 3;
+    if (numTriangles < 2) return;
+
+    vector<unsigned char> misses;
+    uint32_t totalMisses = simulateFifo(indices, mesh.getNumVertices(), PFBMESH_FIFO_CACHE, &misses);
+    float acmr = (float)totalMisses / numTriangles;
+
+    // Hard cuts where the cache restarts cold, soft cuts once a cluster
+    // is efficient enough
+    vector<PfbCluster> clusters;
+    uint32_t clusterMisses = 0;
+    for (uint32_t t=0; t<numTriangles; ++t) {
+        bool cut = (t == 0) || misses[t] == 3;
+        if (!cut) {
+            const PfbCluster &c = clusters.back();
+            cut = clusterMisses <= threshold * acmr * c.count;
+        }
+        if (cut) {
+            PfbCluster c = { t, 0, 0 };
+            clusters.push_back(c);
+            clusterMisses = 0;
+        }
+        clusters.back().count++;
+        clusterMisses += misses[t];
+    }
+    if (clusters.size() < 2) return;
+
+    // Area-weighted centroid and normal of the clusters and of the mesh
+    const char    *vertices = mesh.getVertices();
+    const uint32_t stride   = mesh.getLayout().stride;
+    const int32_t  offset   = mesh.getLayout().offsets[PFBATTRIB_POSITION];
+    vector<float> centroids(clusters.size() * 3, 0), normals(clusters.size() * 3, 0);
+    float meshCentroid[3] = { 0, 0, 0 };
+    float meshArea = 0;
+
+    for (unsigned c=0; c<clusters.size(); ++c) {
+        float *centroid = &centroids[3*c], *normal = &normals[3*c];
+        float area = 0;
+        for (uint32_t t=clusters[c].first; t<clusters[c].first+clusters[c].count; ++t) {
+            const float *p0 = (const float*)(vertices + (size_t)indices[3*t]   * stride + offset);
+            const float *p1 = (const float*)(vertices + (size_t)indices[3*t+1] * stride + offset);
+            const float *p2 = (const float*)(vertices + (size_t)indices[3*t+2] * stride + offset);
+            float e1[3] = { p1[0]-p0[0], p1[1]-p0[1], p1[2]-p0[2] };
+            float e2[3] = { p2[0]-p0[0], p2[1]-p0[1], p2[2]-p0[2] };
+            float n[3]  = { e1[1]*e2[2]-e1[2]*e2[1], e1[2]*e2[0]-e1[0]*e2[2], e1[0]*e2[1]-e1[1]*e2[0] };
+            float a     = sqrtf(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+            for (unsigned k=0; k<3; ++k) {
+                centroid[k] += (p0[k] + p1[k] + p2[k]) * a;
+                normal[k]   += n[k];
+            }
+            area += a;
+        }
+        for (unsigned k=0; k<3; ++k)
+            meshCentroid[k] += centroid[k];
+        meshArea += area;
+        if (area > 0)
+            for (unsigned k=0; k<3; ++k)
+                centroid[k] /= 3 * area;
+    }
+    if (meshArea <= 0) return;
+    for (unsigned k=0; k<3; ++k)
+        meshCentroid[k] /= 3 * meshArea;
+
+    for (unsigned c=0; c<clusters.size(); ++c) {
+        const float *centroid = &centroids[3*c], *normal = &normals[3*c];
+        float length = sqrtf(normal[0]*normal[0] + normal[1]*normal[1] + normal[2]*normal[2]);
+        float dot = 0;
+        for (unsigned k=0; k<3; ++k)
+            dot += (centroid[k] - meshCentroid[k]) * normal[k];
+        clusters[c].key = (length > 0) ? dot / length : 0;
+    }
+
+    std::stable_sort(clusters.begin(), clusters.end(), clusterFacesMore);
+
+    vector<uint32_t> sorted;
+    sorted.reserve(indices.size());
+    for (unsigned c=0; c<clusters.size(); ++c)
+        sorted.insert(sorted.end(), indices.begin() + 3 * clusters[c].first,
+                indices.begin() + 3 * (clusters[c].first + clusters[c].count));
+    indices.swap(sorted);
+}
+
+/// Renumber the vertices in order of first use, unused ones last
+static void reorderVertices(PfbIndexedMesh &mesh, vector<uint32_t> &indices)
+{
+    uint32_t numVertices = mesh.getNumVertices();
+    if (numVertices == 0) return;
+
+    vector<uint32_t> remap(numVertices, 0xffffffff);
+    uint32_t next = 0;
+    for (size_t i=0; i<indices.size(); ++i) {
+        uint32_t &m = remap[indices[i]];
+        if (m == 0xffffffff) m = next++;
+        indices[i] = m;
+    }
+    for (uint32_t v=0; v<numVertices; ++v)
+        if (remap[v] == 0xffffffff) remap[v] = next++;
+
+    uint32_t stride = mesh.getLayout().stride;
+    vector<char> vertices(mesh.getVertices(), mesh.getVertices() + (size_t)numVertices * stride);
+    for (uint32_t v=0; v<numVertices; ++v)
+        memcpy(mesh.getVertices() + (size_t)remap[v] * stride, &vertices[(size_t)v * stride], stride);
+}
+
+void optimizeMesh(PfbIndexedMesh &mesh, PfbOptimizeReport *report, float overdrawThreshold)
+{
+    vector<uint32_t> indices;
+    getIndices(mesh, indices);
+    if (report) report->before = analyze(indices, mesh.getNumVertices(), PFBMESH_FIFO_CACHE);
+
+    vector<uint32_t> ordered;
+    optimizeForsyth(indices, mesh.getNumVertices(), ordered);
+    if (overdrawThreshold > 0 && mesh.getLayout().has(PFBATTRIB_POSITION))
+        optimizeOverdraw(mesh, ordered, overdrawThreshold);
+    reorderVertices(mesh, ordered);
+    setIndices(mesh, ordered);
+
+    if (report) report->after = analyze(ordered, mesh.getNumVertices(), PFBMESH_FIFO_CACHE);
+}
+
+/// Optimize mesh i
+struct PfbOptimizeTask : public PfbTask
+{
+    PfbIndexedMesh    *meshes;
+    PfbOptimizeReport *reports;
+    float              overdrawThreshold;
+
+    PfbOptimizeTask(PfbIndexedMesh *meshes, PfbOptimizeReport *reports, float overdrawThreshold) :
+        meshes(meshes), reports(reports), overdrawThreshold(overdrawThreshold) {}
+
+    void run(unsigned i) {
+        optimizeMesh(meshes[i], reports ? reports + i : NULL, overdrawThreshold);
+    }
+};
+
+void optimizeMeshes(PfbIndexedMesh *meshes, uint32_t numMeshes,
+        PfbOptimizeReport *reports, float overdrawThreshold, unsigned numThreads)
+{
+    PfbOptimizeTask task(meshes, reports, overdrawThreshold);
+    parallelFor(task, numMeshes, numThreads);
+}
+/* }}} */
+}
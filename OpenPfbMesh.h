@@ -0,0 +1,199 @@
+#ifndef _OPENPFB_MESH_H
+#define _OPENPFB_MESH_H
+
+#include "OpenPfb.h"
+
+namespace openpfb
+{
+#define PFBATTRIB_POSITION 0 // float[3], vertex list
+#define PFBATTRIB_NORMAL   1 // float[3], normal list
+#define PFBATTRIB_TEXCOORD 2 // float[2], texcoord list
+#define PFBATTRIB_COLOR    3 // float[4], color list
+#define PFBATTRIB_COUNT    4
+
+/// Bit of an attribute in the masks of PfbVertexLayout::packed()
+#define PFBATTRIB_BIT(attrib) (1u << (attrib))
+
+    /// @struct PfbVertexLayout
+    ///
+    /// @brief Where the attributes are in an interleaved vertex
+    struct PfbVertexLayout
+    {
+        uint32_t stride;                   // bytes from a vertex to the next
+        int32_t  offsets[PFBATTRIB_COUNT]; // byte offset in the vertex, -1 = absent
+
+        /// Empty layout, attributes are added by setting their offset
+        PfbVertexLayout();
+
+        /// The attributes of mask (PFBATTRIB_BIT values) one after the
+        /// other, in PFBATTRIB order. The stride is rounded up to a
+        /// multiple of align bytes.
+        static PfbVertexLayout packed(unsigned mask, unsigned align = 4);
+
+        bool has(unsigned attrib) const { return offsets[attrib] >= 0; }
+
+        /// Number of floats of an attribute
+        static unsigned getNumComponents(unsigned attrib);
+    };
+
+    /// Number of vertices of a geoset: size of its vertex list, or sum of
+    /// its strip lengths if the tree has no vertex list.
+    ///
+    /// The lists of a geoset are the ones whose id is geoset.lengthListId.
+    /// A normal, texcoord or color list holds one value per vertex, per
+    /// strip or for the whole geoset, depending on its size. Missing values
+    /// default to 0 (white for colors).
+    uint32_t getNumVertices(PfbTree &tree, const PfbGeoSet &geoset);
+
+    /// Write the interleaved vertices of geoset at dst, which must hold
+    /// getNumVertices() * layout.stride bytes. Bytes of dst not covered by
+    /// the layout are left untouched. Returns the number of vertices.
+    uint32_t buildVertices(PfbTree &tree, const PfbGeoSet &geoset,
+            const PfbVertexLayout &layout, void *dst);
+
+    /// @class PfbVertexBuffer
+    ///
+    /// @brief Interleaved vertices of several geosets, one after the other
+    class PfbVertexBuffer
+    {
+        public:
+            PfbVertexBuffer();
+            ~PfbVertexBuffer();
+
+            /// Build the vertices of the geosets (ids in tree), the
+            /// geosets being processed concurrently on numThreads threads
+            /// (0 = one per processor). The memory of a previous build is
+            /// reused.
+            void build(PfbTree &tree, const uint32_t *geosets, uint32_t numGeosets,
+                    const PfbVertexLayout &layout, unsigned numThreads = 0);
+
+            /// Build the vertices of all the geosets of a geode
+            void build(PfbTree &tree, const PfbNodeGeode &geode,
+                    const PfbVertexLayout &layout, unsigned numThreads = 0);
+
+            const PfbVertexLayout &getLayout() const { return layout; }
+
+            /// Vertex data, 64-byte aligned
+            char       *getData()       { return data; }
+            const char *getData() const { return data; }
+            size_t      getSize() const { return (size_t)getNumVertices() * layout.stride; }
+
+            uint32_t getNumVertices() const { return firsts.back(); }
+
+            /// Vertices of the i-th geoset given to build()
+            uint32_t getFirstVertex(uint32_t i) const { return firsts[i]; }
+            uint32_t getNumVertices(uint32_t i) const { return firsts[i+1] - firsts[i]; }
+
+        private:
+            PfbVertexLayout       layout;
+            char                 *data;
+            size_t                capacity;
+            std::vector<uint32_t> firsts; // numGeosets + 1
+
+            PfbVertexBuffer(const PfbVertexBuffer &);
+            PfbVertexBuffer &operator=(const PfbVertexBuffer &);
+    };
+
+    /// @class PfbIndexedMesh
+    ///
+    /// @brief Indexed triangle list of a geoset, identical vertices merged
+    ///
+    /// Strips are expanded to triangles, every other triangle of a strip
+    /// being flipped to keep the winding of the first one. Geosets of
+    /// stripType 8 (no strips) hold polygons, which are split in fans.
+    /// Triangles that become degenerate once vertices are merged are
+    /// dropped. Indices are 16-bit when there are at most 65536 vertices.
+    class PfbIndexedMesh
+    {
+        public:
+            PfbIndexedMesh();
+
+            /// Convert geoset, with vertices interleaved as layout says.
+            /// Vertices are merged when all their attributes of the layout
+            /// are identical or, if epsilon > 0, when all their values
+            /// round to the same multiple of epsilon.
+            void build(PfbTree &tree, const PfbGeoSet &geoset,
+                    const PfbVertexLayout &layout, float epsilon = 0);
+
+            const PfbVertexLayout &getLayout() const { return layout; }
+
+            uint32_t    getNumVertices() const { return numVertices; }
+            const char *getVertices() const    { return vertices.empty() ? NULL : &vertices[0]; }
+            char       *getVertices()          { return vertices.empty() ? NULL : &vertices[0]; }
+
+            /// Number of vertices of the strips, before merging
+            uint32_t    getNumSourceVertices() const { return numSourceVertices; }
+
+            uint32_t getNumTriangles() const { return getNumIndices() / 3; }
+            uint32_t getNumIndices() const {
+                return (uint32_t)(is16Bit() ? indices16.size() : indices32.size());
+            }
+            bool     is16Bit() const { return numVertices <= 0x10000; }
+            uint32_t getIndex(uint32_t i) const {
+                return is16Bit() ? indices16[i] : indices32[i];
+            }
+
+            /// Indices, when is16Bit()
+            const uint16_t *getIndices16() const { return indices16.empty() ? NULL : &indices16[0]; }
+            uint16_t       *getIndices16()       { return indices16.empty() ? NULL : &indices16[0]; }
+            /// Indices, when !is16Bit()
+            const uint32_t *getIndices32() const { return indices32.empty() ? NULL : &indices32[0]; }
+            uint32_t       *getIndices32()       { return indices32.empty() ? NULL : &indices32[0]; }
+
+        private:
+            PfbVertexLayout       layout;
+            uint32_t              numVertices;
+            uint32_t              numSourceVertices;
+            std::vector<char>     vertices;
+            std::vector<uint16_t> indices16;
+            std::vector<uint32_t> indices32;
+    };
+
+    /// Convert the geosets (ids in tree) into meshes[0..numGeosets), the
+    /// geosets being processed concurrently on numThreads threads
+    /// (0 = one per processor)
+    void buildIndexedMeshes(PfbTree &tree, const uint32_t *geosets, uint32_t numGeosets,
+            const PfbVertexLayout &layout, float epsilon, PfbIndexedMesh *meshes,
+            unsigned numThreads = 0);
+    /// @struct PfbVertexCacheStats
+    ///
+    /// @brief Efficiency of a triangle order for a FIFO post-transform cache
+    struct PfbVertexCacheStats
+    {
+        float acmr; // cache misses per triangle: 3 worst, ~0.5 best
+        float atvr; // cache misses per used vertex: 1 best
+    };
+
+    /// Simulate a FIFO cache of cacheSize vertices on the mesh triangles
+    PfbVertexCacheStats analyzeVertexCache(const PfbIndexedMesh &mesh, unsigned cacheSize = 16);
+
+    /// @struct PfbOptimizeReport
+    ///
+    /// @brief Vertex cache efficiency before and after optimizeMesh()
+    struct PfbOptimizeReport
+    {
+        PfbVertexCacheStats before;
+        PfbVertexCacheStats after;
+    };
+
+    /// Reorder the triangles of mesh for the vertex cache (Forsyth), then
+    /// sort clusters of them to draw the outward facing ones first (less
+    /// overdraw), then renumber the vertices in order of first use.
+    ///
+    /// Clusters are cut where the order restarts from a cold cache, and
+    /// as soon as the cache misses of a cluster fall below
+    /// overdrawThreshold times those of the whole order: the higher the
+    /// threshold, the smaller the clusters (less overdraw, more misses).
+    /// 0 disables the overdraw step, which also needs positions in the
+    /// mesh layout.
+    void optimizeMesh(PfbIndexedMesh &mesh, PfbOptimizeReport *report = NULL,
+            float overdrawThreshold = 1.05f);
+
+    /// optimizeMesh() on meshes[0..numMeshes), concurrently on numThreads
+    /// threads (0 = one per processor). reports may be NULL.
+    void optimizeMeshes(PfbIndexedMesh *meshes, uint32_t numMeshes,
+            PfbOptimizeReport *reports = NULL, float overdrawThreshold = 1.05f,
+            unsigned numThreads = 0);
+}
+
+#endif
@@ -0,0 +1,717 @@
+#include "OpenPfbScene.h"
+#include "OpenPfbThreads.h"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+namespace openpfb
+{
+
+//
+// MATRICES /* {{{ */
+//
+
+static const float identity[16] = { 1,0,0,0, 0,1,0,0, 0,0,1,0, 0,0,0,1 };
+
+void multMatrix(float *r, const float *a, const float *b)
+{
+    float t[16];
+    for (unsigned i=0; i<4; ++i)
+        for (unsigned j=0; j<4; ++j)
+            t[4*i+j] = a[4*i]*b[j] + a[4*i+1]*b[4+j] + a[4*i+2]*b[8+j] + a[4*i+3]*b[12+j];
+    memcpy(r, t, sizeof(t));
+}
+
+void transformPoints(float *dst, const float *src, uint32_t count, const float *m)
+{
+    uint32_t i = 0;
+#ifdef __SSE2__
+    // One vertex per iteration: x*row0 + y*row1 + z*row2 + row3. Only the
+    // 3 components are stored, the next vertex of src may be in dst.
+    __m128 r0 = _mm_loadu_ps(m),     r1 = _mm_loadu_ps(m + 4);
+    __m128 r2 = _mm_loadu_ps(m + 8), r3 = _mm_loadu_ps(m + 12);
+    for (; i < count; ++i) {
+        const float *p = src + 3*i;
+        __m128 v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(p[0]), r0), _mm_mul_ps(_mm_set1_ps(p[1]), r1)),
+                              _mm_add_ps(_mm_mul_ps(_mm_set1_ps(p[2]), r2), r3));
+        _mm_storel_pi((__m64*)(dst + 3*i), v);
+        _mm_store_ss(dst + 3*i + 2, _mm_movehl_ps(v, v));
+    }
+#endif
+    for (; i < count; ++i) {
+        const float *p = src + 3*i;
+        float x = p[0], y = p[1], z = p[2];
+        dst[3*i]   = x*m[0] + y*m[4] + z*m[8]  + m[12];
+        dst[3*i+1] = x*m[1] + y*m[5] + z*m[9]  + m[13];
+        dst[3*i+2] = x*m[2] + y*m[6] + z*m[10] + m[14];
+    }
+}
+
+void transformNormals(float *dst, const float *src, uint32_t count, const float *m)
+{
+    // Inverse transpose of the 3x3 part, up to a positive factor: the
+    // cofactors, sign of the determinant applied
+    float n[16] = { 0 };
+    n[0] = m[5]*m[10] - m[6]*m[9];  n[1] = m[6]*m[8] - m[4]*m[10]; n[2]  = m[4]*m[9] - m[5]*m[8];
+    n[4] = m[2]*m[9]  - m[1]*m[10]; n[5] = m[0]*m[10] - m[2]*m[8]; n[6]  = m[1]*m[8] - m[0]*m[9];
+    n[8] = m[1]*m[6]  - m[2]*m[5];  n[9] = m[2]*m[4] - m[0]*m[6];  n[10] = m[0]*m[5] - m[1]*m[4];
+    float det = m[0]*n[0] + m[1]*n[1] + m[2]*n[2];
+    if (det == 0)
+        for (unsigned i=0; i<3; ++i)
+            memcpy(n + 4*i, m + 4*i, 3 * sizeof(float));
+    else if (det < 0)
+        for (unsigned i=0; i<12; ++i)
+            n[i] = -n[i];
+    n[15] = 1;
+
+    transformPoints(dst, src, count, n);
+    for (uint32_t i=0; i<count; ++i) {
+        float *v = dst + 3*i;
+        float length = sqrtf(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]);
+        if (length > 0) {
+            v[0] /= length;
+            v[1] /= length;
+            v[2] /= length;
+        }
+    }
+}
+/* }}} */
+
+//
+// FLATTEN /* {{{ */
+//
+// The tree is walked first, deciding the nodes, geosets and lists of the
+// new tree (the plan). The new tree is then created from the plan, the
+// lists being copied and transformed concurrently.
+//
+
+#define PFBFLATTEN_IDENTITY (-1)
+
+struct PfbMatrix
+{
+    float m[16];
+    bool operator<(const PfbMatrix &o) const { return memcmp(m, o.m, sizeof(m)) < 0; }
+};
+
+struct PfbFlattenNode
+{
+    uint32_t         source;   // node of the source tree
+    uint32_t         type;
+    int              matrix;   // residual SCS: index in matrices
+    vector<uint32_t> children; // new node ids
+    vector<uint32_t> geosets;  // new geoset ids
+};
+
+struct PfbFlattenPlan
+{
+    PfbTree                      &tree;
+    PfbFlattenStats              &stats;
+    vector<PfbMatrix>             matrices;
+    map<PfbMatrix,int>            matrixIds;
+    vector<PfbFlattenNode>        nodes;
+    map<pair<uint32_t,int>, vector<uint32_t> > visited; // (node, matrix) -> new ids
+    vector<unsigned char>         active;               // node being walked (cycles)
+    vector<pair<uint32_t,int> >   geosets;              // (source geoset, matrix)
+    map<pair<uint32_t,int>, uint32_t> geosetIds;
+    vector<pair<int32_t,int> >    lists;                // (source list id, matrix)
+    map<pair<int32_t,int>, int32_t> listIds;
+
+    PfbFlattenPlan(PfbTree &tree, PfbFlattenStats &stats) :
+        tree(tree), stats(stats), active(tree.getNumNodes(), 0) {}
+
+    /// Index of matrix m, PFBFLATTEN_IDENTITY for the identity
+    int addMatrix(const float *m) {
+        if (memcmp(m, identity, sizeof(identity)) == 0) return PFBFLATTEN_IDENTITY;
+        PfbMatrix matrix;
+        memcpy(matrix.m, m, sizeof(matrix.m));
+        map<PfbMatrix,int>::iterator it = matrixIds.find(matrix);
+        if (it != matrixIds.end()) return it->second;
+        matrices.push_back(matrix);
+        return matrixIds[matrix] = matrices.size() - 1;
+    }
+    const float *getMatrix(int matrix) const {
+        return (matrix == PFBFLATTEN_IDENTITY) ? identity : matrices[matrix].m;
+    }
+
+    uint32_t addNode(uint32_t source, uint32_t type, int matrix = PFBFLATTEN_IDENTITY) {
+        PfbFlattenNode node;
+        node.source = source;
+        node.type   = type;
+        node.matrix = matrix;
+        nodes.push_back(node);
+        return nodes.size() - 1;
+    }
+
+    int32_t addList(int32_t source, int matrix) {
+        if (source < 0) return -1;
+        pair<int32_t,int> key(source, matrix);
+        map<pair<int32_t,int>, int32_t>::iterator it = listIds.find(key);
+        if (it != listIds.end()) return it->second;
+        lists.push_back(key);
+        return listIds[key] = lists.size() - 1;
+    }
+
+    uint32_t addGeoset(uint32_t source, int matrix) {
+        pair<uint32_t,int> key(source, matrix);
+        map<pair<uint32_t,int>, uint32_t>::iterator it = geosetIds.find(key);
+        if (it != geosetIds.end()) return it->second;
+        if (matrix != PFBFLATTEN_IDENTITY) stats.transformedGeosets++;
+        geosets.push_back(key);
+        return geosetIds[key] = geosets.size() - 1;
+    }
+
+    void walkChildren(const PfbChilds &childs, int matrix, vector<uint32_t> &out, bool keepSlots = false) {
+        for (uint32_t i=0; i<childs.getNumChildren(); ++i) {
+            vector<uint32_t> ids = walk(childs.getChild(i), matrix, keepSlots);
+            out.insert(out.end(), ids.begin(), ids.end());
+        }
+    }
+
+    /// New nodes replacing node under the combined transform matrix.
+    /// keepSlot: node must be replaced by a single node (the root, the
+    /// children of a LOD, whose ranges follow the children).
+    vector<uint32_t> walk(uint32_t nodeId, int matrix, bool keepSlot) {
+        vector<uint32_t> ids;
+        if (nodeId >= tree.getNumNodes() || active[nodeId]) return ids;
+
+        pair<uint32_t,int> key(nodeId, matrix);
+        map<pair<uint32_t,int>, vector<uint32_t> >::iterator it = visited.find(key);
+        if (it != visited.end()) return it->second;
+
+        // Reached before with another transform: this is a copy
+        it = visited.lower_bound(pair<uint32_t,int>(nodeId, PFBFLATTEN_IDENTITY));
+        bool seen = (it != visited.end() && it->first.first == nodeId);
+
+        active[nodeId] = 1;
+        PfbNode &node = tree.getNode(nodeId);
+        uint32_t type = node.getType();
+
+        if (PfbNodeSCS *scs = node.asSCS()) {
+            float combined[16];
+            multMatrix(combined, scs->getMatrix(), getMatrix(matrix));
+            int childMatrix = addMatrix(combined);
+            stats.removedTransforms++;
+            if (keepSlot || scs->getChilds().getNumChildren() != 1) {
+                // The node stays, as a group
+                uint32_t id = addNode(nodeId, 5);
+                ids.push_back(id);
+                vector<uint32_t> children;
+                walkChildren(scs->getChilds(), childMatrix, children);
+                nodes[id].children = children;
+            }
+            else {
+                walkChildren(scs->getChilds(), childMatrix, ids);
+            }
+        }
+        else if (type == 7 || type == 11) {
+            // Transform kept above, flattening restarts below
+            uint32_t id;
+            if (matrix != PFBFLATTEN_IDENTITY) {
+                uint32_t wrapper = addNode(nodeId, 6, matrix);
+                ids.push_back(wrapper);
+                stats.residualTransforms++;
+                id = addNode(nodeId, type);
+                nodes[wrapper].children.push_back(id);
+            }
+            else {
+                id = addNode(nodeId, type);
+                ids.push_back(id);
+            }
+            vector<uint32_t> children;
+            if (type == 7)
+                walkChildren(node.asDCS()->getChilds(), PFBFLATTEN_IDENTITY, children);
+            else
+                walkChildren(node.asLOD()->getChilds(), PFBFLATTEN_IDENTITY, children, true);
+            nodes[id].children = children;
+        }
+        else {
+            uint32_t id = addNode(nodeId, type);
+            ids.push_back(id);
+            if (PfbNodeGroup *group = node.asGroup()) {
+                vector<uint32_t> children;
+                walkChildren(group->getChilds(), matrix, children);
+                nodes[id].children = children;
+            }
+            else if (PfbNodeGeode *geode = node.asGeode()) {
+                for (uint32_t i=0; i<geode->getNumGeosets(); ++i) {
+                    uint32_t geoset = geode->getGeosets()[i];
+                    if (geoset < tree.getNumGeosets())
+                        nodes[id].geosets.push_back(addGeoset(geoset, matrix));
+                }
+            }
+        }
+
+        if (seen) stats.duplicatedNodes += ids.size();
+        active[nodeId] = 0;
+        visited[key] = ids;
+        return ids;
+    }
+};
+
+/// Copy (and transform) the lists of one new list id
+struct PfbFlattenListTask : public PfbTask
+{
+    PfbTree                          &source;
+    PfbTree                          &tree;
+    const PfbFlattenPlan             &plan;
+
+    PfbFlattenListTask(PfbTree &source, PfbTree &tree, const PfbFlattenPlan &plan) :
+        source(source), tree(tree), plan(plan) {}
+
+    template <typename T, unsigned N>
+    static void copy(PfbList<T,N> &dst, PfbList<T,N> &src) {
+        if (src.getSize()) memcpy(dst.get(0), src.get(0), src.getSize() * N * sizeof(T));
+    }
+
+    void run(unsigned i) {
+        uint32_t     id     = plan.lists[i].first;
+        int          matrix = plan.lists[i].second;
+        const float *m      = plan.getMatrix(matrix);
+
+        if (tree.haveLengthList() && id < source.getNumLengthList())
+            copy(tree.getLengthList(i), source.getLengthList(id));
+        if (tree.haveColorList() && id < source.getNumColorList())
+            copy(tree.getColorList(i), source.getColorList(id));
+        if (tree.haveTexcoordList() && id < source.getNumTexcoordList())
+            copy(tree.getTexcoordList(i), source.getTexcoordList(id));
+
+        if (tree.haveVertexList() && id < source.getNumVertexList()) {
+            PfbVertexList &src = source.getVertexList(id), &dst = tree.getVertexList(i);
+            if (src.getSize() == 0) {}
+            else if (matrix == PFBFLATTEN_IDENTITY) copy(dst, src);
+            else transformPoints(dst.get(0), src.get(0), src.getSize(), m);
+        }
+        if (tree.haveNormalList() && id < source.getNumNormalList()) {
+            PfbNormalList &src = source.getNormalList(id), &dst = tree.getNormalList(i);
+            if (src.getSize() == 0) {}
+            else if (matrix == PFBFLATTEN_IDENTITY) copy(dst, src);
+            else transformNormals(dst.get(0), src.get(0), src.getSize(), m);
+        }
+    }
+};
+
+template <typename T, unsigned N>
+static void allocateStorage(PfbList<T,N> &list, PfbArena &arena, unsigned size)
+{
+    list.attach(size ? arena.allocate<T>((size_t)size * N) : NULL, size);
+}
+
+/// Storage for list id of the new tree, in its arena, of the size of the
+/// source list
+template <typename L>
+static void allocateList(PfbTree &tree, L &dst, PfbTree &source,
+        L &(PfbTree::*getList)(unsigned), unsigned numSource, int32_t id)
+{
+    unsigned size = ((unsigned)id < numSource) ? (source.*getList)(id).getSize() : 0;
+    allocateStorage(dst, tree.getArena(), size);
+}
+
+auto_ptr<PfbTree> flattenTree(PfbTree &source, PfbFlattenStats *stats)
+{
+    PfbFlattenStats localStats;
+    if (!stats) stats = &localStats;
+    memset(stats, 0, sizeof(*stats));
+
+    PfbFlattenPlan plan(source, *stats);
+    if (source.getNumNodes()) plan.walk(0, PFBFLATTEN_IDENTITY, true);
+
+    // Geosets, and the lists they use
+    vector<int32_t> geosetLists(plan.geosets.size());
+    for (unsigned g=0; g<plan.geosets.size(); ++g)
+        geosetLists[g] = plan.addList(source.getGeoSet(plan.geosets[g].first).lengthListId, plan.geosets[g].second);
+
+    auto_ptr<PfbTree> tree(new PfbTree());
+    PfbArena &arena = tree->getArena();
+
+    if (source.haveMaterials()) {
+        tree->createMaterials(source.getNumMaterials());
+        if (source.getNumMaterials())
+            memcpy(&tree->getMaterial(0), &source.getMaterial(0), source.getNumMaterials() * sizeof(PfbMaterial));
+    }
+    if (source.haveTextures()) {
+        tree->createTextures(source.getNumTextures());
+        for (unsigned i=0; i<source.getNumTextures(); ++i) {
+            PfbTexture &texture = tree->getTexture(i);
+            texture = source.getTexture(i);
+            if (texture.fileName) {
+                const char *fileName = texture.fileName;
+                texture.fileName = arena.allocate<char>(strlen(fileName) + 1);
+                strcpy(texture.fileName, fileName);
+            }
+        }
+    }
+    if (source.getNumGeoStates()) {
+        tree->createGeoStates(source.getNumGeoStates());
+        for (unsigned i=0; i<source.getNumGeoStates(); ++i) {
+            PfbGeoState &src = source.getGeoState(i), &dst = tree->getGeoState(i);
+            dst.setNumValues(src.getNumValues(), &arena);
+            for (int32_t v=1; v<=src.getNumValues(); ++v)
+                dst.setValue(v, src.getValue(v));
+        }
+    }
+
+    if (!plan.geosets.empty()) {
+        tree->createGeoSets(plan.geosets.size());
+        for (unsigned g=0; g<plan.geosets.size(); ++g) {
+            PfbGeoSet &geoset = tree->getGeoSet(g);
+            geoset = source.getGeoSet(plan.geosets[g].first);
+            geoset.lengthListId = geosetLists[g];
+        }
+    }
+
+    // Lists: storage first (the arena is not thread-safe), then content
+    unsigned numLists = plan.lists.size();
+    if (source.haveLengthList())   tree->createLengthLists(numLists);
+    if (source.haveVertexList())   tree->createVertexLists(numLists);
+    if (source.haveColorList())    tree->createColorLists(numLists);
+    if (source.haveNormalList())   tree->createNormalLists(numLists);
+    if (source.haveTexcoordList()) tree->createTexcoordLists(numLists);
+    for (unsigned i=0; i<numLists; ++i) {
+        int32_t id = plan.lists[i].first;
+        if (source.haveLengthList())
+            allocateList(*tree, tree->getLengthList(i), source, &PfbTree::getLengthList, source.getNumLengthList(), id);
+        if (source.haveVertexList()) {
+            allocateList(*tree, tree->getVertexList(i), source, &PfbTree::getVertexList, source.getNumVertexList(), id);
+            if (plan.lists[i].second != PFBFLATTEN_IDENTITY)
+                stats->transformedVertices += tree->getVertexList(i).getSize();
+        }
+        if (source.haveColorList())
+            allocateList(*tree, tree->getColorList(i), source, &PfbTree::getColorList, source.getNumColorList(), id);
+        if (source.haveNormalList())
+            allocateList(*tree, tree->getNormalList(i), source, &PfbTree::getNormalList, source.getNumNormalList(), id);
+        if (source.haveTexcoordList())
+            allocateList(*tree, tree->getTexcoordList(i), source, &PfbTree::getTexcoordList, source.getNumTexcoordList(), id);
+    }
+    PfbFlattenListTask task(source, *tree, plan);
+    parallelFor(task, numLists);
+
+    // Nodes
+    if (!plan.nodes.empty()) tree->createNodes(plan.nodes.size());
+    for (unsigned n=0; n<plan.nodes.size(); ++n) {
+        const PfbFlattenNode &flat = plan.nodes[n];
+        PfbNode &src = source.getNode(flat.source);
+        PfbNode &dst = tree->getNode(n);
+        dst.setType(flat.type, &arena);
+        // A residual SCS has no name of its own
+        const char *name = (flat.type == 6 || !src.getName()) ? "" : src.getName();
+        dst.setName(name, strlen(name), &arena);
+
+        PfbChilds *childs = NULL;
+        switch (flat.type) {
+            case 2: {
+                PfbNodeGeode *geode = dst.asGeode();
+                geode->setNumGeosets(flat.geosets.size(), &arena);
+                if (!flat.geosets.empty())
+                    memcpy(geode->getGeosets(), &flat.geosets[0], flat.geosets.size() * sizeof(uint32_t));
+                break;
+            }
+            case 5:
+                childs = &dst.asGroup()->getChilds();
+                break;
+            case 6:
+                memcpy(dst.asSCS()->getMatrix(), plan.getMatrix(flat.matrix), 16 * sizeof(float));
+                childs = &dst.asSCS()->getChilds();
+                break;
+            case 7:
+                memcpy(dst.asDCS()->getMatrix(), src.asDCS()->getMatrix(), 16 * sizeof(float));
+                childs = &dst.asDCS()->getChilds();
+                break;
+            case 11: {
+                PfbNodeLOD *lod = dst.asLOD(), *srcLod = src.asLOD();
+                lod->setNumRanges(srcLod->getNumRanges(), &arena);
+                memcpy(lod->getRanges(0), srcLod->getRanges(0), (srcLod->getNumRanges() + 1) * sizeof(float));
+                memcpy(lod->getCenter(), srcLod->getCenter(), 3 * sizeof(float));
+                childs = &lod->getChilds();
+                break;
+            }
+        }
+        if (childs) {
+            childs->setNumChildren(flat.children.size(), &arena);
+            for (unsigned c=0; c<flat.children.size(); ++c)
+                childs->childs[c] = flat.children[c];
+        }
+    }
+    tree->buildNodeTable();
+    if (source.haveBounds()) tree->computeBounds();
+    return tree;
+}
+/* }}} */
+
+//
+// BATCHING /* {{{ */
+//
+// The tree is walked for the geosets of every geode instance and their
+// transform context. Each distinct geoset is converted once (concurrently),
+// then the instances are appended to the buffers batch by batch.
+//
+
+PfbBatchOptions::PfbBatchOptions() :
+    layout(PfbVertexLayout::packed(PFBATTRIB_BIT(PFBATTRIB_POSITION) | PFBATTRIB_BIT(PFBATTRIB_NORMAL) |
+                PFBATTRIB_BIT(PFBATTRIB_TEXCOORD) | PFBATTRIB_BIT(PFBATTRIB_COLOR))),
+    epsilon(0), optimize(true), maxBufferVertices(0x10000)
+{
+}
+
+struct PfbBatchInstance
+{
+    uint32_t node;
+    uint32_t geoset;
+    uint32_t context;
+};
+
+struct PfbBatchWalker
+{
+    PfbTree                         &tree;
+    vector<PfbDrawContext>          &contexts;
+    map<pair<pair<uint32_t,int32_t>,PfbMatrix>, uint32_t> contextIds;
+    vector<PfbBatchInstance>         instances;
+    vector<unsigned char>            active; // node being walked (cycles)
+
+    PfbBatchWalker(PfbTree &tree, vector<PfbDrawContext> &contexts) :
+        tree(tree), contexts(contexts), active(tree.getNumNodes(), 0) {}
+
+    uint32_t addContext(uint32_t anchorNode, int32_t anchorChild, const float *m) {
+        pair<pair<uint32_t,int32_t>,PfbMatrix> key;
+        key.first = pair<uint32_t,int32_t>(anchorNode, anchorChild);
+        memcpy(key.second.m, m, sizeof(key.second.m));
+        map<pair<pair<uint32_t,int32_t>,PfbMatrix>, uint32_t>::iterator it = contextIds.find(key);
+        if (it != contextIds.end()) return it->second;
+        PfbDrawContext context;
+        context.anchorNode  = anchorNode;
+        context.anchorChild = anchorChild;
+        memcpy(context.matrix, m, sizeof(context.matrix));
+        contexts.push_back(context);
+        return contextIds[key] = contexts.size() - 1;
+    }
+
+    void walkChildren(const PfbChilds &childs, uint32_t anchorNode, int32_t anchorChild, const float *m) {
+        for (uint32_t i=0; i<childs.getNumChildren(); ++i)
+            walk(childs.getChild(i), anchorNode, anchorChild, m);
+    }
+
+    void walk(uint32_t nodeId, uint32_t anchorNode, int32_t anchorChild, const float *m) {
+        if (nodeId >= tree.getNumNodes() || active[nodeId]) return;
+        active[nodeId] = 1;
+        PfbNode &node = tree.getNode(nodeId);
+
+        if (PfbNodeSCS *scs = node.asSCS()) {
+            float combined[16];
+            multMatrix(combined, scs->getMatrix(), m);
+            walkChildren(scs->getChilds(), anchorNode, anchorChild, combined);
+        }
+        else if (PfbNodeDCS *dcs = node.asDCS()) {
+            walkChildren(dcs->getChilds(), nodeId, -1, identity);
+        }
+        else if (PfbNodeLOD *lod = node.asLOD()) {
+            const PfbChilds &childs = lod->getChilds();
+            for (uint32_t i=0; i<childs.getNumChildren(); ++i)
+                walk(childs.getChild(i), nodeId, i, identity);
+        }
+        else if (PfbNodeGroup *group = node.asGroup()) {
+            walkChildren(group->getChilds(), anchorNode, anchorChild, m);
+        }
+        else if (PfbNodeGeode *geode = node.asGeode()) {
+            uint32_t context = addContext(anchorNode, anchorChild, m);
+            for (uint32_t i=0; i<geode->getNumGeosets(); ++i) {
+                PfbBatchInstance instance;
+                instance.node    = nodeId;
+                instance.geoset  = geode->getGeosets()[i];
+                instance.context = context;
+                if (instance.geoset < tree.getNumGeosets())
+                    instances.push_back(instance);
+            }
+        }
+        active[nodeId] = 0;
+    }
+};
+
+/// State of each geostate: the first geostate with the same values
+static vector<int32_t> getStates(PfbTree &tree)
+{
+    vector<int32_t> states(tree.getNumGeoStates());
+    map<vector<int32_t>, int32_t> firsts;
+    for (unsigned i=0; i<tree.getNumGeoStates(); ++i) {
+        PfbGeoState &geostate = tree.getGeoState(i);
+        vector<int32_t> values(geostate.getNumValues());
+        for (int32_t v=0; v<geostate.getNumValues(); ++v)
+            values[v] = geostate.getValue(v + 1);
+        map<vector<int32_t>, int32_t>::iterator it = firsts.find(values);
+        states[i] = (it != firsts.end()) ? it->second : (firsts[values] = i);
+    }
+    return states;
+}
+
+void PfbDrawList::build(PfbTree &tree, const PfbBatchOptions &options, unsigned numThreads)
+{
+    layout = options.layout;
+    items.clear();
+    buffers.clear();
+    contexts.clear();
+    sources.clear();
+    if (tree.getNumNodes() == 0) return;
+
+    PfbBatchWalker walker(tree, contexts);
+    walker.walk(0, 0, -1, identity);
+
+    // Batches: (state, context) -> instances, in walk order
+    vector<int32_t> states = getStates(tree);
+    map<pair<int32_t,uint32_t>, vector<uint32_t> > batches;
+    vector<uint32_t> geosets;
+    vector<int32_t>  meshIds(tree.getNumGeosets(), -1);
+    for (uint32_t i=0; i<walker.instances.size(); ++i) {
+        const PfbBatchInstance &instance = walker.instances[i];
+        int32_t geostateId = tree.getGeoSet(instance.geoset).geostateId;
+        int32_t state = (geostateId >= 0 && (uint32_t)geostateId < states.size()) ? states[geostateId] : -1;
+        batches[pair<int32_t,uint32_t>(state, instance.context)].push_back(i);
+        if (meshIds[instance.geoset] < 0) {
+            meshIds[instance.geoset] = geosets.size();
+            geosets.push_back(instance.geoset);
+        }
+    }
+
+    vector<PfbIndexedMesh> meshes(geosets.size());
+    if (meshes.empty()) return;
+    buildIndexedMeshes(tree, &geosets[0], geosets.size(), layout, options.epsilon, &meshes[0], numThreads);
+    if (options.optimize)
+        optimizeMeshes(&meshes[0], meshes.size(), NULL, 1.05f, numThreads);
+
+    // A batch continues in a new item when its buffer is full
+    for (map<pair<int32_t,uint32_t>, vector<uint32_t> >::iterator it = batches.begin(); it != batches.end(); ++it) {
+        bool newItem = true;
+        for (unsigned i=0; i<it->second.size(); ++i) {
+            const PfbBatchInstance &instance = walker.instances[it->second[i]];
+            const PfbIndexedMesh &mesh = meshes[meshIds[instance.geoset]];
+            if (mesh.getNumIndices() == 0) continue;
+
+            if (buffers.empty() || (buffers.back().numVertices &&
+                        buffers.back().numVertices + mesh.getNumVertices() > options.maxBufferVertices)) {
+                buffers.push_back(PfbDrawBuffer());
+                newItem = true;
+            }
+            PfbDrawBuffer &buffer = buffers.back();
+            if (newItem) {
+                PfbDrawItem item;
+                item.buffer      = buffers.size() - 1;
+                item.firstIndex  = buffer.indices.size();
+                item.numIndices  = 0;
+                item.geostateId  = it->first.first;
+                item.context     = it->first.second;
+                item.firstSource = sources.size();
+                item.numSources  = 0;
+                items.push_back(item);
+                newItem = false;
+            }
+
+            PfbDrawSource source;
+            source.node       = instance.node;
+            source.geoset     = instance.geoset;
+            source.firstIndex = buffer.indices.size();
+            source.numIndices = mesh.getNumIndices();
+            sources.push_back(source);
+
+            uint32_t base = buffer.numVertices;
+            buffer.vertices.insert(buffer.vertices.end(), mesh.getVertices(),
+                    mesh.getVertices() + (size_t)mesh.getNumVertices() * layout.stride);
+            buffer.numVertices += mesh.getNumVertices();
+            buffer.indices.reserve(buffer.indices.size() + mesh.getNumIndices());
+            for (uint32_t n=0; n<mesh.getNumIndices(); ++n)
+                buffer.indices.push_back(base + mesh.getIndex(n));
+
+            items.back().numIndices += mesh.getNumIndices();
+            items.back().numSources++;
+        }
+    }
+}
+
+static bool sourceBefore(uint32_t index, const PfbDrawSource &source)
+{
+    return index < source.firstIndex;
+}
+
+const PfbDrawSource *PfbDrawList::findSource(uint32_t item, uint32_t triangle) const
+{
+    if (item >= items.size()) return NULL;
+    const PfbDrawItem &drawItem = items[item];
+    if (triangle >= drawItem.numIndices / 3) return NULL;
+
+    uint32_t index = drawItem.firstIndex + triangle * 3;
+    const PfbDrawSource *first = &sources[drawItem.firstSource];
+    const PfbDrawSource *last  = first + drawItem.numSources;
+    return upper_bound(first, last, index, sourceBefore) - 1;
+}
+/* }}} */
+
+//
+// TRAVERSAL /* {{{ */
+//
+
+void PfbTraversal::build(PfbTree &tree)
+{
+    if (tree.getNodeTable().getNumNodes() != tree.getNumNodes())
+        tree.buildNodeTable();
+    table = &tree.getNodeTable();
+    nodes.clear();
+    parents.clear();
+    depths.clear();
+    subtreeEnds.clear();
+    matrices.clear();
+    geodes.clear();
+
+    vector<unsigned char> active(table->getNumNodes(), 0);
+    if (table->getNumNodes()) walk(0, -1, active);
+}
+
+void PfbTraversal::setMatrix(uint32_t entry, const float *local)
+{
+    float *m = &matrices[16 * entry];
+    const float *parent = (parents[entry] < 0) ? identity : &matrices[16 * parents[entry]];
+    if (local)
+        multMatrix(m, local, parent);
+    else
+        memcpy(m, parent, 16 * sizeof(float));
+}
+
+void PfbTraversal::walk(uint32_t node, int32_t parent, vector<unsigned char> &active)
+{
+    if (node >= table->getNumNodes() || active[node]) return;
+    active[node] = 1;
+
+    PfbNodeHandle handle = table->getNode(node);
+    uint32_t entry = nodes.size();
+    nodes.push_back(node);
+    parents.push_back(parent);
+    depths.push_back(parent < 0 ? 0 : depths[parent] + 1);
+    subtreeEnds.push_back(0);
+    matrices.resize(matrices.size() + 16);
+    setMatrix(entry, (handle.isSCS() || handle.isDCS()) ? handle.getMatrix() : NULL);
+    if (handle.isGeode()) geodes.push_back(entry);
+
+    for (uint32_t i=0; i<handle.getNumChildren(); ++i)
+        walk(handle.getChildren()[i], entry, active);
+
+    subtreeEnds[entry] = nodes.size();
+    active[node] = 0;
+}
+
+void PfbTraversal::updateMatrices(PfbTree &tree)
+{
+    // Parents come first
+    for (uint32_t i=0; i<nodes.size(); ++i) {
+        PfbNode &node = tree.getNode(nodes[i]);
+        if (node.asSCS())
+            setMatrix(i, node.asSCS()->getMatrix());
+        else if (node.asDCS())
+            setMatrix(i, node.asDCS()->getMatrix());
+        else
+            setMatrix(i, NULL);
+    }
+}
+/* }}} */
+}
@@ -0,0 +1,217 @@
+#ifndef _OPENPFB_SCENE_H
+#define _OPENPFB_SCENE_H
+
+#include "OpenPfb.h"
+#include "OpenPfbMesh.h"
+
+namespace openpfb
+{
+    /// @struct PfbFlattenStats
+    ///
+    /// @brief What flattenTree() did
+    struct PfbFlattenStats
+    {
+        uint32_t removedTransforms;   // SCS nodes baked into the geometry
+        uint32_t residualTransforms;  // SCS nodes kept above DCS/LOD nodes
+        uint32_t duplicatedNodes;     // shared nodes copied for another transform
+        uint32_t transformedGeosets;  // geosets with baked positions/normals
+        uint32_t transformedVertices;
+    };
+
+    /// Build a copy of tree without its static transforms: the SCS
+    /// matrices met from the root down are combined and applied to the
+    /// positions and normals of the geodes below them, and the SCS nodes
+    /// are removed. An SCS stays as a group when it is the root, a child
+    /// of a LOD (so that the children still match the ranges) or when it
+    /// has several children (or none).
+    ///
+    /// Flattening does not cross DCS and LOD nodes: the transform combined
+    /// above one is kept as a single SCS node over it, and the flattening
+    /// restarts below it. Nodes, geosets and lists reached with several
+    /// transforms are duplicated, the ones reached with the same
+    /// transform stay shared. Lists no geoset uses are dropped.
+    ///
+    /// Matrices use the Performer convention: row vectors (v' = v * M),
+    /// translation in matrix[12..14]. The new tree does not depend on the
+    /// source tree.
+    std::auto_ptr<PfbTree> flattenTree(PfbTree &tree, PfbFlattenStats *stats = NULL);
+
+    /// Apply the 4x4 matrix m (row vectors) to count points src[3*i],
+    /// written to dst (which may be src)
+    void transformPoints(float *dst, const float *src, uint32_t count, const float *m);
+
+    /// Apply the inverse transpose of the 3x3 part of m to count normals,
+    /// renormalized, written to dst (which may be src)
+    void transformNormals(float *dst, const float *src, uint32_t count, const float *m);
+
+    /// r = a * b (4x4, row vectors: transforming by r is a then b)
+    void multMatrix(float *r, const float *a, const float *b);
+
+    /// @struct PfbBatchOptions
+    ///
+    /// @brief How PfbDrawList::build() converts and merges the geometry
+    struct PfbBatchOptions
+    {
+        PfbVertexLayout layout;      // vertex format of the buffers
+        float    epsilon;            // vertex welding, see PfbIndexedMesh
+        bool     optimize;           // optimizeMesh() every geoset first
+        uint32_t maxBufferVertices;  // a buffer is closed beyond this
+
+        /// Positions, normals, texcoords and colors; exact welding;
+        /// optimized; buffers of at most 65536 vertices (16-bit indices)
+        PfbBatchOptions();
+    };
+
+    /// @struct PfbDrawContext
+    ///
+    /// @brief Transform shared by the geometry of draw items: the static
+    /// matrix (combined SCS) below an anchor. The anchor is the root, a
+    /// DCS or one child of a LOD.
+    struct PfbDrawContext
+    {
+        uint32_t anchorNode;
+        int32_t  anchorChild;  // LOD child index, -1 otherwise
+        float    matrix[16];   // row vectors, relative to the anchor
+    };
+
+    /// @struct PfbDrawBuffer
+    ///
+    /// @brief Vertices and triangles shared by several draw items
+    struct PfbDrawBuffer
+    {
+        std::vector<char>     vertices;  // numVertices * layout.stride
+        uint32_t              numVertices;
+        std::vector<uint32_t> indices;   // < numVertices
+
+        PfbDrawBuffer() : numVertices(0) {}
+    };
+
+    /// @struct PfbDrawSource
+    ///
+    /// @brief Origin of a range of indices, for picking
+    struct PfbDrawSource
+    {
+        uint32_t node;        // geode of the source tree
+        uint32_t geoset;      // geoset of the source tree
+        uint32_t firstIndex;  // in the buffer indices
+        uint32_t numIndices;
+    };
+
+    /// @struct PfbDrawItem
+    ///
+    /// @brief One draw call: a range of the indices of a buffer, drawn
+    /// with one state and one transform
+    struct PfbDrawItem
+    {
+        uint32_t buffer;
+        uint32_t firstIndex;
+        uint32_t numIndices;
+        int32_t  geostateId;   // first of the geostates with the same values
+        uint32_t context;      // index in the contexts
+        uint32_t firstSource;  // sources of the item, ordered by firstIndex
+        uint32_t numSources;
+    };
+
+    /// @class PfbDrawList
+    ///
+    /// @brief Geometry of a tree merged into few draw calls
+    ///
+    /// The geosets of the geodes are grouped by transform context and by
+    /// state (geostates with the same values, so the same material,
+    /// texture, ... are one state), converted to indexed triangles and
+    /// appended to shared buffers. Items are sorted by state, then by
+    /// context. Flattening the tree first (flattenTree()) leaves fewer
+    /// contexts, so bigger batches.
+    class PfbDrawList
+    {
+        public:
+            void build(PfbTree &tree, const PfbBatchOptions &options = PfbBatchOptions(),
+                    unsigned numThreads = 0);
+
+            const PfbVertexLayout &getLayout() const { return layout; }
+
+            uint32_t getNumItems() const                   { return items.size(); }
+            const PfbDrawItem &getItem(uint32_t i) const   { return items[i]; }
+
+            uint32_t getNumBuffers() const                   { return buffers.size(); }
+            const PfbDrawBuffer &getBuffer(uint32_t i) const { return buffers[i]; }
+
+            uint32_t getNumContexts() const                     { return contexts.size(); }
+            const PfbDrawContext &getContext(uint32_t i) const  { return contexts[i]; }
+
+            const PfbDrawSource &getSource(uint32_t i) const { return sources[i]; }
+
+            /// Source of a triangle of an item (0 = the first triangle of
+            /// the item), NULL if out of range
+            const PfbDrawSource *findSource(uint32_t item, uint32_t triangle) const;
+
+        private:
+            PfbVertexLayout             layout;
+            std::vector<PfbDrawItem>    items;
+            std::vector<PfbDrawBuffer>  buffers;
+            std::vector<PfbDrawContext> contexts;
+            std::vector<PfbDrawSource>  sources;
+    };
+    /// @class PfbTraversal
+    ///
+    /// @brief Pre-order walk of a tree, computed once
+    ///
+    /// One entry per node reached from the root (a node reached through
+    /// several paths has several entries), parents before their
+    /// children. The subtree of entry i is [i, getSubtreeEnd(i)), so a
+    /// subtree is skipped by jumping to its end.
+    ///
+    /// The world matrix of an entry takes its content to the world: the
+    /// matrices of the SCS/DCS above it combined, its own included.
+    class PfbTraversal
+    {
+        public:
+            PfbTraversal() : table(NULL) {}
+
+            /// Walk the node table of tree (see PfbTree::getNodeTable()),
+            /// which is built first if the tree has none
+            void build(PfbTree &tree);
+
+            /// Recompute the world matrices from the current SCS/DCS
+            /// matrices of tree (after DCS changes)
+            void updateMatrices(PfbTree &tree);
+
+            uint32_t getNumEntries() const { return nodes.size(); }
+
+            uint32_t     getNode(uint32_t i) const        { return nodes[i]; }
+            int32_t      getParent(uint32_t i) const      { return parents[i]; }  // -1 for the root
+            uint32_t     getDepth(uint32_t i) const       { return depths[i]; }
+            uint32_t     getSubtreeEnd(uint32_t i) const  { return subtreeEnds[i]; }
+            const float *getWorldMatrix(uint32_t i) const { return &matrices[16 * i]; }
+
+            /// Entries of the geodes
+            uint32_t getNumGeodes() const           { return geodes.size(); }
+            uint32_t getGeodeEntry(uint32_t i) const { return geodes[i]; }
+
+            /// Call f(nodeId, worldMatrix, geosets, numGeosets) for every
+            /// geode entry, in order. Returns f, as std::for_each.
+            template <typename F>
+            F forEachGeode(F f) const {
+                for (uint32_t i=0; i<geodes.size(); ++i) {
+                    uint32_t entry = geodes[i];
+                    f(nodes[entry], getWorldMatrix(entry),
+                            table->getGeosets(nodes[entry]), table->getNumGeosets(nodes[entry]));
+                }
+                return f;
+            }
+
+        private:
+            const PfbNodeTable   *table;
+            std::vector<uint32_t> nodes;
+            std::vector<int32_t>  parents;
+            std::vector<uint32_t> depths;
+            std::vector<uint32_t> subtreeEnds;
+            std::vector<float>    matrices;  // 16 per entry
+            std::vector<uint32_t> geodes;
+
+            void walk(uint32_t node, int32_t parent, std::vector<unsigned char> &active);
+            void setMatrix(uint32_t entry, const float *local);
+    };
+}
+
+#endif
@@ -0,0 +1,62 @@
+#include "OpenPfbThreads.h"
+#include "OpenPfbTrace.h"
+
+#include <pthread.h>
+#include <unistd.h>
+#include <vector>
+
+namespace openpfb
+{
+
+unsigned getNumProcessors()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (unsigned)n : 1;
+}
+
+struct PfbWorkQueue
+{
+    PfbTask           *task;
+    unsigned           count;
+    volatile unsigned  next;
+};
+
+static void *workerMain(void *arg)
+{
+    PfbWorkQueue *queue = (PfbWorkQueue*)arg;
+    PfbTraceEvent event("worker", "openpfb.thread");
+    unsigned      done = 0;
+    while (true) {
+        unsigned i = __sync_fetch_and_add(&queue->next, 1);
+        if (i >= queue->count) break;
+        queue->task->run(i);
+        done++;
+    }
+    event.addArg("items", done);
+    return NULL;
+}
+
+void parallelFor(PfbTask &task, unsigned count, unsigned numThreads)
+{
+    if (numThreads == 0) numThreads = getNumProcessors();
+    if (numThreads > count) numThreads = count;
+
+    PfbWorkQueue queue;
+    queue.task  = &task;
+    queue.count = count;
+    queue.next  = 0;
+
+    std::vector<pthread_t> threads;
+    for (unsigned t=1; t<numThreads; ++t) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, workerMain, &queue) != 0)
+            break; // the remaining threads will do the work
+        threads.push_back(thread);
+    }
+
+    workerMain(&queue);
+
+    for (unsigned t=0; t<threads.size(); ++t)
+        pthread_join(threads[t], NULL);
+}
+}
@@ -0,0 +1,28 @@
+#ifndef _OPENPFB_THREADS_H
+#define _OPENPFB_THREADS_H
+
+namespace openpfb
+{
+    /// @class PfbTask
+    ///
+    /// @brief Work split in independent items, see parallelFor()
+    class PfbTask
+    {
+        public:
+            virtual ~PfbTask() {}
+
+            /// Process item i. Called concurrently for different items.
+            virtual void run(unsigned i) = 0;
+    };
+
+    /// Return the number of online processors (at least 1)
+    unsigned getNumProcessors();
+
+    /// Run task.run(i) for every i in [0,count) using up to numThreads
+    /// threads (0 = one per processor). Items are handed out one by one,
+    /// the calling thread takes part in the work. Returns when all items
+    /// are done.
+    void parallelFor(PfbTask &task, unsigned count, unsigned numThreads = 0);
+}
+
+#endif
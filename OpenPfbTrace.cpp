@@ -0,0 +1,125 @@
+#include "OpenPfbTrace.h"
+
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <time.h>
+#include <cstdio>
+
+namespace openpfb
+{
+
+//
+// TRACE FILE /* {{{ */
+//
+// Events are appended to the file as they end, under a lock. The file is
+// a JSON array of complete ("X") events, timestamps in microseconds since
+// startTrace().
+//
+
+static pthread_mutex_t traceLock  = PTHREAD_MUTEX_INITIALIZER;
+static FILE * volatile traceFile  = NULL;
+static double          traceStart = 0;
+static bool            traceFirst = true;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+bool startTrace(const char *fileName)
+{
+    pthread_mutex_lock(&traceLock);
+    bool started = false;
+    if (!traceFile) {
+        FILE *file = fopen(fileName, "w");
+        if (file) {
+            fprintf(file, "{\"traceEvents\":[\n");
+            traceStart = now();
+            traceFirst = true;
+            traceFile  = file;
+            started    = true;
+        }
+    }
+    pthread_mutex_unlock(&traceLock);
+    return started;
+}
+
+void stopTrace()
+{
+    pthread_mutex_lock(&traceLock);
+    if (traceFile) {
+        fprintf(traceFile, "\n],\"displayTimeUnit\":\"ms\"}\n");
+        fclose(traceFile);
+        traceFile = NULL;
+    }
+    pthread_mutex_unlock(&traceLock);
+}
+
+bool isTracing()
+{
+    return traceFile != NULL;
+}
+/* }}} */
+
+//
+// EVENTS /* {{{ */
+//
+
+PfbTraceEvent::PfbTraceEvent(const char *name, const char *category)
+    : active(traceFile != NULL), name(name), category(category), start(0), argsLength(0)
+{
+    if (active) start = now();
+}
+
+PfbTraceEvent::~PfbTraceEvent()
+{
+    if (!active) return;
+    double end = now();
+
+    pthread_mutex_lock(&traceLock);
+    if (traceFile) {
+        fprintf(traceFile, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                "\"pid\":%d,\"tid\":%ld,\"args\":{%.*s}}",
+                traceFirst ? "" : ",\n", name, category,
+                (start - traceStart) * 1e6, (end - start) * 1e6,
+                (int)getpid(), (long)syscall(SYS_gettid), (int)argsLength, args);
+        traceFirst = false;
+    }
+    pthread_mutex_unlock(&traceLock);
+}
+
+void PfbTraceEvent::addArg(const char *key, uint64_t value)
+{
+    if (!active) return;
+    int n = snprintf(args + argsLength, sizeof(args) - argsLength, "%s\"%s\":%llu",
+            argsLength ? "," : "", key, (unsigned long long)value);
+    if (n > 0 && argsLength + n < sizeof(args)) argsLength += n;
+}
+
+void PfbTraceEvent::addArg(const char *key, const char *value)
+{
+    if (!active) return;
+
+    // Escaped into a copy first: an argument that does not fit is dropped
+    char   escaped[PFBTRACE_ARGS_SIZE];
+    size_t length = 0;
+    for (const char *c = value; *c && length + 7 < sizeof(escaped); ++c) {
+        if (*c == '"' || *c == '\\') {
+            escaped[length++] = '\\';
+            escaped[length++] = *c;
+        }
+        else if ((unsigned char)*c < 0x20)
+            length += sprintf(escaped + length, "\\u%04x", (unsigned char)*c);
+        else
+            escaped[length++] = *c;
+    }
+
+    int n = snprintf(args + argsLength, sizeof(args) - argsLength, "%s\"%s\":\"%.*s\"",
+            argsLength ? "," : "", key, (int)length, escaped);
+    if (n > 0 && argsLength + n < sizeof(args)) argsLength += n;
+}
+/* }}} */
+}
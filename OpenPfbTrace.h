@@ -0,0 +1,55 @@
+#ifndef _OPENPFB_TRACE_H
+#define _OPENPFB_TRACE_H
+
+#include <stdint.h>
+#include <cstddef>
+
+/// Size of the arguments of one event, the ones that do not fit are dropped
+#define PFBTRACE_ARGS_SIZE 512
+
+namespace openpfb
+{
+    /// Write the trace events of the loads (all the PfbFile of the
+    /// process, on all threads) to fileName, as Chrome trace-event JSON
+    /// (chrome://tracing, ui.perfetto.dev), until stopTrace(). Returns
+    /// false if the file can't be created or a trace is already running.
+    bool startTrace(const char *fileName);
+
+    /// Finish and close the trace file
+    void stopTrace();
+
+    bool isTracing();
+
+    /// @class PfbTraceEvent
+    ///
+    /// @brief Timed event of the trace, from its construction to its
+    /// destruction, on the calling thread
+    ///
+    /// Does nothing when no trace is running. The name and the category
+    /// must outlive the event (string literals).
+    class PfbTraceEvent
+    {
+        public:
+            PfbTraceEvent(const char *name, const char *category = "openpfb");
+            ~PfbTraceEvent();
+
+            /// True if the event is written, arguments are worth computing
+            bool isActive() const { return active; }
+
+            void addArg(const char *key, uint64_t value);
+            void addArg(const char *key, const char *value);
+
+        private:
+            bool        active;
+            const char *name;
+            const char *category;
+            double      start;
+            char        args[PFBTRACE_ARGS_SIZE];
+            size_t      argsLength;
+
+            PfbTraceEvent(const PfbTraceEvent &);
+            PfbTraceEvent &operator=(const PfbTraceEvent &);
+    };
+}
+
+#endif
@@ -0,0 +1,502 @@
+#include "OpenPfbWriter.h"
+#include "OpenPfbBswap.h"
+
+#include <algorithm>
+#include <map>
+#include <unistd.h>
+
+using namespace std;
+
+namespace openpfb
+{
+
+//
+// OUTPUT /* {{{ */
+//
+// Buffered file output. Words are swapped on the way when the file byte
+// order is not the one of the machine; block sizes are patched once the
+// block is written.
+//
+
+#define PFBWRITE_BUFFER (256*1024)
+
+class PfbOutput
+{
+    public:
+        PfbOutput(FILE *f, bool swap) :
+            f(f), swap(swap), used(0), pos(0), failed(false)
+        {
+            buffer  = new char[PFBWRITE_BUFFER];
+            swapped = new uint32_t[PFBWRITE_BUFFER / 4];
+        }
+        ~PfbOutput() {
+            delete[] buffer;
+            delete[] swapped;
+        }
+
+        void bytes(const void *data, size_t size) {
+            const char *src = (const char*)data;
+            while (size) {
+                if (used == PFBWRITE_BUFFER) flush();
+                size_t n = min(size, (size_t)PFBWRITE_BUFFER - used);
+                memcpy(buffer + used, src, n);
+                used += n;
+                pos  += n;
+                src  += n;
+                size -= n;
+            }
+        }
+
+        /// num 32-bit words (integers or floats)
+        void words(const void *data, size_t num) {
+            if (!swap) {
+                bytes(data, num * 4);
+                return;
+            }
+            const uint32_t *src = (const uint32_t*)data;
+            while (num) {
+                size_t n = min(num, (size_t)PFBWRITE_BUFFER / 4);
+                if (n >= 16) {
+                    bswap32Copy(swapped, src, n);
+                }
+                else {
+                    for (size_t i=0; i<n; ++i) {
+                        uint32_t w = src[i];
+                        swapped[i] = (w >> 24) | ((w >> 8) & 0xff00) | ((w << 8) & 0xff0000) | (w << 24);
+                    }
+                }
+                bytes(swapped, n * 4);
+                src += n;
+                num -= n;
+            }
+        }
+        void word(uint32_t w) { words(&w, 1); }
+
+        void zeros(size_t size) {
+            static const char zero[256] = { 0 };
+            while (size) {
+                size_t n = min(size, sizeof(zero));
+                bytes(zero, n);
+                size -= n;
+            }
+        }
+
+        /// Start a block, returns the position of its content
+        long beginBlock(uint32_t type, uint32_t count) {
+            word(type);
+            word(count);
+            word(0);
+            return pos;
+        }
+        /// Write the size of the block started at start
+        void endBlock(long start) {
+            patch(start - 4, (uint32_t)(pos - start));
+        }
+
+        bool finish() {
+            flush();
+            return !failed;
+        }
+
+    private:
+        FILE     *f;
+        bool      swap;
+        char     *buffer;
+        uint32_t *swapped;
+        size_t    used;
+        long      pos;
+        bool      failed;
+
+        void flush() {
+            if (used && fwrite(buffer, 1, used, f) != used) failed = true;
+            used = 0;
+        }
+
+        void patch(long offset, uint32_t w) {
+            flush();
+            if (swap) bswap32(&w, 1);
+            if (fseek(f, offset, SEEK_SET) != 0 || fwrite(&w, 4, 1, f) != 1 ||
+                    fseek(f, 0, SEEK_END) != 0)
+                failed = true;
+        }
+};
+/* }}} */
+
+//
+// LISTS /* {{{ */
+//
+// A list id stands for the length, vertex, color, normal and texcoord
+// lists of that index, the geosets only hold the id. Merging keeps the
+// first of the ids whose lists are all identical, and renumbers the kept
+// ids in order, so every kind keeps a prefix of its lists.
+//
+
+static uint64_t hashBytes(const void *data, size_t size, uint64_t h)
+{
+    const unsigned char *p = (const unsigned char*)data;
+    for (size_t i=0; i<size; ++i) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+template <typename T, unsigned N>
+static uint64_t hashList(PfbList<T,N> *list, uint64_t h)
+{
+    uint32_t size = list ? list->getSize() : 0xffffffff;
+    h = hashBytes(&size, 4, h);
+    if (list && size) h = hashBytes(list->get(0), size * N * sizeof(T), h);
+    return h;
+}
+
+template <typename T, unsigned N>
+static bool sameList(PfbList<T,N> *a, PfbList<T,N> *b)
+{
+    if (!a || !b) return a == b;
+    if (a->getSize() != b->getSize()) return false;
+    return a->getSize() == 0 || memcmp(a->get(0), b->get(0), a->getSize() * N * sizeof(T)) == 0;
+}
+
+/// Lists of one id, NULL for the kinds that do not have it
+struct PfbListSet
+{
+    PfbLengthList   *length;
+    PfbVertexList   *vertex;
+    PfbColorList    *color;
+    PfbNormalList   *normal;
+    PfbTexcoordList *texcoord;
+
+    PfbListSet(PfbTree &tree, uint32_t id) {
+        length   = (tree.haveLengthList()   && id < tree.getNumLengthList())   ? &tree.getLengthList(id)   : NULL;
+        vertex   = (tree.haveVertexList()   && id < tree.getNumVertexList())   ? &tree.getVertexList(id)   : NULL;
+        color    = (tree.haveColorList()    && id < tree.getNumColorList())    ? &tree.getColorList(id)    : NULL;
+        normal   = (tree.haveNormalList()   && id < tree.getNumNormalList())   ? &tree.getNormalList(id)   : NULL;
+        texcoord = (tree.haveTexcoordList() && id < tree.getNumTexcoordList()) ? &tree.getTexcoordList(id) : NULL;
+    }
+
+    uint64_t hash() const {
+        uint64_t h = 14695981039346656037ULL;
+        h = hashList(length, h);
+        h = hashList(vertex, h);
+        h = hashList(color, h);
+        h = hashList(normal, h);
+        return hashList(texcoord, h);
+    }
+
+    bool operator==(const PfbListSet &o) const {
+        return sameList(length, o.length) && sameList(vertex, o.vertex) &&
+            sameList(color, o.color) && sameList(normal, o.normal) &&
+            sameList(texcoord, o.texcoord);
+    }
+};
+
+static uint32_t getNumListIds(PfbTree &tree)
+{
+    uint32_t num = 0;
+    if (tree.haveLengthList())   num = max(num, (uint32_t)tree.getNumLengthList());
+    if (tree.haveVertexList())   num = max(num, (uint32_t)tree.getNumVertexList());
+    if (tree.haveColorList())    num = max(num, (uint32_t)tree.getNumColorList());
+    if (tree.haveNormalList())   num = max(num, (uint32_t)tree.getNumNormalList());
+    if (tree.haveTexcoordList()) num = max(num, (uint32_t)tree.getNumTexcoordList());
+    return num;
+}
+
+/// kept: the ids written, in order; remap: new id of every id
+static void mapListIds(PfbTree &tree, bool merge, vector<uint32_t> &kept, vector<uint32_t> &remap)
+{
+    uint32_t num = getNumListIds(tree);
+    kept.clear();
+    remap.resize(num);
+
+    multimap<uint64_t, uint32_t> seen; // hash -> new id
+    for (uint32_t id=0; id<num; ++id) {
+        if (merge) {
+            PfbListSet set(tree, id);
+            uint64_t h = set.hash();
+            bool found = false;
+            pair<multimap<uint64_t, uint32_t>::iterator, multimap<uint64_t, uint32_t>::iterator> range = seen.equal_range(h);
+            for (multimap<uint64_t, uint32_t>::iterator it = range.first; it != range.second; ++it) {
+                if (PfbListSet(tree, kept[it->second]) == set) {
+                    remap[id] = it->second;
+                    found = true;
+                    break;
+                }
+            }
+            if (found) continue;
+            seen.insert(make_pair(h, (uint32_t)kept.size()));
+        }
+        remap[id] = kept.size();
+        kept.push_back(id);
+    }
+}
+
+template <typename T, unsigned N>
+static void writeList(PfbOutput &out, PfbList<T,N> &list)
+{
+    out.word(list.getSize());
+    out.word(0);
+    out.word(0);
+    if (list.getSize()) out.words(list.get(0), list.getSize() * N * sizeof(T) / 4);
+}
+
+template <typename L>
+static void writeLists(PfbOutput &out, PfbTree &tree, uint32_t type, bool have, unsigned num,
+        L &(PfbTree::*getList)(unsigned), const vector<uint32_t> &kept)
+{
+    if (!have) return;
+    uint32_t count = 0;
+    while (count < kept.size() && kept[count] < num)
+        count++;
+
+    long start = out.beginBlock(type, count);
+    for (uint32_t i=0; i<count; ++i)
+        writeList(out, (tree.*getList)(kept[i]));
+    out.endBlock(start);
+}
+/* }}} */
+
+//
+// BLOCKS /* {{{ */
+//
+
+static void writeMaterials(PfbOutput &out, PfbTree &tree)
+{
+    if (!tree.haveMaterials()) return;
+    long start = out.beginBlock(PFBBLOCK_MATERIALS, tree.getNumMaterials());
+    for (unsigned i=0; i<tree.getNumMaterials(); ++i)
+        out.words(&tree.getMaterial(i), sizeof(PfbMaterial) / 4);
+    out.endBlock(start);
+}
+
+/// Only the file names are kept by the loader, the 228 bytes of
+/// attributes that follow are zeroed
+static void writeTextures(PfbOutput &out, PfbTree &tree)
+{
+    if (!tree.haveTextures()) return;
+    long start = out.beginBlock(PFBBLOCK_TEXTURES, tree.getNumTextures());
+    uint32_t size = 0;
+    for (unsigned i=0; i<tree.getNumTextures(); ++i) {
+        const char *fileName = tree.getTexture(i).fileName;
+        uint32_t length = fileName ? strlen(fileName) : 0;
+        out.word(length);
+        out.bytes(fileName, length);
+        out.zeros(228);
+        size += 4 + length + 228;
+    }
+    out.zeros((4 - size % 4) % 4);
+    out.endBlock(start);
+}
+
+/// Keys with a value other than -1 (the loader default), key 1 first then
+/// in order: the loader reads a word after keys 6, 13, 17, 18 and 25 to
+/// tell their variants apart, it must be the next key (neither 1 nor -1)
+/// or the final -1.
+static void writeGeoStates(PfbOutput &out, PfbTree &tree)
+{
+    if (tree.getNumGeoStates() == 0) return;
+    long start = out.beginBlock(PFBBLOCK_GEOSTATES, tree.getNumGeoStates());
+    vector<int32_t> words;
+    for (unsigned i=0; i<tree.getNumGeoStates(); ++i) {
+        const PfbGeoState &geostate = tree.getGeoState(i);
+        int32_t num = geostate.getNumValues();
+        words.clear();
+        words.push_back(num);
+        if (num >= 1 && geostate.getValue(1) != -1) {
+            words.push_back(1);
+            words.push_back(geostate.getValue(1));
+        }
+        for (int32_t key=2; key<=num; ++key) {
+            if (geostate.getValue(key) == -1) continue;
+            words.push_back(key);
+            words.push_back(geostate.getValue(key));
+        }
+        words.push_back(-1);
+        out.words(&words[0], words.size());
+    }
+    out.endBlock(start);
+}
+
+static void writeGeoSets(PfbOutput &out, PfbTree &tree, const vector<uint32_t> &remap)
+{
+    if (tree.getNumGeosets() == 0) return;
+    long start = out.beginBlock(PFBBLOCK_GEOSETS, tree.getNumGeosets());
+    for (unsigned i=0; i<tree.getNumGeosets(); ++i) {
+        PfbGeoSet geoset = tree.getGeoSet(i);
+        if (geoset.lengthListId >= 0 && (uint32_t)geoset.lengthListId < remap.size())
+            geoset.lengthListId = remap[geoset.lengthListId];
+        out.words(&geoset, sizeof(PfbGeoSet) / 4);
+    }
+    out.endBlock(start);
+}
+
+static void pushChilds(vector<uint32_t> &words, const PfbChilds &childs)
+{
+    words.push_back(childs.getNumChildren());
+    for (uint32_t i=0; i<childs.getNumChildren(); ++i)
+        words.push_back(childs.getChild(i));
+}
+
+static void pushFloats(vector<uint32_t> &words, const float *values, unsigned num)
+{
+    for (unsigned i=0; i<num; ++i) {
+        uint32_t w;
+        memcpy(&w, values + i, 4);
+        words.push_back(w);
+    }
+}
+
+/// Every node: its size in words, the body (type, payload, trailing
+/// words), the name. False on a node of unknown type.
+static bool writeNodes(PfbOutput &out, PfbTree &tree)
+{
+    if (tree.getNumNodes() == 0) return true;
+    long start = out.beginBlock(PFBBLOCK_NODES, tree.getNumNodes());
+    uint32_t size = 0; // of the names, the words keep the alignment
+    vector<uint32_t> words;
+    const float one = 1;
+
+    for (unsigned i=0; i<tree.getNumNodes(); ++i) {
+        const PfbNode &node = tree.getNode(i);
+        words.clear();
+        words.push_back(0); // size
+        words.push_back(node.getType());
+
+        if (const PfbNodeGeode *geode = node.asGeode()) {
+            words.push_back(geode->getNumGeosets());
+            words.insert(words.end(), geode->getGeosets(), geode->getGeosets() + geode->getNumGeosets());
+        }
+        else if (const PfbNodeGroup *group = node.asGroup()) {
+            pushChilds(words, group->getChilds());
+        }
+        else if (const PfbNodeSCS *scs = node.asSCS()) {
+            pushFloats(words, scs->getMatrix(), 16);
+            pushChilds(words, scs->getChilds());
+        }
+        else if (const PfbNodeDCS *dcs = node.asDCS()) {
+            words.push_back(0); // mask
+            pushFloats(words, dcs->getMatrix(), 16);
+            pushChilds(words, dcs->getChilds());
+        }
+        else if (const PfbNodeLOD *lod = node.asLOD()) {
+            uint32_t numRanges = lod->getNumRanges();
+            words.push_back(numRanges);
+            pushFloats(words, lod->getRanges(0), numRanges + 1);
+            for (uint32_t r=0; r<=numRanges; ++r)
+                pushFloats(words, &one, 1);
+            pushFloats(words, lod->getCenter(), 3);
+            words.push_back(0xffffffff);
+            words.push_back(0xffffffff);
+            pushChilds(words, lod->getChilds());
+        }
+        else {
+            return false;
+        }
+
+        for (unsigned k=0; k<4; ++k)
+            words.push_back(0xffffffff);
+        words.push_back(0);
+        words.push_back(0xffffffff);
+        words.push_back(0);
+        words.push_back(0xffffffff);
+        words[0] = words.size() - 1;
+
+        const char *name = node.getName();
+        uint32_t length = name ? strlen(name) : 0;
+        words.push_back(length);
+        out.words(&words[0], words.size());
+        out.bytes(name, length);
+        size += length;
+    }
+    // Keeps the next blocks aligned, for their lists to be used in place
+    out.zeros((4 - size % 4) % 4);
+    out.endBlock(start);
+    return true;
+}
+/* }}} */
+
+//
+// WRITER /* {{{ */
+//
+
+PfbWriter::PfbWriter(unsigned flags) :
+    flags(flags),
+    error(NULL),
+    numMergedLists(0)
+{
+    memset(&header, 0, sizeof(header));
+}
+
+bool PfbWriter::isBigEndian() const
+{
+    if (flags & PFBWRITE_BIGENDIAN)    return true;
+    if (flags & PFBWRITE_LITTLEENDIAN) return false;
+    return isNativeBigEndian();
+}
+
+void PfbWriter::addRawBlock(uint32_t type, uint32_t count, const void *data, uint32_t size)
+{
+    rawBlocks.push_back(RawBlock());
+    RawBlock &block = rawBlocks.back();
+    block.type  = type;
+    block.count = count;
+    block.data.assign((const char*)data, (const char*)data + size);
+}
+
+bool PfbWriter::write(PfbTree &tree, const string &name)
+{
+    vector<uint32_t> kept, remap;
+    mapListIds(tree, (flags & PFBWRITE_MERGE_LISTS) != 0, kept, remap);
+    numMergedLists = remap.size() - kept.size();
+
+    // Written aside then renamed, as the cache: the file can be rewritten
+    // in place, readers never see a partial file
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".tmp%d", (int)getpid());
+    string tmpName = name + suffix;
+
+    FILE *f = fopen(tmpName.c_str(), "wb");
+    if (!f) {
+        error = "Can't create file";
+        return false;
+    }
+
+    bool nodesOk = true, ok;
+    {
+        PfbOutput out(f, isBigEndian() != isNativeBigEndian());
+        PfbHeader h = header;
+        h.magic = 0xdb0ace00;
+        out.words(&h, sizeof(h) / 4);
+
+        if (flags & PFBWRITE_NODES_FIRST) nodesOk = writeNodes(out, tree);
+        writeMaterials(out, tree);
+        writeTextures(out, tree);
+        writeGeoStates(out, tree);
+        writeLists(out, tree, PFBBLOCK_LENGTHLISTS,   tree.haveLengthList(),   tree.getNumLengthList(),   &PfbTree::getLengthList,   kept);
+        writeLists(out, tree, PFBBLOCK_VERTEXLISTS,   tree.haveVertexList(),   tree.getNumVertexList(),   &PfbTree::getVertexList,   kept);
+        writeLists(out, tree, PFBBLOCK_COLORLISTS,    tree.haveColorList(),    tree.getNumColorList(),    &PfbTree::getColorList,    kept);
+        writeLists(out, tree, PFBBLOCK_NORMALLISTS,   tree.haveNormalList(),   tree.getNumNormalList(),   &PfbTree::getNormalList,   kept);
+        writeLists(out, tree, PFBBLOCK_TEXCOORDLISTS, tree.haveTexcoordList(), tree.getNumTexcoordList(), &PfbTree::getTexcoordList, kept);
+        writeGeoSets(out, tree, remap);
+        if (!(flags & PFBWRITE_NODES_FIRST) && nodesOk) nodesOk = writeNodes(out, tree);
+
+        for (unsigned b=0; b<rawBlocks.size(); ++b) {
+            const RawBlock &block = rawBlocks[b];
+            long start = out.beginBlock(block.type, block.count);
+            if (!block.data.empty()) out.bytes(&block.data[0], block.data.size());
+            out.endBlock(start);
+        }
+        ok = out.finish() && nodesOk;
+    }
+    if (fclose(f) != 0) ok = false;
+
+    if (!ok || rename(tmpName.c_str(), name.c_str()) != 0) {
+        unlink(tmpName.c_str());
+        error = nodesOk ? "Can't write file" : "Unsupported node type";
+        return false;
+    }
+    error = NULL;
+    return true;
+}
+/* }}} */
+}
@@ -0,0 +1,74 @@
+#ifndef _OPENPFB_WRITER_H
+#define _OPENPFB_WRITER_H
+
+#include "OpenPfb.h"
+
+/// Byte order of the written file, the one of this machine when neither
+/// is given
+#define PFBWRITE_BIGENDIAN    0x0001
+#define PFBWRITE_LITTLEENDIAN 0x0002
+
+/// Write the nodes before the other blocks
+#define PFBWRITE_NODES_FIRST  0x0004
+
+/// Write the lists of identical list ids once (same length, vertex, color,
+/// normal and texcoord lists), the geosets then share them
+#define PFBWRITE_MERGE_LISTS  0x0008
+
+namespace openpfb
+{
+    /// @class PfbWriter
+    ///
+    /// @brief Writes a PfbTree as a pfb file that PfbFile loads back
+    ///
+    /// Blocks are written in the usual order: materials, textures,
+    /// geostates, lists, geosets, nodes, then the raw blocks. What the
+    /// loader does not keep is written with the values common files hold:
+    /// texture attributes are zeroed, the DCS mask is 0, LOD and node
+    /// trailing words are the usual constants and the geosets lose their
+    /// padding.
+    class PfbWriter
+    {
+        public:
+            /// @param flags  combination of PFBWRITE_* values
+            PfbWriter(unsigned flags = 0);
+
+            /// Header of the file, its magic is ignored (default: the
+            /// other words 0). Words are given in the byte order of this
+            /// machine.
+            void setHeader(const PfbHeader &header) { this->header = header; }
+
+            /// Block written as is after the others, payload already in
+            /// the byte order of the file (e.g. a block the loader skips,
+            /// copied from a file in that byte order)
+            void addRawBlock(uint32_t type, uint32_t count, const void *data, uint32_t size);
+
+            /// Write tree to the file name. The file is replaced
+            /// atomically. Returns false on failure (see getError()).
+            bool write(PfbTree &tree, const std::string &name);
+
+            const char *getError() const { return error; }
+
+            /// True if the file is written big-endian
+            bool isBigEndian() const;
+
+            /// List ids left out by PFBWRITE_MERGE_LISTS in the last write()
+            uint32_t getNumMergedLists() const { return numMergedLists; }
+
+        private:
+            struct RawBlock
+            {
+                uint32_t          type;
+                uint32_t          count;
+                std::vector<char> data;
+            };
+
+            unsigned              flags;
+            const char           *error;
+            PfbHeader             header;
+            uint32_t              numMergedLists;
+            std::vector<RawBlock> rawBlocks;
+    };
+}
+
+#endif
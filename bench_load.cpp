@@ -0,0 +1,261 @@
+#include "OpenPfb.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Load benchmark: PfbFile::load() of every file with every loading mode,
+// MB/s, nodes/s, allocations and peak RSS, and the time of its phases.
+// Each file and mode runs in its own process, so that the peak RSS is its
+// own. Results can be written as JSON (-o) to compare versions.
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+//
+// ALLOCATIONS /* {{{ */
+//
+// Every operator new of the process (the library included) is counted.
+//
+
+static volatile unsigned long numAllocs = 0;
+static volatile unsigned long allocBytes = 0;
+
+void *operator new(size_t size)
+{
+    __sync_fetch_and_add(&numAllocs, 1);
+    __sync_fetch_and_add(&allocBytes, size);
+    void *p = malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p)
+{
+    free(p);
+}
+
+void operator delete[](void *p)
+{
+    free(p);
+}
+/* }}} */
+
+struct Mode
+{
+    const char *name;
+    unsigned    flags;
+};
+
+static const Mode modes[] = {
+    { "default",       0 },
+    { "mmap",          PFBLOAD_MMAP },
+    { "parallel",      PFBLOAD_PARALLEL },
+    { "mmap+parallel", PFBLOAD_MMAP | PFBLOAD_PARALLEL },
+    { "lazy",          PFBLOAD_LAZY },
+    { NULL, 0 }
+};
+
+/// Measures of one file and mode, sent back by the child process
+struct Result
+{
+    int           ok;
+    char          error[128];
+    unsigned      numNodes;
+    unsigned      numGeoSets;
+    double        load;       // best full load()
+    double        parse;      // load() without the bounds and node table
+    double        nodeTable;
+    double        bounds;     // 0 when not computed (lazy)
+    unsigned long allocs;     // during one full load()
+    unsigned long allocBytes;
+    long          peakRss;    // KB
+};
+
+static void measure(const char *name, const Mode &mode, unsigned rounds, Result &r)
+{
+    memset(&r, 0, sizeof(r));
+    r.load = 1e30;
+    r.parse = 1e30;
+    r.nodeTable = 1e30;
+    r.bounds = 1e30;
+
+    for (unsigned i=0; i<rounds; ++i) {
+        unsigned long a0 = numAllocs, b0 = allocBytes;
+        double t0 = now();
+        openpfb::PfbFile file(name, mode.flags);
+        std::auto_ptr<openpfb::PfbTree> tree = file.load();
+        double t1 = now();
+        if (!tree.get()) {
+            snprintf(r.error, sizeof(r.error), "%s", file.getError() ? file.getError() : "load failed");
+            return;
+        }
+        if (t1 - t0 < r.load) r.load = t1 - t0;
+        r.allocs     = numAllocs - a0;
+        r.allocBytes = allocBytes - b0;
+        r.numNodes   = tree->getNumNodes();
+        r.numGeoSets = tree->getNumGeosets();
+    }
+
+    // Phases: the node table is built again to time it alone
+    for (unsigned i=0; i<rounds; ++i) {
+        double t0 = now();
+        openpfb::PfbFile file(name, mode.flags | PFBLOAD_NOBOUNDS);
+        std::auto_ptr<openpfb::PfbTree> tree = file.load();
+        double t1 = now();
+        if (!tree.get()) return;
+        tree->buildNodeTable();
+        double t2 = now();
+        double bounds = 0;
+        if (!(mode.flags & PFBLOAD_LAZY)) {
+            tree->computeBounds((mode.flags & PFBLOAD_PARALLEL) ? 0 : 1);
+            bounds = now() - t2;
+        }
+        double nodeTable = t2 - t1;
+        double parse = (t1 - t0) - nodeTable;
+        if (parse < r.parse)         r.parse = (parse > 0) ? parse : 0;
+        if (nodeTable < r.nodeTable) r.nodeTable = nodeTable;
+        if (bounds < r.bounds)       r.bounds = bounds;
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    r.peakRss = usage.ru_maxrss;
+    r.ok = 1;
+}
+
+/// measure() in a child process
+static bool run(const char *name, const Mode &mode, unsigned rounds, Result &r)
+{
+    int fds[2];
+    if (pipe(fds) != 0) return false;
+    pid_t pid = fork();
+    if (pid < 0) return false;
+    if (pid == 0) {
+        close(fds[0]);
+        measure(name, mode, rounds, r);
+        ssize_t written = write(fds[1], &r, sizeof(r));
+        _exit(written == (ssize_t)sizeof(r) ? 0 : 1);
+    }
+    close(fds[1]);
+    size_t got = 0;
+    while (got < sizeof(r)) {
+        ssize_t n = read(fds[0], (char*)&r + got, sizeof(r) - got);
+        if (n <= 0) break;
+        got += n;
+    }
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    return got == sizeof(r);
+}
+
+static void usage(const char *argv0)
+{
+    printf("usage: %s [-r rounds] [-m mode] [-o out.json] [-l label] <file.pfb>...\n", argv0);
+    printf("  modes:");
+    for (const Mode *m = modes; m->name; ++m)
+        printf(" %s", m->name);
+    printf(" (default: all)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned    rounds = 3;
+    const char *only = NULL;
+    const char *output = NULL;
+    const char *label = "";
+
+    int c;
+    while ((c = getopt(argc, argv, "r:m:o:l:")) != -1) {
+        switch (c) {
+            case 'r': rounds = strtoul(optarg, NULL, 10); break;
+            case 'm': only   = optarg; break;
+            case 'o': output = optarg; break;
+            case 'l': label  = optarg; break;
+            default:  usage(argv[0]); return 1;
+        }
+    }
+    if (optind >= argc || rounds == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::string json;
+    char line[1024];
+    snprintf(line, sizeof(line), "{\n  \"label\": \"%s\",\n  \"time\": %ld,\n  \"rounds\": %u,\n  \"results\": [",
+            label, (long)time(NULL), rounds);
+    json += line;
+    bool first = true, failed = false;
+
+    printf("%-14s %8s %9s %10s %8s %8s %8s %8s %9s %9s\n", "mode", "load ms", "MB/s", "nodes/s",
+            "parse ms", "table ms", "bound ms", "allocs", "alloc MB", "rss MB");
+    for (int f=optind; f<argc; ++f) {
+        const char *name = argv[f];
+        struct stat st;
+        if (stat(name, &st) != 0) {
+            fprintf(stderr, "%s: cannot stat\n", name);
+            failed = true;
+            continue;
+        }
+        printf("%s (%.1f MB)\n", name, st.st_size / 1048576.0);
+
+        for (const Mode *m = modes; m->name; ++m) {
+            if (only && strcmp(only, m->name) != 0) continue;
+
+            Result r;
+            memset(&r, 0, sizeof(r));
+            if (!run(name, *m, rounds, r) || !r.ok) {
+                fprintf(stderr, "%s (%s): %s\n", name, m->name, r.error[0] ? r.error : "failed");
+                failed = true;
+                continue;
+            }
+            double mbs   = st.st_size / 1048576.0 / r.load;
+            double nodes = r.numNodes / r.load;
+            printf("%-14s %8.2f %9.1f %10.0f %8.2f %8.2f %8.2f %8lu %9.1f %9.1f\n", m->name,
+                    r.load * 1e3, mbs, nodes, r.parse * 1e3, r.nodeTable * 1e3, r.bounds * 1e3,
+                    r.allocs, r.allocBytes / 1048576.0, r.peakRss / 1024.0);
+
+            snprintf(line, sizeof(line),
+                    "%s\n    { \"file\": \"%s\", \"mode\": \"%s\", \"bytes\": %ld,"
+                    " \"nodes\": %u, \"geosets\": %u,"
+                    " \"load_s\": %.6f, \"mb_per_s\": %.2f, \"nodes_per_s\": %.0f,"
+                    " \"parse_s\": %.6f, \"node_table_s\": %.6f, \"bounds_s\": %.6f,"
+                    " \"allocations\": %lu, \"allocated_bytes\": %lu, \"peak_rss_kb\": %ld }",
+                    first ? "" : ",", name, m->name, (long)st.st_size, r.numNodes, r.numGeoSets,
+                    r.load, mbs, nodes, r.parse, r.nodeTable, r.bounds,
+                    r.allocs, r.allocBytes, r.peakRss);
+            json += line;
+            first = false;
+        }
+    }
+    json += "\n  ]\n}\n";
+
+    if (output) {
+        FILE *out = fopen(output, "w");
+        if (!out || fwrite(json.data(), 1, json.size(), out) != json.size()) {
+            fprintf(stderr, "%s: cannot write\n", output);
+            failed = true;
+        }
+        if (out) fclose(out);
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,119 @@
+#include "OpenPfbCache.h"
+#include "OpenPfbThreads.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Pre-warm the caches of pfb files: every file whose cache is missing or
+// out of date is loaded and its cache written, several files at once.
+
+static bool isPfb(const std::string &name)
+{
+    return name.size() > 4 && strcasecmp(name.c_str() + name.size() - 4, ".pfb") == 0;
+}
+
+/// Add the pfb files of path (a file, or a directory walked recursively)
+static void findFiles(const std::string &path, std::vector<std::string> &files)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        fprintf(stderr, "%s: not found\n", path.c_str());
+        return;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        files.push_back(path);
+        return;
+    }
+
+    DIR *dir = opendir(path.c_str());
+    if (!dir) return;
+    while (struct dirent *entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name == "." || name == "..") continue;
+        std::string child = path + "/" + name;
+        if (stat(child.c_str(), &st) != 0) continue;
+        if (S_ISDIR(st.st_mode))
+            findFiles(child, files);
+        else if (isPfb(name))
+            files.push_back(child);
+    }
+    closedir(dir);
+}
+
+enum { CACHE_VALID, CACHE_WRITTEN, CACHE_FAILED };
+
+class WarmTask : public openpfb::PfbTask
+{
+    public:
+        WarmTask(const std::vector<std::string> &files, unsigned cacheFlags, bool force) :
+            files(files), cacheFlags(cacheFlags), force(force),
+            status(files.size()), errors(files.size()) {}
+
+        void run(unsigned i) {
+            openpfb::PfbCache cache(files[i], "", cacheFlags);
+            if (!force && cache.isValid()) {
+                status[i] = CACHE_VALID;
+                return;
+            }
+            if (cache.rebuild(PFBLOAD_NOBOUNDS)) {
+                status[i] = CACHE_WRITTEN;
+            }
+            else {
+                status[i] = CACHE_FAILED;
+                errors[i] = cache.getError();
+            }
+        }
+
+        const std::vector<std::string> &files;
+        unsigned cacheFlags;
+        bool     force;
+        std::vector<int>         status;
+        std::vector<const char*> errors;
+};
+
+static void usage(const char *argv0)
+{
+    printf("usage: %s [-j threads] [-f] [-v] <dir|pfbfile> [...]\n", argv0);
+    printf("  -j  number of threads (default: one per processor)\n");
+    printf("  -f  rewrite valid caches too\n");
+    printf("  -v  validate caches with a hash of the whole source file\n");
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned numThreads = 0;
+    unsigned cacheFlags = 0;
+    bool     force      = false;
+
+    int c;
+    while ((c = getopt(argc, argv, "j:fv")) != -1) {
+        switch (c) {
+            case 'j': numThreads = strtoul(optarg, NULL, 10); break;
+            case 'f': force = true; break;
+            case 'v': cacheFlags |= PFBCACHE_VERIFY_CONTENT; break;
+            default:  usage(argv[0]); return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<std::string> files;
+    for (int i=optind; i<argc; ++i)
+        findFiles(argv[i], files);
+
+    WarmTask task(files, cacheFlags, force);
+    openpfb::parallelFor(task, files.size(), numThreads);
+
+    unsigned counts[3] = { 0, 0, 0 };
+    for (unsigned i=0; i<files.size(); ++i) {
+        counts[task.status[i]]++;
+        if (task.status[i] == CACHE_FAILED)
+            printf("%s: %s\n", files[i].c_str(), task.errors[i]);
+    }
+    printf("%u files: %u valid, %u written, %u failed\n",
+            (unsigned)files.size(), counts[CACHE_VALID], counts[CACHE_WRITTEN], counts[CACHE_FAILED]);
+    return counts[CACHE_FAILED] ? 1 : 0;
+}
@@ -0,0 +1,339 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <unistd.h>
+
+// Synthetic pfb generator for the benchmarks: a balanced tree of groups,
+// SCS, DCS and LOD nodes over geodes, every geoset with its own lists.
+
+struct Options
+{
+    bool     bigEndian;
+    unsigned geodes;
+    unsigned geosetsPerGeode;
+    unsigned vertices;     // per geoset
+    unsigned stripLength;
+    unsigned depth;        // levels of inner nodes above the geodes
+    unsigned lodPercent;   // of the inner nodes
+    unsigned dcsPercent;
+    unsigned scsPercent;
+    unsigned geostates;
+    unsigned seed;
+};
+
+/// Bytes of the file, words written in the target byte order
+class Output
+{
+    public:
+        Output(bool bigEndian) : bigEndian(bigEndian) {}
+
+        void u32(uint32_t v) {
+            unsigned char b[4];
+            for (unsigned i=0; i<4; ++i)
+                b[bigEndian ? 3 - i : i] = (unsigned char)(v >> (8 * i));
+            data.insert(data.end(), b, b + 4);
+        }
+        void i32(int32_t v) { u32((uint32_t)v); }
+        void f32(float v)   { uint32_t u; memcpy(&u, &v, 4); u32(u); }
+        void bytes(const void *p, size_t n) {
+            data.insert(data.end(), (const unsigned char*)p, (const unsigned char*)p + n);
+        }
+        void string(const std::string &s) {
+            u32(s.size());
+            bytes(s.data(), s.size());
+        }
+        void pad4() { while (data.size() % 4) data.push_back(0); }
+
+        size_t size() const { return data.size(); }
+        void   patch(size_t pos, uint32_t v) {
+            Output word(bigEndian);
+            word.u32(v);
+            memcpy(&data[pos], &word.data[0], 4);
+        }
+
+        /// Block header, its size patched by endBlock()
+        size_t beginBlock(uint32_t type, uint32_t num) {
+            u32(type);
+            u32(num);
+            u32(0);
+            return size();
+        }
+        void endBlock(size_t start) { patch(start - 4, size() - start); }
+
+        bool write(const char *name) const {
+            FILE *f = fopen(name, "wb");
+            if (!f) return false;
+            bool ok = fwrite(&data[0], 1, data.size(), f) == data.size();
+            return fclose(f) == 0 && ok;
+        }
+
+    private:
+        bool bigEndian;
+        std::vector<unsigned char> data;
+};
+
+static float frand() { return rand() / (float)RAND_MAX; }
+
+struct Node
+{
+    uint32_t type;
+    std::vector<uint32_t> children; // nodes, or geosets for geodes
+};
+
+/// Inner nodes level by level from the root, then the geodes
+static std::vector<Node> buildNodes(const Options &opt)
+{
+    unsigned fanout = 2;
+    while (pow((double)fanout, (double)opt.depth) < opt.geodes) ++fanout;
+
+    std::vector<Node> nodes;
+    std::vector<uint32_t> level(1, 0);
+    nodes.push_back(Node());
+    nodes[0].type = 5;
+    for (unsigned d=1; d<opt.depth; ++d) {
+        std::vector<uint32_t> next;
+        for (unsigned p=0; p<level.size(); ++p) {
+            for (unsigned c=0; c<fanout; ++c) {
+                Node node;
+                unsigned r = rand() % 100;
+                node.type = (r < opt.lodPercent) ? 11 :
+                            (r < opt.lodPercent + opt.dcsPercent) ? 7 :
+                            (r < opt.lodPercent + opt.dcsPercent + opt.scsPercent) ? 6 : 5;
+                nodes[level[p]].children.push_back(nodes.size());
+                next.push_back(nodes.size());
+                nodes.push_back(node);
+            }
+        }
+        level.swap(next);
+    }
+
+    // Geodes spread over the last level
+    uint32_t geoset = 0;
+    for (unsigned g=0; g<opt.geodes; ++g) {
+        Node geode;
+        geode.type = 2;
+        for (unsigned s=0; s<opt.geosetsPerGeode; ++s)
+            geode.children.push_back(geoset++);
+        nodes[level[g % level.size()]].children.push_back(nodes.size());
+        nodes.push_back(geode);
+    }
+    return nodes;
+}
+
+static void writeNode(Output &out, const Node &node, unsigned id)
+{
+    size_t sizePos = out.size();
+    out.u32(0);
+    size_t start = out.size();
+    out.u32(node.type);
+
+    float matrix[16] = { 1,0,0,0, 0,1,0,0, 0,0,1,0, 0,0,0,1 };
+    matrix[12] = frand() * 100;
+    matrix[13] = frand() * 100;
+    switch (node.type) {
+        case 7:
+            out.u32(0);
+            // fall through
+        case 6:
+            for (unsigned i=0; i<16; ++i)
+                out.f32(matrix[i]);
+            break;
+        case 11: {
+            unsigned n = node.children.size();
+            out.u32(n);
+            for (unsigned r=0; r<=n; ++r)
+                out.f32(r * 100.0f);
+            for (unsigned r=0; r<=n; ++r)
+                out.f32(1);
+            out.f32(frand());
+            out.f32(frand());
+            out.f32(frand());
+            out.i32(-1);
+            out.i32(-1);
+            break;
+        }
+    }
+    out.u32(node.children.size());
+    for (unsigned i=0; i<node.children.size(); ++i)
+        out.u32(node.children[i]);
+
+    for (unsigned i=0; i<4; ++i)
+        out.u32(0xffffffff);
+    out.i32(0);
+    out.i32(-1);
+    out.i32(0);
+    out.i32(-1);
+    out.patch(sizePos, (out.size() - start) / 4);
+
+    char name[32];
+    snprintf(name, sizeof(name), "node%u", id);
+    out.string(name);
+}
+
+/// One list per geoset, numValues values of n floats each
+static void writeFloatLists(Output &out, uint32_t type, unsigned numLists, unsigned numValues,
+        unsigned n, float scale)
+{
+    size_t block = out.beginBlock(type, numLists);
+    for (unsigned l=0; l<numLists; ++l) {
+        out.u32(numValues);
+        out.u32(0);
+        out.u32(0);
+        for (unsigned v=0; v<numValues * n; ++v)
+            out.f32(frand() * scale);
+    }
+    out.endBlock(block);
+}
+
+static bool generate(const Options &opt, const char *fileName)
+{
+    srand(opt.seed);
+    Output out(opt.bigEndian);
+    out.u32(0xdb0ace00);
+    out.u32(1);
+    out.u32(2);
+    out.u32(3);
+
+    // Materials and textures, one per geostate
+    size_t block = out.beginBlock(0, opt.geostates);
+    for (unsigned m=0; m<opt.geostates; ++m) {
+        out.u32(1);
+        out.f32(1);
+        out.f32(16);
+        for (unsigned i=0; i<12; ++i)
+            out.f32(frand());
+        out.i32(3);
+        out.i32(4);
+        out.i32(-1);
+    }
+    out.endBlock(block);
+
+    block = out.beginBlock(1, opt.geostates);
+    for (unsigned t=0; t<opt.geostates; ++t) {
+        char name[32];
+        snprintf(name, sizeof(name), "texture%u.rgb", t);
+        out.string(name);
+        for (unsigned i=0; i<228/4; ++i)
+            out.u32(0);
+    }
+    out.pad4();
+    out.endBlock(block);
+
+    // Geostates: texture (17) then material (15)
+    block = out.beginBlock(3, opt.geostates);
+    for (unsigned g=0; g<opt.geostates; ++g) {
+        out.i32(20);
+        out.i32(17);
+        out.i32(g);
+        out.i32(15);
+        out.i32(g);
+        out.i32(-1);
+    }
+    out.endBlock(block);
+
+    unsigned numGeosets = opt.geodes * opt.geosetsPerGeode;
+    unsigned numStrips  = (opt.vertices + opt.stripLength - 1) / opt.stripLength;
+
+    block = out.beginBlock(4, numGeosets);
+    for (unsigned l=0; l<numGeosets; ++l) {
+        out.u32(numStrips);
+        out.u32(0);
+        out.u32(0);
+        for (unsigned s=0; s<numStrips; ++s)
+            out.u32((s + 1 < numStrips) ? opt.stripLength : opt.vertices - s * opt.stripLength);
+    }
+    out.endBlock(block);
+
+    writeFloatLists(out, 5, numGeosets, opt.vertices, 3, 10);
+    writeFloatLists(out, 6, numGeosets, 1, 4, 1);
+    writeFloatLists(out, 7, numGeosets, opt.vertices, 3, 1);
+    writeFloatLists(out, 8, numGeosets, opt.vertices, 2, 1);
+
+    block = out.beginBlock(10, numGeosets);
+    for (unsigned g=0; g<numGeosets; ++g) {
+        out.u32(7);
+        out.u32(numStrips);
+        out.u32(g);
+        for (unsigned i=0; i<15; ++i)
+            out.i32(0);
+        out.i32(g % opt.geostates);
+        for (unsigned i=0; i<4; ++i)
+            out.i32(0);
+        out.u32(0xff);
+        out.i32(0);
+        out.i32(2);
+        for (unsigned i=0; i<6; ++i)
+            out.f32(0);
+        out.u32(0);
+        out.u32(0);
+    }
+    out.endBlock(block);
+
+    std::vector<Node> nodes = buildNodes(opt);
+    block = out.beginBlock(12, nodes.size());
+    for (unsigned n=0; n<nodes.size(); ++n)
+        writeNode(out, nodes[n], n);
+    out.endBlock(block);
+
+    if (!out.write(fileName)) return false;
+    printf("%s: %.1f MB, %u nodes, %u geosets\n", fileName, out.size() / 1048576.0,
+            (unsigned)nodes.size(), numGeosets);
+    return true;
+}
+
+static void usage(const char *argv0)
+{
+    printf("usage: %s [options] <out.pfb>\n", argv0);
+    printf("  -e be|le  byte order (default be)\n");
+    printf("  -g N      geodes (default 10000)\n");
+    printf("  -s N      geosets per geode (default 2)\n");
+    printf("  -v N      vertices per geoset (default 64)\n");
+    printf("  -p N      vertices per strip (default 8)\n");
+    printf("  -d N      levels of inner nodes (default 4)\n");
+    printf("  -l/-t/-c  percent of LOD/DCS/SCS inner nodes (default 10 each)\n");
+    printf("  -m N      geostates, materials and textures (default 8)\n");
+    printf("  -r N      random seed (default 1)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    Options opt;
+    opt.bigEndian       = true;
+    opt.geodes          = 10000;
+    opt.geosetsPerGeode = 2;
+    opt.vertices        = 64;
+    opt.stripLength     = 8;
+    opt.depth           = 4;
+    opt.lodPercent      = 10;
+    opt.dcsPercent      = 10;
+    opt.scsPercent      = 10;
+    opt.geostates       = 8;
+    opt.seed            = 1;
+
+    int c;
+    while ((c = getopt(argc, argv, "e:g:s:v:p:d:l:t:c:m:r:")) != -1) {
+        switch (c) {
+            case 'e': opt.bigEndian = (strcmp(optarg, "le") != 0); break;
+            case 'g': opt.geodes          = strtoul(optarg, NULL, 10); break;
+            case 's': opt.geosetsPerGeode = strtoul(optarg, NULL, 10); break;
+            case 'v': opt.vertices        = strtoul(optarg, NULL, 10); break;
+            case 'p': opt.stripLength     = strtoul(optarg, NULL, 10); break;
+            case 'd': opt.depth           = strtoul(optarg, NULL, 10); break;
+            case 'l': opt.lodPercent      = strtoul(optarg, NULL, 10); break;
+            case 't': opt.dcsPercent      = strtoul(optarg, NULL, 10); break;
+            case 'c': opt.scsPercent      = strtoul(optarg, NULL, 10); break;
+            case 'm': opt.geostates       = strtoul(optarg, NULL, 10); break;
+            case 'r': opt.seed            = strtoul(optarg, NULL, 10); break;
+            default:  usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc - 1 || opt.geostates == 0 || opt.stripLength < 3 || opt.vertices < 3 || opt.depth == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    return generate(opt, argv[optind]) ? 0 : 1;
+}
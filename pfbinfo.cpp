@@ -0,0 +1,36 @@
+#include "OpenPfb.h"
+
+// Print the table of contents of pfb files, without loading them.
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        printf("usage: %s <pfbfile> [<pfbfile> ...]\n", argv[0]);
+        return 1;
+    }
+
+    int ret = 0;
+    for (int i=1; i<argc; ++i)
+    {
+        openpfb::PfbFile file(argv[i]);
+        openpfb::PfbToc toc = file.scan();
+        if (file.loadFailed()) {
+            printf("%s: %s\n", argv[i], file.getError());
+            ret = 1;
+            continue;
+        }
+
+        printf("%s: %s-endian, %ld bytes, %u blocks%s\n", argv[i],
+                toc.bigEndian ? "big" : "little", toc.fileSize,
+                (unsigned)toc.blocks.size(), toc.complete ? "" : " (incomplete)");
+        printf("  %12s  %-14s %10s %12s %12s\n", "offset", "block", "count", "values", "bytes");
+        for (unsigned b=0; b<toc.blocks.size(); ++b) {
+            const openpfb::PfbBlockInfo &block = toc.blocks[b];
+            printf("  %12ld  %-14s %10u %12u %12ld\n", block.offset,
+                    openpfb::getBlockName(block.type), block.count,
+                    block.numValues, block.getSize());
+        }
+        if (!toc.complete) ret = 1;
+    }
+    return ret;
+}
@@ -0,0 +1,119 @@
+#include "OpenPfbWriter.h"
+#include "OpenPfbBswap.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Rewrite a pfb file in the form that loads fastest: in the byte order of
+// this machine (nothing to swap), nodes first, duplicate lists merged. The
+// blocks the loader skips are copied as is, or dropped on request.
+
+static bool isSkippedBlock(uint32_t type)
+{
+    return type == PFBBLOCK_TEXENVS || type == PFBBLOCK_TEXGENS ||
+        type == PFBBLOCK_LIGHTMODELS || type == PFBBLOCK_IMAGES;
+}
+
+static uint32_t swapWord(uint32_t w)
+{
+    return (w >> 24) | ((w >> 8) & 0xff00) | ((w << 8) & 0xff0000) | (w << 24);
+}
+
+static long fileSize(const char *name)
+{
+    struct stat st;
+    return (stat(name, &st) == 0) ? (long)st.st_size : -1;
+}
+
+static void usage(const char *argv0)
+{
+    printf("usage: %s [-e native|be|le] [-d] [-k] [-n] <in.pfb> <out.pfb>\n", argv0);
+    printf("  -e  byte order of the output (default native)\n");
+    printf("  -d  drop the blocks the loader skips (TexEnvs, TexGens, LightModels, Images)\n");
+    printf("  -k  keep duplicate lists\n");
+    printf("  -n  keep the nodes last\n");
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned flags = PFBWRITE_MERGE_LISTS | PFBWRITE_NODES_FIRST;
+    bool     drop  = false;
+
+    int c;
+    while ((c = getopt(argc, argv, "e:dkn")) != -1) {
+        switch (c) {
+            case 'e':
+                if (strcmp(optarg, "be") == 0)      flags |= PFBWRITE_BIGENDIAN;
+                else if (strcmp(optarg, "le") == 0) flags |= PFBWRITE_LITTLEENDIAN;
+                else if (strcmp(optarg, "native") != 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'd': drop = true; break;
+            case 'k': flags &= ~PFBWRITE_MERGE_LISTS; break;
+            case 'n': flags &= ~PFBWRITE_NODES_FIRST; break;
+            default:  usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc - 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *inName  = argv[optind];
+    const char *outName = argv[optind + 1];
+
+    openpfb::PfbFile file(inName, PFBLOAD_MMAP | PFBLOAD_NOBOUNDS);
+    openpfb::PfbToc toc = file.scan();
+    std::auto_ptr<openpfb::PfbTree> tree = file.load();
+    if (file.loadFailed()) {
+        printf("%s: %s\n", inName, file.getError());
+        return 1;
+    }
+
+    openpfb::PfbWriter writer(flags);
+
+    // The header words other than the magic are kept, in our byte order
+    openpfb::PfbHeader header = toc.header;
+    if (toc.bigEndian != openpfb::isNativeBigEndian()) {
+        header.unknown1 = swapWord(header.unknown1);
+        header.unknown2 = swapWord(header.unknown2);
+        header.unknown3 = swapWord(header.unknown3);
+    }
+    writer.setHeader(header);
+
+    // Skipped blocks can only be copied to a file of the same byte order:
+    // their layout is not known, they can't be swapped
+    unsigned copied = 0, dropped = 0;
+    FILE *in = fopen(inName, "rb");
+    for (unsigned b=0; b<toc.blocks.size(); ++b) {
+        const openpfb::PfbBlockInfo &block = toc.blocks[b];
+        if (!isSkippedBlock(block.type)) continue;
+        if (drop || toc.bigEndian != writer.isBigEndian() || !in) {
+            if (!drop) printf("%s: %s block dropped (byte order differs)\n", inName, openpfb::getBlockName(block.type));
+            dropped++;
+            continue;
+        }
+        std::vector<char> data(block.totalSize);
+        if (fseek(in, block.offset + 12, SEEK_SET) != 0 ||
+                (block.totalSize && fread(&data[0], 1, block.totalSize, in) != block.totalSize)) {
+            printf("%s: can't read %s block\n", inName, openpfb::getBlockName(block.type));
+            fclose(in);
+            return 1;
+        }
+        writer.addRawBlock(block.type, block.count, data.empty() ? NULL : &data[0], block.totalSize);
+        copied++;
+    }
+    if (in) fclose(in);
+
+    long inSize = fileSize(inName);
+    if (!writer.write(*tree, outName)) {
+        printf("%s: %s\n", outName, writer.getError());
+        return 1;
+    }
+
+    printf("%s -> %s: %ld -> %ld bytes, %s-endian, %u lists merged, %u blocks copied, %u dropped\n",
+            inName, outName, inSize, fileSize(outName), writer.isBigEndian() ? "big" : "little",
+            writer.getNumMergedLists(), copied, dropped);
+    return 0;
+}
@@ -1,5 +1,17 @@
 #include "OpenPfb.h"
+#include "OpenPfbCache.h"
+#include "OpenPfbMesh.h"
+#include "OpenPfbScene.h"
+#include "OpenPfbBvh.h"
+#include "OpenPfbLod.h"
+#include "OpenPfbWriter.h"
+#include "OpenPfbTrace.h"
+#include <algorithm>
+#include <cmath>
 #include <stack>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 // Test program
 
@@ -54,6 +66,20 @@ void testTree(openpfb::PfbTree *tree)
                         volatile openpfb::PfbVertexList &list = tree->getVertexList(geoset.lengthListId);
                         //fprintf(stderr, "Vertex: %d [%p]\n", list.getSize(), list.get(0));
                     }
+                    // The geoset bounds contain its vertices
+                    if (tree->haveBounds() && tree->haveVertexList()) {
+                        const openpfb::PfbBounds &bounds = tree->getGeoSetBounds(geode->getGeosets()[gs]);
+                        openpfb::PfbVertexList &list = tree->getVertexList(geoset.lengthListId);
+                        for (unsigned v = 0; v < list.getSize(); ++v) {
+                            const float *p = list.get(v);
+                            if (p[0] < bounds.box.min[0] || p[0] > bounds.box.max[0] ||
+                                p[1] < bounds.box.min[1] || p[1] > bounds.box.max[1] ||
+                                p[2] < bounds.box.min[2] || p[2] > bounds.box.max[2]) {
+                                fprintf(stderr, "ERROR! vertex out of the geoset bounds\n");
+                                break;
+                            }
+                        }
+                    }
                     if (tree->haveNormalList()) {
                         volatile openpfb::PfbNormalList &list = tree->getNormalList(geoset.lengthListId);
                         //fprintf(stderr, "Normals: %d [%p]\n", list.getSize(), list.get(0));
@@ -64,6 +90,37 @@ void testTree(openpfb::PfbTree *tree)
                     }
                 }
             }
+
+            // Interleaved vertices start with the vertex list positions
+            openpfb::PfbVertexBuffer buffer;
+            buffer.build(*tree, *geode, openpfb::PfbVertexLayout::packed(
+                        PFBATTRIB_BIT(PFBATTRIB_POSITION) | PFBATTRIB_BIT(PFBATTRIB_NORMAL) |
+                        PFBATTRIB_BIT(PFBATTRIB_TEXCOORD) | PFBATTRIB_BIT(PFBATTRIB_COLOR)));
+            for (unsigned gs = 0; gs < geode->getNumGeosets(); ++gs) {
+                openpfb::PfbGeoSet &geoset = tree->getGeoSet(geode->getGeosets()[gs]);
+                if (buffer.getNumVertices(gs) == 0 || !tree->haveVertexList()) continue;
+                const char *vertex = buffer.getData() + buffer.getFirstVertex(gs) * buffer.getLayout().stride;
+                if (memcmp(vertex, tree->getVertexList(geoset.lengthListId).get(0), 3 * sizeof(float)) != 0) {
+                    fprintf(stderr, "ERROR! wrong interleaved vertex (geoset %d)\n", geode->getGeosets()[gs]);
+                }
+            }
+
+            // Indexed triangles only reference merged vertices, also once
+            // optimized for the vertex cache
+            std::vector<openpfb::PfbIndexedMesh> meshes(geode->getNumGeosets());
+            if (!meshes.empty()) {
+                openpfb::buildIndexedMeshes(*tree, geode->getGeosets(), geode->getNumGeosets(),
+                        buffer.getLayout(), 0, &meshes[0]);
+                openpfb::optimizeMeshes(&meshes[0], meshes.size());
+            }
+            for (unsigned gs = 0; gs < meshes.size(); ++gs) {
+                for (unsigned i = 0; i < meshes[gs].getNumIndices(); ++i) {
+                    if (meshes[gs].getIndex(i) >= meshes[gs].getNumVertices()) {
+                        fprintf(stderr, "ERROR! bad index (geoset %d)\n", geode->getGeosets()[gs]);
+                        break;
+                    }
+                }
+            }
         }
         else if (pfbNode.asSCS())
         {
@@ -96,15 +153,211 @@ void testTree(openpfb::PfbTree *tree)
     }
 }
 
+/// Source reading a buffer through read() only, as a custom source does
+class BufferSource : public openpfb::PfbSource
+{
+    public:
+        BufferSource(const std::vector<char> &data) : data(data) {}
+
+        size_t read(void *dst, size_t size, uint64_t offset) {
+            if (offset >= data.size()) return 0;
+            if (size > data.size() - offset) size = data.size() - offset;
+            memcpy(dst, &data[offset], size);
+            return size;
+        }
+        uint64_t getSize() { return data.size(); }
+
+    private:
+        const std::vector<char> &data;
+};
+
+/// Counts what a file gives to a visitor, and checks the list chunks
+/// against the lists of the loaded tree
+class CheckingVisitor : public openpfb::PfbVisitor
+{
+    public:
+        CheckingVisitor(openpfb::PfbTree *tree) : tree(tree), numNodes(0), numGeosets(0), bad(false)
+        {
+            for (unsigned k=0; k<5; ++k) {
+                numLists[k] = 0;
+                numValues[k] = 0;
+                next[k] = 0;
+                listSize[k] = 0;
+            }
+        }
+
+        void onLengthList(uint32_t id, const openpfb::PfbListChunk<uint32_t,1> &chunk) {
+            check(0, id, chunk, id < tree->getNumLengthList() ? &tree->getLengthList(id) : NULL);
+        }
+        void onVertexList(uint32_t id, const openpfb::PfbListChunk<float,3> &chunk) {
+            check(1, id, chunk, id < tree->getNumVertexList() ? &tree->getVertexList(id) : NULL);
+        }
+        void onColorList(uint32_t id, const openpfb::PfbListChunk<float,4> &chunk) {
+            check(2, id, chunk, id < tree->getNumColorList() ? &tree->getColorList(id) : NULL);
+        }
+        void onNormalList(uint32_t id, const openpfb::PfbListChunk<float,3> &chunk) {
+            check(3, id, chunk, id < tree->getNumNormalList() ? &tree->getNormalList(id) : NULL);
+        }
+        void onTexcoordList(uint32_t id, const openpfb::PfbListChunk<float,2> &chunk) {
+            check(4, id, chunk, id < tree->getNumTexcoordList() ? &tree->getTexcoordList(id) : NULL);
+        }
+        void onGeoSet(uint32_t, const openpfb::PfbGeoSet &) { numGeosets++; }
+        void onNode(uint32_t, const openpfb::PfbNode &)     { numNodes++; }
+
+        /// True if every list was given whole, and was the one of the tree
+        bool isComplete() const {
+            for (unsigned k=0; k<5; ++k)
+                if (next[k] != listSize[k]) return false;
+            return !bad;
+        }
+
+        openpfb::PfbTree *tree;
+        uint32_t numNodes;
+        uint32_t numGeosets;
+        uint32_t numLists[5];  // by kind: length, vertex, color, normal, texcoord
+        uint64_t numValues[5];
+
+    private:
+        uint32_t next[5];      // first element expected in the next chunk
+        uint32_t listSize[5];
+        bool     bad;
+
+        template <typename T, unsigned N, class List>
+        void check(unsigned kind, uint32_t id, const openpfb::PfbListChunk<T,N> &chunk, List *list) {
+            if (chunk.first == 0) {
+                // A new list, the previous one is over
+                if (next[kind] != listSize[kind] || id != numLists[kind]) bad = true;
+                numLists[kind]++;
+                listSize[kind] = chunk.listSize;
+                next[kind]     = 0;
+            }
+            if (chunk.first != next[kind] || chunk.listSize != listSize[kind] ||
+                    chunk.first + chunk.count > chunk.listSize ||
+                    (chunk.count == 0 && chunk.listSize != 0) ||
+                    chunk.count * N * sizeof(T) > PFB_VISIT_CHUNK)
+                bad = true;
+            if (!list || list->getSize() != chunk.listSize ||
+                    (chunk.count && memcmp(list->get(chunk.first), chunk.data, chunk.count * N * sizeof(T)) != 0))
+                bad = true;
+            next[kind] += chunk.count;
+            numValues[kind] += chunk.count;
+        }
+};
+
+/// True if the geodes of both trees, in traversal order, put their
+/// vertices at the same places of the world (within a relative epsilon)
+bool sameWorldGeometry(openpfb::PfbTree *a, openpfb::PfbTree *b)
+{
+    openpfb::PfbTraversal ta, tb;
+    ta.build(*a);
+    tb.build(*b);
+    if (ta.getNumGeodes() != tb.getNumGeodes()) return false;
+    if (!a->haveVertexList() || !b->haveVertexList()) return a->haveVertexList() == b->haveVertexList();
+
+    std::vector<float> pa, pb;
+    for (uint32_t g=0; g<ta.getNumGeodes(); ++g) {
+        uint32_t ea = ta.getGeodeEntry(g), eb = tb.getGeodeEntry(g);
+        openpfb::PfbNodeGeode *ga = a->getNode(ta.getNode(ea)).asGeode();
+        openpfb::PfbNodeGeode *gb = b->getNode(tb.getNode(eb)).asGeode();
+        if (!ga || !gb || ga->getNumGeosets() != gb->getNumGeosets()) return false;
+
+        for (uint32_t gs=0; gs<ga->getNumGeosets(); ++gs) {
+            int32_t la = a->getGeoSet(ga->getGeosets()[gs]).lengthListId;
+            int32_t lb = b->getGeoSet(gb->getGeosets()[gs]).lengthListId;
+            bool hasA = la >= 0 && (uint32_t)la < a->getNumVertexList();
+            bool hasB = lb >= 0 && (uint32_t)lb < b->getNumVertexList();
+            if (hasA != hasB) return false;
+            if (!hasA) continue;
+            openpfb::PfbVertexList &va = a->getVertexList(la), &vb = b->getVertexList(lb);
+            if (va.getSize() != vb.getSize()) return false;
+            if (va.getSize() == 0) continue;
+
+            pa.resize(va.getSize() * 3);
+            pb.resize(vb.getSize() * 3);
+            openpfb::transformPoints(&pa[0], va.get(0), va.getSize(), ta.getWorldMatrix(ea));
+            openpfb::transformPoints(&pb[0], vb.get(0), vb.getSize(), tb.getWorldMatrix(eb));
+            for (size_t i=0; i<pa.size(); ++i)
+                if (fabs(pa[i] - pb[i]) > 1e-4 * (1 + fabs(pa[i]))) return false;
+        }
+    }
+    return true;
+}
+
+/// Number of LOD nodes whose children do not match their ranges
+unsigned countBadLods(openpfb::PfbTree *tree)
+{
+    unsigned bad = 0;
+    for (uint32_t i=0; i<tree->getNumNodes(); ++i) {
+        openpfb::PfbNodeLOD *lod = tree->getNode(i).asLOD();
+        if (lod && lod->getChilds().getNumChildren() > lod->getNumRanges()) bad++;
+    }
+    return bad;
+}
+
+template <class List>
+bool sameList(List &a, List &b)
+{
+    size_t bytes = (const char*)a.get(a.getSize()) - (const char*)a.get(0);
+    return a.getSize() == b.getSize() && (bytes == 0 || memcmp(a.get(0), b.get(0), bytes) == 0);
+}
+
+/// True if both trees have the same nodes, geosets and list contents
+bool sameContent(openpfb::PfbTree *a, openpfb::PfbTree *b)
+{
+    if (a->getNumNodes() != b->getNumNodes() || a->getNumGeosets() != b->getNumGeosets() ||
+            a->getNumLengthList() != b->getNumLengthList() || a->getNumVertexList() != b->getNumVertexList() ||
+            a->getNumColorList() != b->getNumColorList() || a->getNumNormalList() != b->getNumNormalList() ||
+            a->getNumTexcoordList() != b->getNumTexcoordList())
+        return false;
+    for (uint32_t i=0; i<a->getNumNodes(); ++i) {
+        if (a->getNode(i).getType() != b->getNode(i).getType()) return false;
+    }
+    for (uint32_t i=0; i<a->getNumGeosets(); ++i) {
+        if (a->getGeoSet(i).lengthListId != b->getGeoSet(i).lengthListId ||
+                a->getGeoSet(i).numStrip != b->getGeoSet(i).numStrip)
+            return false;
+    }
+    for (uint32_t i=0; i<a->getNumLengthList(); ++i)
+        if (!sameList(a->getLengthList(i), b->getLengthList(i))) return false;
+    for (uint32_t i=0; i<a->getNumVertexList(); ++i)
+        if (!sameList(a->getVertexList(i), b->getVertexList(i))) return false;
+    for (uint32_t i=0; i<a->getNumColorList(); ++i)
+        if (!sameList(a->getColorList(i), b->getColorList(i))) return false;
+    for (uint32_t i=0; i<a->getNumNormalList(); ++i)
+        if (!sameList(a->getNormalList(i), b->getNormalList(i))) return false;
+    for (uint32_t i=0; i<a->getNumTexcoordList(); ++i)
+        if (!sameList(a->getTexcoordList(i), b->getTexcoordList(i))) return false;
+    return true;
+}
+
 int main(int argc, char *argv[])
 {
     if (argc < 2) {
-        printf("usage: %s <pfbfile>\n", argv[0]);
+        printf("usage: %s <pfbfile> [<pfbfile> ...]\n", argv[0]);
         return 1;
     }
-    char *fileName = argv[1];
     //printf("OpenPfb version: %s\n", OpenPfb_GetVersion());
 
+    if (argc > 2) {
+        // Several files: load them concurrently
+        std::vector<std::string> names(argv + 1, argv + argc);
+        std::vector<openpfb::PfbLoadResult> results = openpfb::PfbFile::loadMany(names);
+        int ret = 0;
+        for (unsigned i=0; i<results.size(); ++i) {
+            if (results[i].tree == NULL) {
+                printf(SHELL_RED "Failure: '%s' [%s]\n" SHELL_END, results[i].name.c_str(), results[i].error);
+                ret = 1;
+            }
+            else {
+                testTree(results[i].tree);
+                printf(SHELL_GREEN "Success '%s'\n" SHELL_END, results[i].name.c_str());
+                delete results[i].tree;
+            }
+        }
+        return ret;
+    }
+
+    char *fileName = argv[1];
     openpfb::PfbFile pfbFile(fileName);
     std::auto_ptr<openpfb::PfbTree> tree = pfbFile.load();
     if (pfbFile.loadFailed()) {
@@ -113,6 +366,440 @@ int main(int argc, char *argv[])
     }
     else {
         testTree(tree.get());
+
+        // Every combination of load flags gives the same tree (lazy lists
+        // are read as they are compared)
+        for (unsigned flags=1; flags<=(PFBLOAD_MMAP | PFBLOAD_PARALLEL | PFBLOAD_LAZY | PFBLOAD_NOBOUNDS); ++flags) {
+            openpfb::PfbFile flagsFile(fileName, flags);
+            std::auto_ptr<openpfb::PfbTree> loaded = flagsFile.load();
+            if (flagsFile.loadFailed() || !sameContent(tree.get(), loaded.get())) {
+                fprintf(stderr, "ERROR! tree loaded with flags 0x%x differs\n", flags);
+                continue;
+            }
+            if (loaded->haveBounds() != !(flags & (PFBLOAD_NOBOUNDS | PFBLOAD_LAZY)))
+                fprintf(stderr, "ERROR! bounds of the tree loaded with flags 0x%x\n", flags);
+            testTree(loaded.get());
+        }
+
+        // The tree without its static transforms must still be valid
+        openpfb::PfbFlattenStats flatStats;
+        std::auto_ptr<openpfb::PfbTree> flat = openpfb::flattenTree(*tree, &flatStats);
+        testTree(flat.get());
+        if (countBadLods(flat.get()) > countBadLods(tree.get()))
+            fprintf(stderr, "ERROR! flattening changed the children of LOD nodes\n");
+
+        // and its baked geometry must stay in place
+        bool haveSCS = false;
+        for (uint32_t i=1; i<tree->getNumNodes() && !haveSCS; ++i)
+            haveSCS = tree->getNode(i).asSCS() != NULL;
+        if (haveSCS && flatStats.removedTransforms == 0)
+            fprintf(stderr, "ERROR! no transform flattened\n");
+        if (!sameWorldGeometry(tree.get(), flat.get()))
+            fprintf(stderr, "ERROR! flattening moved the geometry\n");
+
+        // Points transformed in place
+        float points[12] = { 1,2,3, 4,5,6, 7,8,9, 10,11,12 };
+        const float translate[16] = { 1,0,0,0, 0,1,0,0, 0,0,1,0, 10,20,30,1 };
+        openpfb::transformPoints(points, points, 4, translate);
+        for (unsigned i=0; i<12; ++i) {
+            if (points[i] != i + 1 + 10 * (i % 3 + 1)) {
+                fprintf(stderr, "ERROR! points transformed in place differ\n");
+                break;
+            }
+        }
+
+        // Every batched index stays in its buffer, and maps back to a geoset
+        openpfb::PfbDrawList drawList;
+        drawList.build(*flat);
+        for (uint32_t i=0; i<drawList.getNumItems(); ++i) {
+            const openpfb::PfbDrawItem &item = drawList.getItem(i);
+            const openpfb::PfbDrawBuffer &buffer = drawList.getBuffer(item.buffer);
+            for (uint32_t n=0; n<item.numIndices; ++n) {
+                if (buffer.indices[item.firstIndex + n] >= buffer.numVertices) {
+                    fprintf(stderr, "ERROR! bad batched index (item %d)\n", i);
+                    break;
+                }
+            }
+            for (uint32_t t=0; t<item.numIndices/3; ++t) {
+                const openpfb::PfbDrawSource *source = drawList.findSource(i, t);
+                if (!source || source->geoset >= flat->getNumGeosets()) {
+                    fprintf(stderr, "ERROR! bad batched source (item %d)\n", i);
+                    break;
+                }
+            }
+        }
+
+        // A query over the whole scene finds every geode of the hierarchy
+        openpfb::PfbBvh bvh;
+        bvh.build(*tree);
+        std::vector<uint32_t> geodes;
+        bvh.queryBox(bvh.getBounds(), geodes);
+        for (uint32_t i=0; i<bvh.getNumPrimitives(); ++i) {
+            if (!std::binary_search(geodes.begin(), geodes.end(), bvh.getPrimitiveNode(i))) {
+                fprintf(stderr, "ERROR! geode %d missing from the bvh query\n", bvh.getPrimitiveNode(i));
+                break;
+            }
+        }
+
+        // The node table mirrors the nodes
+        const openpfb::PfbNodeTable &table = tree->getNodeTable();
+        if (table.getNumNodes() != tree->getNumNodes())
+            fprintf(stderr, "ERROR! node table size\n");
+        for (uint32_t i=0; i<table.getNumNodes(); ++i) {
+            openpfb::PfbNodeHandle handle = table.getNode(i);
+            openpfb::PfbNode &node = tree->getNode(i);
+            const openpfb::PfbChilds *childs = node.asGroup() ? &node.asGroup()->getChilds() :
+                node.asSCS() ? &node.asSCS()->getChilds() : node.asDCS() ? &node.asDCS()->getChilds() :
+                node.asLOD() ? &node.asLOD()->getChilds() : NULL;
+            bool same = handle.getType() == node.getType() &&
+                handle.getNumChildren() == (childs ? childs->getNumChildren() : 0);
+            for (uint32_t c=0; same && c<handle.getNumChildren(); ++c)
+                same = handle.getChild(c).getId() == childs->getChild(c);
+            if (same && node.asGeode())
+                same = handle.getNumGeosets() == node.asGeode()->getNumGeosets();
+            if (!same) {
+                fprintf(stderr, "ERROR! node table differs (node %d)\n", i);
+                break;
+            }
+        }
+
+        // Traversal entries lie in the subtree of their parent, one level below
+        openpfb::PfbTraversal traversal;
+        traversal.build(*tree);
+        for (uint32_t i=1; i<traversal.getNumEntries(); ++i) {
+            int32_t parent = traversal.getParent(i);
+            if (parent < 0 || (uint32_t)parent >= i || traversal.getSubtreeEnd(parent) <= i ||
+                    traversal.getDepth(i) != traversal.getDepth(parent) + 1) {
+                fprintf(stderr, "ERROR! bad traversal entry %d\n", i);
+                break;
+            }
+        }
+
+        // LOD selection: away from everything, only the LODs with no LOD
+        // above (first in the selector, in traversal order) are evaluated
+        openpfb::PfbLodSelector lods;
+        lods.build(*tree);
+        std::vector<uint32_t> topLods; // their traversal entries
+        for (uint32_t i=0; i<traversal.getNumEntries(); ++i) {
+            if (!tree->getNode(traversal.getNode(i)).asLOD()) continue;
+            bool nested = false;
+            for (int32_t p=traversal.getParent(i); p >= 0 && !nested; p=traversal.getParent(p))
+                nested = tree->getNode(traversal.getNode(p)).asLOD() != NULL;
+            if (!nested) topLods.push_back(i);
+        }
+        const float away[3] = { 1e9f, 1e9f, 1e9f };
+        lods.select(away, 1);
+        if (lods.getNumEvaluated() != topLods.size())
+            fprintf(stderr, "ERROR! %u LODs evaluated, %u expected\n", lods.getNumEvaluated(), (unsigned)topLods.size());
+        for (uint32_t i=0; i<lods.getNumLods(); ++i) {
+            if (lods.getActiveChild(i) != -1) {
+                fprintf(stderr, "ERROR! LOD %d active away from everything\n", lods.getNode(i));
+                break;
+            }
+        }
+
+        // A viewpoint in the range of child 0 activates it; past the range,
+        // hysteresis keeps it; near the end of the range, child 1 fades in
+        for (uint32_t k=0; k<topLods.size(); ++k) {
+            uint32_t node = traversal.getNode(topLods[k]);
+            if (k >= lods.getNumLods() || lods.getNode(k) != node) {
+                fprintf(stderr, "ERROR! LOD entries out of order\n");
+                break;
+            }
+            openpfb::PfbNodeLOD *lod = tree->getNode(node).asLOD();
+            if (std::min(lod->getNumRanges(), lod->getChilds().getNumChildren()) < 2) continue;
+            float r0 = std::max(*lod->getRanges(0), 0.0f), r1 = *lod->getRanges(1), r2 = *lod->getRanges(2);
+            if (!(r0 < r1 && r1 * 1.1f < r2)) continue;
+
+            float center[3];
+            openpfb::transformPoints(center, lod->getCenter(), 1, traversal.getWorldMatrix(topLods[k]));
+            float eye[3] = { center[0] + (r0 + r1) / 2, center[1], center[2] };
+            lods.select(eye, 1);
+            bool ok = lods.getActiveChild(k) == 0;
+
+            eye[0] = center[0] + r1 * 1.05f;
+            lods.setHysteresis(0.1f);
+            lods.select(eye, 1);
+            ok = ok && lods.getActiveChild(k) == 0;
+            lods.setHysteresis(0);
+            lods.select(eye, 1);
+            ok = ok && lods.getActiveChild(k) == 1;
+
+            float fade = (r1 - r0) / 2;
+            lods.setFadeRange(fade);
+            eye[0] = center[0] + r1 - fade / 2;
+            lods.select(eye, 1);
+            ok = ok && lods.getActiveChild(k) == 0 && lods.getBlendChild(k) == 1 &&
+                fabs(lods.getBlend(k) - 0.5f) < 0.01f;
+            eye[0] = center[0] + r1 - fade * 1.5f;
+            lods.select(eye, 1);
+            ok = ok && lods.getActiveChild(k) == 0 && lods.getBlendChild(k) == -1 && lods.getBlend(k) == 0;
+            lods.setFadeRange(0);
+
+            if (!ok) fprintf(stderr, "ERROR! bad selection of LOD %d\n", node);
+            break;
+        }
+
+        // Written back, swapped and with its lists merged, the tree loads again
+        std::string written = std::string(fileName) + ".written";
+        openpfb::PfbWriter writer(PFBWRITE_BIGENDIAN | PFBWRITE_MERGE_LISTS | PFBWRITE_NODES_FIRST);
+        if (!writer.write(*tree, written)) {
+            fprintf(stderr, "ERROR! can't write '%s' [%s]\n", written.c_str(), writer.getError());
+        }
+        else {
+            openpfb::PfbFile writtenFile(written);
+            std::auto_ptr<openpfb::PfbTree> reloaded = writtenFile.load();
+            unlink(written.c_str());
+            if (!reloaded.get() || reloaded->getNumNodes() != tree->getNumNodes() ||
+                    reloaded->getNumGeosets() != tree->getNumGeosets()) {
+                fprintf(stderr, "ERROR! written tree differs\n");
+            }
+            else if (tree->haveVertexList()) {
+                for (uint32_t i=0; i<tree->getNumGeosets(); ++i) {
+                    int32_t id = tree->getGeoSet(i).lengthListId;
+                    if (id < 0 || (uint32_t)id >= tree->getNumVertexList()) continue;
+                    openpfb::PfbVertexList &a = tree->getVertexList(id);
+                    openpfb::PfbVertexList &b = reloaded->getVertexList(reloaded->getGeoSet(i).lengthListId);
+                    if (a.getSize() != b.getSize() ||
+                            (a.getSize() && memcmp(a.get(0), b.get(0), a.getSize() * 3 * sizeof(float)) != 0)) {
+                        fprintf(stderr, "ERROR! written vertex list differs (geoset %d)\n", i);
+                        break;
+                    }
+                }
+            }
+        }
+
+        // Repacked as pfbrepack does (native, nodes first), the lists of a
+        // mapped load are used in place: nothing of them is allocated
+        std::string repacked = std::string(fileName) + ".repacked";
+        openpfb::PfbWriter repacker(PFBWRITE_MERGE_LISTS | PFBWRITE_NODES_FIRST);
+        if (!repacker.write(*tree, repacked)) {
+            fprintf(stderr, "ERROR! can't write '%s' [%s]\n", repacked.c_str(), repacker.getError());
+        }
+        else {
+            openpfb::PfbLoadStats copiedStats, mappedStats;
+            openpfb::PfbFile copiedFile(repacked, PFBLOAD_NOBOUNDS);
+            openpfb::PfbFile mappedFile(repacked, PFBLOAD_MMAP | PFBLOAD_NOBOUNDS);
+            copiedFile.setStats(&copiedStats);
+            mappedFile.setStats(&mappedStats);
+            std::auto_ptr<openpfb::PfbTree> copied = copiedFile.load();
+            std::auto_ptr<openpfb::PfbTree> mapped = mappedFile.load();
+            unlink(repacked.c_str());
+
+            uint64_t listBytes = 0;
+            for (uint32_t i=0; mapped.get() && i<mapped->getNumLengthList(); ++i)
+                listBytes += mapped->getLengthList(i).getSize() * 4;
+            for (uint32_t i=0; mapped.get() && i<mapped->getNumVertexList(); ++i)
+                listBytes += mapped->getVertexList(i).getSize() * 12;
+            for (uint32_t i=0; mapped.get() && i<mapped->getNumColorList(); ++i)
+                listBytes += mapped->getColorList(i).getSize() * 16;
+            for (uint32_t i=0; mapped.get() && i<mapped->getNumNormalList(); ++i)
+                listBytes += mapped->getNormalList(i).getSize() * 12;
+            for (uint32_t i=0; mapped.get() && i<mapped->getNumTexcoordList(); ++i)
+                listBytes += mapped->getTexcoordList(i).getSize() * 8;
+            if (mappedFile.loadFailed() || copiedFile.loadFailed() ||
+                    mappedStats.allocatedBytes + listBytes > copiedStats.allocatedBytes)
+                fprintf(stderr, "ERROR! lists of the repacked file were copied\n");
+        }
+
+        // The stats of a parallel load count the elements of the tree, its
+        // trace holds the load and its blocks
+        std::string traced = std::string(fileName) + ".trace.json";
+        openpfb::startTrace(traced.c_str());
+        openpfb::PfbLoadStats stats;
+        openpfb::PfbFile statsFile(fileName, PFBLOAD_PARALLEL | PFBLOAD_NOBOUNDS);
+        statsFile.setStats(&stats);
+        std::auto_ptr<openpfb::PfbTree> counted = statsFile.load();
+        openpfb::stopTrace();
+        if (statsFile.loadFailed() || stats.fileSize == 0 ||
+                stats.blocks[PFBBLOCK_NODES].count != tree->getNumNodes() ||
+                stats.blocks[PFBBLOCK_GEOSETS].count != tree->getNumGeosets()) {
+            fprintf(stderr, "ERROR! load stats differ from the tree\n");
+        }
+        if (!stats.parallel)
+            fprintf(stderr, "ERROR! parallel load fell back to sequential\n");
+        FILE *trace = fopen(traced.c_str(), "r");
+        if (trace) {
+            std::string json;
+            char buffer[4096];
+            size_t n;
+            while ((n = fread(buffer, 1, sizeof(buffer), trace)) > 0) json.append(buffer, n);
+            fclose(trace);
+            if (json.find("\"name\":\"load\"") == std::string::npos ||
+                    json.find("\"name\":\"Nodes\"") == std::string::npos ||
+                    json.compare(json.size() - 2, 2, "}\n") != 0)
+                fprintf(stderr, "ERROR! incomplete trace\n");
+        }
+        else fprintf(stderr, "ERROR! no trace written\n");
+
+        // Tracing does not change the reads and seeks of a load
+        openpfb::PfbLoadStats untracedStats, tracedStats;
+        openpfb::PfbFile untracedFile(fileName, PFBLOAD_NOBOUNDS);
+        untracedFile.setStats(&untracedStats);
+        untracedFile.load();
+        openpfb::startTrace(traced.c_str());
+        openpfb::PfbFile tracedFile(fileName, PFBLOAD_NOBOUNDS);
+        tracedFile.setStats(&tracedStats);
+        tracedFile.load();
+        openpfb::stopTrace();
+        if (tracedStats.numSeeks != untracedStats.numSeeks || tracedStats.numReads != untracedStats.numReads)
+            fprintf(stderr, "ERROR! tracing changed the reads or seeks of the load\n");
+        unlink(traced.c_str());
+
+        // The same tree loads from the file content in memory, and from
+        // the file descriptor
+        std::vector<char> content;
+        FILE *in = fopen(fileName, "rb");
+        if (in) {
+            char buffer[4096];
+            size_t n;
+            while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0) content.insert(content.end(), buffer, buffer + n);
+            fclose(in);
+        }
+        int fd = open(fileName, O_RDONLY);
+        if (!content.empty() && fd >= 0) {
+            openpfb::PfbMemorySource memory(&content[0], content.size());
+            openpfb::PfbFdSource     descriptor(fd);
+            openpfb::PfbSource *sources[2] = { &memory, &descriptor };
+            for (unsigned i=0; i<2; ++i) {
+                openpfb::PfbFile sourceFile(*sources[i], PFBLOAD_PARALLEL);
+                std::auto_ptr<openpfb::PfbTree> loaded = sourceFile.load();
+                if (sourceFile.loadFailed() || loaded->getNumNodes() != tree->getNumNodes() ||
+                        loaded->getNumGeosets() != tree->getNumGeosets() ||
+                        loaded->getNumVertexList() != tree->getNumVertexList()) {
+                    fprintf(stderr, "ERROR! tree loaded from source %u differs\n", i);
+                }
+            }
+        }
+        else fprintf(stderr, "ERROR! can't read '%s'\n", fileName);
+        if (fd >= 0) close(fd);
+
+        // A visit gives what a load builds, lists in contiguous chunks
+        CheckingVisitor visitor(tree.get());
+        openpfb::PfbFile visitedFile(fileName);
+        if (!visitedFile.visit(visitor))
+            fprintf(stderr, "ERROR! can't visit '%s' [%s]\n", fileName, visitedFile.getError());
+        else {
+            uint32_t numLists[5] = { tree->getNumLengthList(), tree->getNumVertexList(), tree->getNumColorList(),
+                tree->getNumNormalList(), tree->getNumTexcoordList() };
+            uint64_t numValues[5] = { 0, 0, 0, 0, 0 };
+            for (uint32_t i=0; i<numLists[0]; ++i) numValues[0] += tree->getLengthList(i).getSize();
+            for (uint32_t i=0; i<numLists[1]; ++i) numValues[1] += tree->getVertexList(i).getSize();
+            for (uint32_t i=0; i<numLists[2]; ++i) numValues[2] += tree->getColorList(i).getSize();
+            for (uint32_t i=0; i<numLists[3]; ++i) numValues[3] += tree->getNormalList(i).getSize();
+            for (uint32_t i=0; i<numLists[4]; ++i) numValues[4] += tree->getTexcoordList(i).getSize();
+            bool same = visitor.isComplete() && visitor.numNodes == tree->getNumNodes() &&
+                visitor.numGeosets == tree->getNumGeosets();
+            for (unsigned k=0; k<5; ++k)
+                same = same && visitor.numLists[k] == numLists[k] && visitor.numValues[k] == numValues[k];
+            if (!same)
+                fprintf(stderr, "ERROR! visited content differs from the tree\n");
+        }
+
+        // The table of contents covers the whole file, in its byte order
+        openpfb::PfbFile scannedFile(fileName);
+        openpfb::PfbToc toc = scannedFile.scan();
+        long covered = sizeof(openpfb::PfbHeader);
+        uint32_t numNodes = 0, numGeosets = 0;
+        for (unsigned i=0; i<toc.blocks.size(); ++i) {
+            if (toc.blocks[i].offset != covered) break;
+            covered += toc.blocks[i].getSize();
+            if (toc.blocks[i].type == PFBBLOCK_NODES)   numNodes   += toc.blocks[i].count;
+            if (toc.blocks[i].type == PFBBLOCK_GEOSETS) numGeosets += toc.blocks[i].count;
+        }
+        if (!toc.complete || covered != toc.fileSize || toc.fileSize != (long)content.size())
+            fprintf(stderr, "ERROR! blocks of the table of contents don't cover the file\n");
+        if (numNodes != tree->getNumNodes() || numGeosets != tree->getNumGeosets())
+            fprintf(stderr, "ERROR! table of contents differs from the tree\n");
+        if (!content.empty() && toc.bigEndian != ((unsigned char)content[0] == 0xdb))
+            fprintf(stderr, "ERROR! byte order of the table of contents\n");
+
+        // A last nodes block whose size is not a byte count (as in some
+        // exporters) is still scanned, and loaded in parallel
+        if (!toc.blocks.empty() && toc.blocks.back().type == PFBBLOCK_NODES) {
+            std::vector<char> odd(content);
+            const unsigned char size[4] = { 0, 0, 1, 13 }; // 269
+            for (unsigned i=0; i<4; ++i)
+                odd[toc.blocks.back().offset + 8 + i] = size[toc.bigEndian ? i : 3 - i];
+            BufferSource oddSource(odd);
+            openpfb::PfbFile oddFile(oddSource, PFBLOAD_PARALLEL | PFBLOAD_NOBOUNDS);
+            openpfb::PfbLoadStats oddStats;
+            oddFile.setStats(&oddStats);
+            std::auto_ptr<openpfb::PfbTree> oddTree = oddFile.load();
+            if (oddFile.loadFailed() || !oddStats.parallel || !sameContent(tree.get(), oddTree.get()))
+                fprintf(stderr, "ERROR! nodes block of another size not loaded in parallel\n");
+            openpfb::PfbFile oddScanned(oddSource);
+            if (!oddScanned.scan().complete)
+                fprintf(stderr, "ERROR! nodes block of another size not scanned\n");
+        }
+
+        // The second loadCached() maps the cache, whose tree is the one of the
+        // source; the cache is outdated by a new modification time, a
+        // content change (with PFBCACHE_VERIFY_CONTENT) or a truncation
+        std::string cachedSource = std::string(fileName) + ".cached.pfb";
+        FILE *copy = fopen(cachedSource.c_str(), "wb");
+        if (copy && !content.empty() && fwrite(&content[0], 1, content.size(), copy) == content.size() &&
+                fclose(copy) == 0) {
+            openpfb::PfbCache cache(cachedSource);
+            openpfb::PfbCache verifiedCache(cachedSource, cache.getCacheName(), PFBCACHE_VERIFY_CONTENT);
+            std::auto_ptr<openpfb::PfbTree> first = cache.loadCached();
+            if (!first.get() || !cache.isValid())
+                fprintf(stderr, "ERROR! cache not written [%s]\n", cache.getError());
+            std::auto_ptr<openpfb::PfbTree> second = cache.loadCached();
+            bool mapped = second.get() && sameContent(tree.get(), second.get());
+            for (uint32_t i=0; mapped && i<second->getNumVertexList(); ++i)
+                mapped = second->getVertexList(i).getSize() == 0 || second->getVertexList(i).isAttached();
+            if (!mapped)
+                fprintf(stderr, "ERROR! cached tree differs from the source\n");
+
+            struct stat st;
+            stat(cachedSource.c_str(), &st);
+            struct timespec times[2] = { st.st_atim, st.st_mtim };
+            times[1].tv_sec += 10;
+            utimensat(AT_FDCWD, cachedSource.c_str(), times, 0);
+            if (cache.isValid())
+                fprintf(stderr, "ERROR! cache valid after its source was touched\n");
+
+            cache.loadCached();
+            stat(cachedSource.c_str(), &st);
+            int changed = open(cachedSource.c_str(), O_WRONLY);
+            char byte = ~content[content.size() / 2];
+            if (changed < 0 || pwrite(changed, &byte, 1, content.size() / 2) != 1)
+                fprintf(stderr, "ERROR! can't change '%s'\n", cachedSource.c_str());
+            if (changed >= 0) close(changed);
+            times[0] = st.st_atim;
+            times[1] = st.st_mtim;
+            utimensat(AT_FDCWD, cachedSource.c_str(), times, 0);
+            if (verifiedCache.isValid())
+                fprintf(stderr, "ERROR! cache valid after its source was rewritten\n");
+
+            verifiedCache.loadCached();
+            if (!verifiedCache.isValid() ||
+                    truncate(cache.getCacheName().c_str(), 64) != 0 ||
+                    cache.isValid() || cache.load().get())
+                fprintf(stderr, "ERROR! truncated cache accepted\n");
+            unlink(cache.getCacheName().c_str());
+        }
+        else fprintf(stderr, "ERROR! can't write '%s'\n", cachedSource.c_str());
+        unlink(cachedSource.c_str());
+
+        // A lazy list whose size goes past the end of the data is left
+        // empty, and accessing it again does not wait for it
+        for (unsigned i=0; i<toc.blocks.size(); ++i) {
+            if (toc.blocks[i].type != PFBBLOCK_VERTEXLISTS || toc.blocks[i].count == 0) continue;
+            BufferSource buffer(content);
+            openpfb::PfbFile lazyFile(buffer, PFBLOAD_LAZY);
+            std::auto_ptr<openpfb::PfbTree> lazyTree = lazyFile.load();
+            if (lazyFile.loadFailed()) {
+                fprintf(stderr, "ERROR! can't load '%s' lazily [%s]\n", fileName, lazyFile.getError());
+                break;
+            }
+            memset(&content[toc.blocks[i].offset + 12], 0xff, 4);
+            if (lazyTree->getVertexList(0).getSize() != 0 || lazyTree->getVertexList(0).getSize() != 0)
+                fprintf(stderr, "ERROR! lazy list past the end of the data\n");
+            break;
+        }
+
         printf(SHELL_GREEN "Success '%s'\n" SHELL_END, fileName);
         return 0;
     }